@@ -1,15 +1,33 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <string>
 
 #include "esphome.h"
 #include "esphome/core/log.h"
 #include "navien.h"
+#include "navien_hal.h"
+
+#ifdef USE_ESP32
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
 
 namespace esphome {
 namespace navien {
 
   static const char *TAG = "navien.sensor";
 
+// The raw packet fields go out every packet. In the protocol task they would go through
+// the logger (and the API log forwarding) from outside the main loop, there they are verbose.
+#define NAVIEN_LOG_PACKET(task, format, ...)                                  \
+  do {                                                                        \
+    if (task)                                                                 \
+      ESP_LOGV(TAG, format, ##__VA_ARGS__);                                   \
+    else                                                                      \
+      ESP_LOGD(TAG, format, ##__VA_ARGS__);                                   \
+  } while (0)
+
 namespace {
 class NavienEspUartAdapter : public NavienUartI {
  public:
@@ -29,14 +47,35 @@ class NavienEspUartAdapter : public NavienUartI {
   }
   void write_array(const uint8_t *data, uint8_t len) override {
     if (!uart_) return;
+    uint32_t now = micros();
+    // The line is busy until the bytes already in the FIFO are out
+    if ((int32_t) (tx_done_us_ - now) < 0) tx_done_us_ = now;
+    tx_done_us_ += len * NavienLink::BYTE_TIME_US;
     uart_->write_array(data, len);
   }
+  int available_for_write() override {
+    // The UART has no way to tell, estimate the FIFO fill from what we wrote and
+    // how long it takes to go out at 19200 baud
+    int32_t left_us = (int32_t) (tx_done_us_ - micros());
+    if (left_us <= 0) return TX_FIFO_SIZE;
+    int queued = (left_us + NavienLink::BYTE_TIME_US - 1) / NavienLink::BYTE_TIME_US;
+    return queued < TX_FIFO_SIZE ? TX_FIFO_SIZE - queued : 0;
+  }
 
  private:
+  // Hardware TX FIFO of the ESP8266 and ESP32 UARTs
+  static const int TX_FIFO_SIZE = 128;
+
   esphome::uart::UARTComponent *uart_ = nullptr;
+  uint32_t tx_done_us_ = 0;
 };
 
 NavienEspUartAdapter global_uart_adapter;
+
+#ifdef NAVIEN_RECORDER_SIZE
+// Ring of NavienFrameRecorder, static like the UART adapter, nothing is allocated for it
+uint8_t recorder_buffer[NAVIEN_RECORDER_SIZE];
+#endif
 }  // namespace
 
 NavienBase::NavienBase() : navien_link_(nullptr), uart_(nullptr), src_(0), is_rt(false) {}
@@ -50,6 +89,12 @@ void NavienBase::setup() {
   navien_link_ = NavienLink::get_instance(&global_uart_adapter);
   if (navien_link_ != nullptr) {
     navien_link_->add_visitor(this, src_);
+    if (idle_timeout_ms_.has_value()) {
+      navien_link_->set_idle_timeout_us(*idle_timeout_ms_ * 1000);
+    }
+    if (rx_threshold_.has_value()) {
+      navien_link_->set_rx_threshold(*rx_threshold_);
+    }
   } else {
     ESP_LOGE(TAG, "Failed to acquire NavienLink singleton");
   }
@@ -58,6 +103,19 @@ void NavienBase::setup() {
   // NavienBase implementation
 // NavienLinkEsp removed. set_link now uses NavienLink.
 
+void NavienBase::add_metric(NAVIEN_METRIC_ID id, NAVIEN_METRIC_KIND kind, void * entity) {
+  if (NavienMetrics::def(id).kind != kind){
+    ESP_LOGE(TAG, "Metric %d can't be shown by an entity of kind %d", id, kind);
+    return;
+  }
+  if (!NavienMetrics::built(id)){
+    ESP_LOGE(TAG, "Metric %d isn't in NAVIEN_METRIC_MASK", id);
+    return;
+  }
+  if (this->metrics.add(id, entity) == nullptr)
+    ESP_LOGE(TAG, "No room for metric %d, %d metrics configured", id, NAVIEN_MAX_METRICS);
+}
+
 void NavienBase::send_turn_on_cmd() {
   if (navien_link_) navien_link_->send_turn_on_cmd();
 }
@@ -68,7 +126,10 @@ void NavienBase::send_hot_button_cmd() {
   if (navien_link_) navien_link_->send_hot_button_cmd();
 }
 void NavienBase::send_dhw_set_temp_cmd(float temp) {
-  if (navien_link_) navien_link_->send_dhw_set_temp_cmd(temp);
+  this->send_dhw_set_temp_cmd(temp, CELSIUS);
+}
+void NavienBase::send_dhw_set_temp_cmd(float temp, DEVICE_UNITS units) {
+  if (navien_link_) navien_link_->send_dhw_set_temp_raw_cmd(NavienDecoder::temp_to_raw(temp, units));
 }
 void NavienBase::send_scheduled_recirculation_on_cmd() {
   if (navien_link_) navien_link_->send_scheduled_recirculation_on_cmd();
@@ -81,14 +142,59 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
   void Navien::setup() {
     NavienBase::setup();
     this->state.power = POWER_OFF;
+    this->task_state.power = POWER_OFF;
+
+#ifdef NAVIEN_RECORDER_SIZE
+    // Before the protocol task starts calling receive()
+    if (this->src_ == 0 && this->navien_link_ != nullptr){
+      recorder_.begin(recorder_buffer, sizeof(recorder_buffer));
+      this->navien_link_->set_recorder(&recorder_);
+    }
+#endif
+
+#ifdef USE_ESP32
+    this->protocol_task_ = protocol_task_enabled_;
+    if (this->protocol_task_ && this->src_ == 0 && this->navien_link_ != nullptr){
+      // The main loop runs on one core, take the other one if there is one
+      BaseType_t core = portNUM_PROCESSORS > 1 ? 1 - xPortGetCoreID() : 0;
+      if (xTaskCreatePinnedToCore(Navien::protocol_task, "navien", PROTOCOL_TASK_STACK, this,
+                                  PROTOCOL_TASK_PRIORITY, nullptr, core) == pdPASS){
+        protocol_task_running_ = true;
+        ESP_LOGI(TAG, "Protocol task running on core %d", (int) core);
+      }else{
+        // Decoding still goes through the snapshot, receive() is called from loop()
+        ESP_LOGE(TAG, "Failed to start the protocol task, staying in the main loop");
+      }
+    }
+#endif
   }
 
-  void Navien::on_water(const WATER_DATA & water, uint8_t src){
-    if (src != PACKET_SRC_STATUS + this->src_) {
-      return;
+  void Navien::protocol_task(void * navien){
+#ifdef USE_ESP32
+    Navien * self = static_cast<Navien *>(navien);
+    NavienLink * navien_link = self->navien_link_;
+    // Below a tick (CONFIG_FREERTOS_HZ under 1000) pdMS_TO_TICKS() gives 0, which would
+    // only yield to tasks of the same priority
+    const TickType_t poll = std::max<TickType_t>(pdMS_TO_TICKS(PROTOCOL_TASK_POLL_MS), 1);
+    uint32_t counters_ms = millis();
+    for (;;){
+      navien_link->receive();
+      if (millis() - counters_ms >= PROTOCOL_TASK_COUNTERS_MS){
+        counters_ms = millis();
+        self->link_counters.write(navien_link_counters(*navien_link));
+      }
+      // receive() returns at once until a whole packet is in
+      vTaskDelay(poll);
     }
+#endif
+  }
+
+  void Navien::on_water(const HEADER & hdr, const WATER_DATA & water){
+    // NavienLink only routes packets of our own cascade unit (PACKET_SRC_STATUS + src_) here
+    uint8_t src = hdr.src;
+    NAVIEN_STATE & state = this->decoded();
 
-    ESP_LOGD(TAG, "SRC:0x%02X Received Temp: 0x%02X, Inlet: 0x%02X, Outlet: 0x%02X, Flow: 0x%02X, Sys Power: 0x%02X, Sys Status: 0x%02X, Recirc Enabled: 0x%02X, "
+    NAVIEN_LOG_PACKET(this->protocol_task_, "SRC:0x%02X Received Temp: 0x%02X, Inlet: 0x%02X, Outlet: 0x%02X, Flow: 0x%02X, Sys Power: 0x%02X, Sys Status: 0x%02X, Recirc Enabled: 0x%02X, "
                   "Err Code:0x%02X 0x%02X, Err Lvl:0x%02X",
              src,
              water.dhw_set_temp,
@@ -101,69 +207,32 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
              water.error_code_hi,
              water.error_code_lo,
              water.error_level);
+    ESP_LOGV(TAG, "SRC:0x%02X Water packet received %u..%u us",
+             src,
+             (unsigned) navien_link_->get_frame_time().first_byte_us,
+             (unsigned) navien_link_->get_frame_time().last_byte_us);
 
-    if (water.system_power & POWER_STATUS_ON_OFF_MASK){
-      state.power = POWER_ON;
-    }else{
-      state.power = POWER_OFF;
-    }
+    uint32_t start = navien_cycles();
+    NavienDecoder::decode_water(hdr, water, state);
+    this->decode_cycles += navien_cycles() - start;
+    this->decoded_cnt++;
 
-    if (this->state.device_type == NCB_H) {
-      // NCB_H units don't seem to report their recirculation setting in the packets
-      /* TODO this might also be true of other device types that use packet type 0x06, 
-         see comment by recirc_running below */
-      state.recirculation = RECIRC_UNKNOWN;
-    }else if (water.system_status & SYS_STATUS_FLAG_RECIRC_INT_SCHEDULED){
-      state.recirculation = RECIRC_INT_SCHEDULED;
-    }else if (water.system_status & SYS_STATUS_FLAG_RECIRC_EXT_SCHEDULED){
-      state.recirculation = RECIRC_EXT_SCHEDULED;
-    }else if (state.hotbutton_mode_enabled){
-      // hotbutton_mode_enabled actually comes from gas packets
-      state.recirculation = RECIRC_EXT_HOTBUTTON;
-    }else{
-      state.recirculation = RECIRC_OFF;
+    if (this->protocol_task_){
+      this->hand_over(FRAME_EVENT_WATER, hdr);
+      return;
     }
-    
-    state.heating_mode = static_cast<DEVICE_HEATING_MODE>(water.heating_mode);
-
-    state.operating_state = static_cast<OPERATING_STATE>(water.operating_state);
     // Update the counter that will be used in assessment
     // of whether we're connected to navien or not
     this->received_cnt++;
-    this->state.water.boiler_active = water.boiler_active & 0x01;
-    this->state.water.dhw_set_temp = NavienLink::t2c(water.dhw_set_temp);
-    this->state.water.outlet_temp = NavienLink::t2c(water.outlet_temp);
-    this->state.water.inlet_temp = NavienLink::t2c(water.inlet_temp);
-    this->state.water.flow_lpm = NavienLink::flow2lpm(water.water_flow);
-    this->state.water.utilization = water.operating_capacity * 0.5f;
-    // Recirculation running detection varies by device type
-    /* TODO detecting this by the second byte of the header might be better, since it's
-       0x05 on NPE and 0x06 on NCB_H, and who knows what on other device types, but for now
-       this is a less invasive code change since the header isn't available here yet */
-    if (this->state.device_type == NCB_H) {
-        // NCB_H units: pump running indicated by system_power bit 5
-        this->state.water.recirc_running = water.system_power & RECIRCULATION_ON_OFF_MASK;
-    } else {
-        // NPE and other units: scheduled (heating_mode 0x08) or hotbutton (byte 33 bit 0)
-        this->state.water.recirc_running =
-            (water.heating_mode & HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING) ||
-            (water.recirculation_enabled & RECIRC_STATUS_FLAG_HOTBUTTON_ON);
-    }
-    this->state.water.scheduled_recirc_allowed = water.recirculation_enabled & RECIRC_STATUS_FLAG_SCHEDULED_ON;
-
-    this->state.water.error_code = water.error_code_hi << 8 | water.error_code_lo;
-    this->state.water.error_level = water.error_level;
-
     if (this->is_rt)
       this->update_water_sensors();
   }
 
-  void Navien::on_gas(const GAS_DATA & gas, uint8_t src){
-    if (src != PACKET_SRC_STATUS + this->src_) {
-      return;
-    }
+  void Navien::on_gas(const HEADER & hdr, const GAS_DATA & gas){
+    uint8_t src = hdr.src;
+    NAVIEN_STATE & state = this->decoded();
 
-    ESP_LOGD(TAG, "SRC:0x%02X Received Gas DHW Temp: 0x%02X, Inlet: 0x%02X, Outlet: 0x%02X, SH Temp: 0x%02X",
+    NAVIEN_LOG_PACKET(this->protocol_task_, "SRC:0x%02X Received Gas DHW Temp: 0x%02X, Inlet: 0x%02X, Outlet: 0x%02X, SH Temp: 0x%02X",
        src,
        gas.dhw_set_temp,
        gas.inlet_temp,
@@ -171,7 +240,7 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
        gas.sh_set_temp
     );
 
-    ESP_LOGD(TAG, "SRC:0x%02X Received Accumulated: 0x%02X 0x%02X, Current Gas: 0x%02X 0x%02X, Capacity Util: 0x%02X",
+    NAVIEN_LOG_PACKET(this->protocol_task_, "SRC:0x%02X Received Accumulated: 0x%02X 0x%02X, Current Gas: 0x%02X 0x%02X, Capacity Util: 0x%02X",
        src,
        gas.cumulative_gas_hi,
        gas.cumulative_gas_lo,
@@ -180,258 +249,320 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
        gas.heat_capacity
     );
 
+    uint32_t start = navien_cycles();
+    NavienDecoder::decode_gas(gas, state);
+    this->decode_cycles += navien_cycles() - start;
+    this->decoded_cnt++;
+
+    if (this->protocol_task_){
+      this->hand_over(FRAME_EVENT_GAS, hdr);
+      return;
+    }
     // Update the counter that will be used in assessment
     // of whether we're connected to navien or not
     this->received_cnt++;
+    if (this->is_rt)
+      this->update_gas_sensors();
+  }
 
-    this->state.gas.dhw_set_temp = NavienLink::t2c(gas.dhw_set_temp);
-    this->state.gas.outlet_temp = NavienLink::t2c(gas.outlet_temp);
-    this->state.gas.inlet_temp = NavienLink::t2c(gas.inlet_temp);
-    this->state.gas.sh_set_temp = NavienLink::t2c(gas.sh_set_temp);
-    this->state.gas.sh_outlet_temp = NavienLink::t2c(gas.sh_outlet_temp);
-    this->state.gas.sh_return_temp = NavienLink::t2c(gas.sh_return_temp);
-    this->state.gas.outdoor_temp = NavienLink::ot2c(gas.outdoor_temp);
-    this->state.device_type = static_cast<DEVICE_TYPE>(gas.device_type);
-    this->state.gas.heat_capacity = gas.heat_capacity * 0.5f;
-    this->state.gas.total_dhw_usage = gas.cumulative_domestic_usage_cnt_hi << 8 | gas.cumulative_domestic_usage_cnt_lo;
-    this->state.gas.total_operating_time = gas.total_operating_time_hi << 8 | gas.total_operating_time_lo;
-    this->state.gas.accumulated_gas_usage = gas.cumulative_gas_hi << 8 | gas.cumulative_gas_lo;
-    this->state.gas.current_gas_usage = gas.current_gas_hi << 8 | gas.current_gas_lo;
-    this->state.gas.cumulative_dwh_usage_hours = gas.cumulative_dwh_usage_hours_hi << 8 | gas.cumulative_dwh_usage_hours_lo;
-    this->state.gas.cumulative_sh_usage_hours = gas.cumulative_sh_usage_hours_hi << 8 | gas.cumulative_sh_usage_hours_lo;
-    
-    if (gas.system_status_2 & SYS_STATUS_2_DISPLAY_UNITS){
-      this->state.units = FARENHEIT;
-    }else{
-      this->state.units = CELSIUS;
-    }
+  void Navien::hand_over(NAVIEN_FRAME_EVENT_TYPE type, const HEADER & hdr){
+    this->state_snapshot.write(this->task_state);
+    NAVIEN_FRAME_EVENT event = {};
+    event.type = type;
+    event.src = hdr.src;
+    event.version = this->state_snapshot.version();
+    event.last_byte_us = this->navien_link_->get_frame_time().last_byte_us;
+    // A full ring only loses the event, the snapshot already has the data
+    this->frame_events.push(event);
+  }
 
-    std::string contVers = std::to_string(gas.controller_version);
-    if (contVers.length() < 2){
-      contVers.insert(0, 2 - contVers.length(), '0');
+  void Navien::drain_frame_events(){
+    NAVIEN_FRAME_EVENT event;
+    bool water = false, gas = false;
+    while (this->frame_events.pop(event)){
+      switch(event.type){
+      case FRAME_EVENT_WATER:
+        this->received_cnt++;
+        water = true;
+        break;
+      case FRAME_EVENT_GAS:
+        this->received_cnt++;
+        gas = true;
+        break;
+      case FRAME_EVENT_ERROR:
+        this->publish_error();
+        break;
+      case FRAME_EVENT_CMD_RESULT:
+        this->log_cmd_result(event.result);
+        break;
+      }
     }
-    this->state.controller_version = contVers.substr(0, 1) + "." + contVers.substr(1, 1);
+    if (!water && !gas)
+      return;
+    this->state_snapshot.read(this->state);
+    if (this->is_rt && water)
+      this->update_water_sensors();
+    if (this->is_rt && gas)
+      this->update_gas_sensors();
+  }
 
-    std::string panVers = std::to_string(gas.panel_version);
-    if (panVers.length() < 2){
-      panVers.insert(0, 2 - panVers.length(), '0');
+  void Navien::on_cmd_result(const NAVIEN_CMD_RESULT & result){
+    if (this->protocol_task_){
+      NAVIEN_FRAME_EVENT event = {};
+      event.type = FRAME_EVENT_CMD_RESULT;
+      event.result = result;
+      this->frame_events.push(event);
+      return;
     }
-    this->state.panel_version = panVers.substr(0, 1) + "." + panVers.substr(1, 1);
-
-    this->state.days_since_install = gas.days_since_install_hi << 8 | gas.days_since_install_lo;
-    this->state.cumulative_domestic_usage_cnt = gas.cumulative_domestic_usage_cnt_hi << 8 | gas.cumulative_domestic_usage_cnt_lo;
-    this->state.hotbutton_mode_enabled = gas.system_status_2 & SYS_STATUS_2_HOTBUTTON_ENABLED;
+    this->log_cmd_result(result);
+  }
 
-    if (this->is_rt)
-      this->update_gas_sensors();
+  void Navien::log_cmd_result(const NAVIEN_CMD_RESULT & result){
+    if (result.confirmed){
+      ESP_LOGD(TAG, "Command (effect %d) confirmed by the heater after %d attempt(s), %u ms",
+               result.effect, result.attempts, (unsigned) (result.latency_us / 1000));
+    }else{
+      ESP_LOGW(TAG, "Command (effect %d) not confirmed by the heater after %d attempt(s)",
+               result.effect, result.attempts);
+      // Home Assistant may show what was asked for, show it what the heater does
+      this->pub_filters[PUB_CLIMATE].reset();
+      this->pub_filters[PUB_WATER_HEATER].reset();
+      this->pub_filters[PUB_POWER_SWITCH].reset();
+      this->pub_filters[PUB_ALLOW_RECIRC_SWITCH].reset();
+    }
   }
 
   void Navien::on_error(){
+    if (this->protocol_task_){
+      NAVIEN_FRAME_EVENT event = {};
+      event.type = FRAME_EVENT_ERROR;
+      this->frame_events.push(event);
+      return;
+    }
+    this->publish_error();
+  }
+
+  void Navien::publish_error(){
     ESP_LOGW(TAG, "Communications interrupted, resetting states!");
 
-    sensor::Sensor *sensors[] = {
-      this->dhw_set_temp_sensor,
-      this->outlet_temp_sensor,
-      this->inlet_temp_sensor,
-      this->gas_dhw_set_temp_sensor,
-      this->gas_outlet_temp_sensor,
-      this->gas_inlet_temp_sensor,
-      this->water_flow_sensor,
-      this->water_utilization_sensor,
-      this->gas_total_sensor,
-      this->gas_current_sensor,
-      this->sh_set_temp_sensor,
-      this->sh_outlet_temp_sensor,
-      this->sh_return_temp_sensor,
-      this->outdoor_temp_sensor,
-      this->heat_capacity_sensor,
-      this->total_dhw_usage_sensor,
-      this->total_operating_time_sensor,
-      this->cumulative_dwh_usage_hours_sensor,
-      this->cumulative_sh_usage_hours_sensor,
-      this->cumulative_domestic_usage_cnt_sensor,
-      this->days_since_install_sensor,
-      this->error_code_sensor,
-      this->error_level_sensor
-    };
-
-    for (sensor::Sensor *s : sensors) {
-        if (s != nullptr){
-            s->publish_state(NAN);
-        }
+    for (NAVIEN_METRIC & m : this->metrics){
+      switch(NavienMetrics::def(static_cast<NAVIEN_METRIC_ID>(m.id)).kind){
+      case METRIC_SENSOR:
+        static_cast<sensor::Sensor *>(m.entity)->publish_state(NAN);
+        break;
+      case METRIC_BINARY:
+        static_cast<binary_sensor::BinarySensor *>(m.entity)->publish_state(false);
+        break;
+      case METRIC_TEXT:
+        static_cast<text_sensor::TextSensor *>(m.entity)->publish_state("");
+        break;
+      }
     }
 
-    text_sensor::TextSensor *text_sensors[] = {
-      this->controller_version_sensor,
-      this->panel_version_sensor,
-      this->heating_mode_sensor,
-      this->device_type_sensor,
-      this->operating_state_sensor,
-      this->recirc_mode_sensor
-    };
-
-    for (text_sensor::TextSensor *t : text_sensors) {
-        if (t != nullptr){
-            t->publish_state("");
-        }
-    }
-    
-    binary_sensor::BinarySensor *binary_sensors[] = {
-      this->boiler_active_sensor,
-      this->conn_status_sensor,
-      this->recirc_running_sensor,
-      this->other_navilink_installed_sensor
-    };
-
-    for (binary_sensor::BinarySensor *b : binary_sensors) {
-        if (b != nullptr){
-            b->publish_state(false);
+    this->is_connected = false;
+
+    // Whatever comes next differs from what was just published
+    this->metrics.reset();
+    for (NavienPublishFilter & f : this->pub_filters)
+      f.reset();
+  }
+
+  void Navien::publish_metrics(uint8_t source){
+    NAVIEN_METRIC_INPUT in = {};
+    in.state = &this->state;
+    in.source = source;
+    in.connected = this->is_connected;
+    in.other_navilink_installed = this->navien_link_ != nullptr && this->navien_link_->is_other_navilink_installed();
+    in.units = this->display_units();
+    if (this->temp_unit_ == TEMP_UNIT_AUTO && in.units != this->labelled_units_)
+      this->relabel_temperatures(in.units);
+
+    this->metrics.publish(in, millis(), this->heartbeat_ms_,
+      [](NAVIEN_METRIC & m, const NAVIEN_METRIC_DEF & def, const NAVIEN_METRIC_VALUE & value){
+        switch(def.kind){
+        case METRIC_SENSOR:
+          static_cast<sensor::Sensor *>(m.entity)->publish_state(value.value);
+          break;
+        case METRIC_BINARY:
+          static_cast<binary_sensor::BinarySensor *>(m.entity)->publish_state(value.value != 0);
+          break;
+        case METRIC_TEXT:
+          // Text sensors only take std::string, only build one when the value changed
+          static_cast<text_sensor::TextSensor *>(m.entity)->publish_state(value.text);
+          break;
         }
+      });
+  }
+
+  DEVICE_UNITS Navien::display_units() const {
+    switch(this->temp_unit_){
+    case TEMP_UNIT_FAHRENHEIT:
+      return FARENHEIT;
+    case TEMP_UNIT_AUTO:
+      return this->state.units;
+    default:
+      return CELSIUS;
     }
+  }
 
-    this->is_connected = false;
+  void Navien::relabel_temperatures(DEVICE_UNITS units){
+    ESP_LOGI(TAG, "SRC:0x%02X displays %s, publishing temperatures in it", this->src_ + PACKET_SRC_STATUS,
+             units == FARENHEIT ? "Fahrenheit" : "Celsius");
+    for (NAVIEN_METRIC & m : this->metrics){
+      if (NavienMetrics::def(static_cast<NAVIEN_METRIC_ID>(m.id)).unit != METRIC_UNIT_TEMP)
+        continue;
+      // Home Assistant takes the new unit when it reconnects
+      static_cast<sensor::Sensor *>(m.entity)->set_unit_of_measurement(units == FARENHEIT ? "°F" : "°C");
+      // The next value differs by the unit, not by the deadband
+      m.filter.reset();
+    }
+    this->labelled_units_ = units;
   }
 
-  void Navien::update_water_sensors(){
-    if (this->water_flow_sensor != nullptr)
-      this->water_flow_sensor->publish_state(this->state.water.flow_lpm);
+#ifdef USE_SWITCH
+  void Navien::publish(switch_::Switch * s, NAVIEN_PUB_ID id, bool value){
+    if (s != nullptr && this->pub_filters[id].due(value, millis(), this->heartbeat_ms_))
+      s->publish_state(value);
+  }
+#endif
 
-    if (this->water_utilization_sensor != nullptr)
-      this->water_utilization_sensor->publish_state(this->state.water.utilization);
+  bool Navien::publish_due(NAVIEN_PUB_ID id, uint32_t hash){
+    return this->pub_filters[id].due_hash(hash, millis(), this->heartbeat_ms_);
+  }
 
-    if (this->heating_mode_sensor != nullptr){
-      std::string heating_mode_str = heat_mode_to_str(this->state.heating_mode);
-      this->heating_mode_sensor->publish_state(heating_mode_str);
-    }
-    if (this->boiler_active_sensor != nullptr){
-      this->boiler_active_sensor->publish_state(this->state.water.boiler_active);
-    }
-    if (this->recirc_running_sensor != nullptr){
-      this->recirc_running_sensor->publish_state(this->state.water.recirc_running);
-    }
+  void Navien::update_water_sensors(){
+    this->publish_metrics(METRIC_FROM_WATER);
 
 #ifdef USE_CLIMATE
     // Update the climate control with the current target temperature
     if (this->climate != nullptr){
-      switch(this->state.power){
-      case POWER_ON:
-        this->climate->mode = climate::ClimateMode::CLIMATE_MODE_HEAT;
-        break;
-      default:
-        this->climate->mode = climate::ClimateMode::CLIMATE_MODE_OFF;
-      }
+      // Power, current and target temperature, published together
+      const uint8_t shown[] = {
+        this->state.power == POWER_ON, this->state.water.outlet_temp, this->state.water.dhw_set_temp
+      };
+      if (this->publish_due(PUB_CLIMATE, NavienPublishFilter::hash(shown, sizeof(shown)))){
+        switch(this->state.power){
+        case POWER_ON:
+          this->climate->mode = climate::ClimateMode::CLIMATE_MODE_HEAT;
+          break;
+        default:
+          this->climate->mode = climate::ClimateMode::CLIMATE_MODE_OFF;
+        }
 
-      this->climate->current_temperature = this->state.water.outlet_temp;
-      this->climate->target_temperature = this->state.water.dhw_set_temp;
-      this->climate->publish_state();
+        this->climate->current_temperature = NavienLink::t2c(this->state.water.outlet_temp);
+        this->climate->target_temperature = NavienLink::t2c(this->state.water.dhw_set_temp);
+        this->climate->publish_state();
+      }
     }
 #endif
 
 #ifdef USE_WATER_HEATER
     if (this->water_heater != nullptr){
-      this->water_heater->set_current_temperature(this->state.water.outlet_temp);
-      this->water_heater->set_target_temperature_state(this->state.water.dhw_set_temp);
-      this->water_heater->set_on_state(this->state.power == POWER_ON);
-      this->water_heater->publish_state();
+      const uint8_t shown[] = {
+        this->state.power == POWER_ON, this->state.water.outlet_temp, this->state.water.dhw_set_temp
+      };
+      if (this->publish_due(PUB_WATER_HEATER, NavienPublishFilter::hash(shown, sizeof(shown)))){
+        this->water_heater->set_current_temperature(NavienLink::t2c(this->state.water.outlet_temp));
+        this->water_heater->set_target_temperature_state(NavienLink::t2c(this->state.water.dhw_set_temp));
+        this->water_heater->set_on_state(this->state.power == POWER_ON);
+        this->water_heater->publish_state();
+      }
     }
 #endif
 
-    if (this->recirc_mode_sensor != nullptr) {
-      this->recirc_mode_sensor->publish_state(device_recirc_mode_to_str(this->state.recirculation));
-    }
-
 #ifdef USE_SWITCH
-    if (this->power_switch != nullptr){
-      switch(this->state.power){
-      case POWER_ON:
-        this->power_switch->publish_state(true);
-        break;
-      default:
-        this->power_switch->publish_state(false);
-      }
-    }
-
-    if (this->allow_recirc_switch != nullptr){
-      this->allow_recirc_switch->publish_state(this->state.water.scheduled_recirc_allowed);
-    }
+    this->publish(this->power_switch, PUB_POWER_SWITCH, this->state.power == POWER_ON);
+    this->publish(this->allow_recirc_switch, PUB_ALLOW_RECIRC_SWITCH, this->state.water.scheduled_recirc_allowed);
 #endif
+  }
 
-    if (this->dhw_set_temp_sensor != nullptr)
-      this->dhw_set_temp_sensor->publish_state(this->state.water.dhw_set_temp);
-    if (this->outlet_temp_sensor != nullptr)
-      this->outlet_temp_sensor->publish_state(this->state.water.outlet_temp);
-    if (this->inlet_temp_sensor != nullptr)
-      this->inlet_temp_sensor->publish_state(this->state.water.inlet_temp);
-    if (this->operating_state_sensor != nullptr){
-      std::string operating_state_str = op_state_to_str(this->state.operating_state);
-      this->operating_state_sensor->publish_state(operating_state_str);
+  void Navien::update_gas_sensors(){
+    // The climate control shows water packet values only, see update_water_sensors()
+    this->publish_metrics(METRIC_FROM_GAS);
+  }
+
+  void Navien::loop() {
+    if (navien_link_ && src_ == 0 && !protocol_task_running_) {
+      navien_link_->receive();
     }
-    if (this->error_code_sensor != nullptr){
-        this->error_code_sensor->publish_state(this->state.water.error_code);
+    if (this->protocol_task_) {
+      this->drain_frame_events();
     }
-    if (this->error_level_sensor != nullptr){
-        this->error_level_sensor->publish_state(this->state.water.error_level);
+    if (this->adaptive_enabled_) {
+      this->adapt_interval();
     }
+#ifdef NAVIEN_RECORDER_SIZE
+    if (this->dumping_) {
+      this->dump_recording_lines();
+    }
+#endif
   }
 
-  void Navien::update_gas_sensors(){
-    if (this->dhw_set_temp_sensor != nullptr)
-      this->dhw_set_temp_sensor->publish_state(this->state.gas.dhw_set_temp);
+  void Navien::dump_recording(){
+#ifdef NAVIEN_RECORDER_SIZE
+    if (this->src_ != 0 || this->dumping_)
+      return;
+    // What is recorded from now on waits for the next dump
+    this->dump_pos_ = recorder_.oldest();
+    this->dump_end_ = recorder_.end();
+    this->dumping_ = true;
+    ESP_LOGI(TAG, "Recording: dumping %u bytes", (unsigned) (this->dump_end_ - this->dump_pos_));
+#else
+    ESP_LOGW(TAG, "Recording: no recorder configured");
+#endif
+  }
 
-#ifdef USE_CLIMATE
-    // Update the climate control with the current target temperature
-    if (this->climate != nullptr){
-      this->climate->publish_state();
+#ifdef NAVIEN_RECORDER_SIZE
+  void Navien::dump_recording_lines(){
+    // A few lines a loop, the log and the API keep up and the loop stays short
+    uint8_t bytes[DUMP_LINE_BYTES];
+    char hex[2 * DUMP_LINE_BYTES + 1];
+    for (uint8_t line = 0; line < DUMP_LINES_PER_LOOP; line++){
+      uint32_t left = this->dump_end_ - this->dump_pos_;
+      uint32_t from;
+      uint16_t n = (int32_t) left > 0
+        ? recorder_.read(this->dump_pos_, bytes, left < sizeof(bytes) ? left : sizeof(bytes), from)
+        : 0;
+      // The recorder overwrote everything up to the end of the dump
+      if (n == 0 || (int32_t) (from - this->dump_end_) >= 0){
+        this->dumping_ = false;
+        ESP_LOGI(TAG, "Recording: dump done");
+        return;
+      }
+      if (n > this->dump_end_ - from)
+        n = this->dump_end_ - from;
+      for (uint16_t i = 0; i < n; i++)
+        snprintf(&hex[2 * i], 3, "%02X", bytes[i]);
+      // A position past the previous line's end tells navien_recording records were lost
+      ESP_LOGI(TAG, "NAVREC %08X %s", (unsigned) from, hex);
+      this->dump_pos_ = from + n;
     }
+  }
 #endif
-  
-  if (this->outlet_temp_sensor != nullptr)
-    this->outlet_temp_sensor->publish_state(this->state.gas.outlet_temp);
-
-  if (this->inlet_temp_sensor != nullptr)
-      this->inlet_temp_sensor->publish_state(this->state.gas.inlet_temp);
 
-    if (this->gas_total_sensor != nullptr)
-      this->gas_total_sensor->publish_state(this->state.gas.accumulated_gas_usage);
-
-    if (this->device_type_sensor != nullptr){
-      std::string device_type_str = device_type_to_str(this->state.device_type);
-      this->device_type_sensor->publish_state(device_type_str);
-    }
-    if (this->heat_capacity_sensor != nullptr)
-      this->heat_capacity_sensor->publish_state(this->state.gas.heat_capacity);
-    if (this->sh_set_temp_sensor != nullptr)
-      this->sh_set_temp_sensor->publish_state(this->state.gas.sh_set_temp);
-    if (this->sh_outlet_temp_sensor != nullptr)
-      this->sh_outlet_temp_sensor->publish_state(this->state.gas.sh_outlet_temp);
-    if (this->sh_return_temp_sensor != nullptr)
-      this->sh_return_temp_sensor->publish_state(this->state.gas.sh_return_temp);
-    if (this->outdoor_temp_sensor != nullptr)
-      this->outdoor_temp_sensor->publish_state(this->state.gas.outdoor_temp);
-    if (this->gas_current_sensor != nullptr)
-      this->gas_current_sensor->publish_state(this->state.gas.current_gas_usage);
-    if (this->total_dhw_usage_sensor != nullptr)
-      this->total_dhw_usage_sensor->publish_state(this->state.gas.total_dhw_usage);
-    if (this->total_operating_time_sensor != nullptr)
-      this->total_operating_time_sensor->publish_state(this->state.gas.total_operating_time);
-    if (this->cumulative_dwh_usage_hours_sensor != nullptr)
-      this->cumulative_dwh_usage_hours_sensor->publish_state(this->state.gas.cumulative_dwh_usage_hours);
-    if (this->cumulative_sh_usage_hours_sensor != nullptr)
-      this->cumulative_sh_usage_hours_sensor->publish_state(this->state.gas.cumulative_sh_usage_hours);
-    if (this->cumulative_domestic_usage_cnt_sensor != nullptr)
-      this->cumulative_domestic_usage_cnt_sensor->publish_state(this->state.cumulative_domestic_usage_cnt);
-    if (this->days_since_install_sensor != nullptr)
-      this->days_since_install_sensor->publish_state(this->state.days_since_install);
-    if (this->controller_version_sensor != nullptr)
-      this->controller_version_sensor->publish_state(this->state.controller_version);
-    if (this->panel_version_sensor != nullptr)
-      this->panel_version_sensor->publish_state(this->state.panel_version);
+  bool Navien::is_active(const NAVIEN_STATE & state){
+    return state.water.flow > 0
+      || state.heating_mode != HEATING_MODE_IDLE
+      // Demand through the burner sequence to shutting down
+      || (state.operating_state >= DEMAND && state.operating_state <= SHUTTING_DOWN);
   }
 
-  void Navien::loop() {
-    if (navien_link_ && src_ == 0) {
-      navien_link_->receive();
-    }
+  void Navien::adapt_interval(){
+    // Keep update_interval until the first update finds the heater connected.
+    // The state of a lost connection is stale, don't stay fast on it.
+    if (!this->is_connected && !this->adaptive_.is_decided())
+      return;
+    bool active = this->is_connected && is_active(this->state);
+    if (!this->adaptive_.on_activity(active, millis()))
+      return;
+
+    ESP_LOGD(TAG, "SRC:0x%02X %s, updating every %u ms", this->src_ + PACKET_SRC_STATUS,
+             this->adaptive_.is_fast() ? "active" : "idle", (unsigned) this->adaptive_.interval());
+    this->set_update_interval(this->adaptive_.interval());
+    this->start_poller();
+    // Don't wait a slow interval to show the start of a draw
+    if (this->adaptive_.is_fast())
+      this->update();
   }
 
   void Navien::update() {
@@ -442,8 +573,13 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
     // if Navien is connected and we receive packets, the
     // received packet count should be greater than the last time
     // we did an update. If it is not it means we no longer receive packets
-    // and therefore should change our status to disconnected
-    if (this->received_cnt > this->updated_cnt){
+    // and therefore should change our status to disconnected.
+    // Packets identical to the previous ones aren't passed on to us
+    // (NavienLink::set_skip_unchanged), the link tells when the unit was last heard from.
+    uint32_t fresh_us = this->navien_link_ != nullptr ? this->navien_link_->get_fresh_us(this->src_) : 0;
+    bool heard = fresh_us != this->last_fresh_us;
+    this->last_fresh_us = fresh_us;
+    if (this->received_cnt > this->updated_cnt || heard){
       this->updated_cnt = this->received_cnt;
       this->is_connected = true;
     }else{
@@ -453,11 +589,46 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
       this->updated_cnt = 0;
     }
 
-    if (this->conn_status_sensor != nullptr)
-      this->conn_status_sensor->publish_state(this->is_connected);
-
-    if (this->other_navilink_installed_sensor != nullptr)
-      this->other_navilink_installed_sensor->publish_state(this->navien_link_->is_other_navilink_installed());
+    this->publish_metrics(METRIC_FROM_UPDATE);
+
+    if (this->src_ == 0 && this->navien_link_ != nullptr){
+      // The protocol task writes the counters, take the copy it handed over
+      NAVIEN_LINK_COUNTERS counters;
+      if (protocol_task_running_)
+        this->link_counters.read(counters);
+      else
+        counters = navien_link_counters(*this->navien_link_);
+      ESP_LOGD(TAG, "TX: %u frames, %u deferred, collision rate %.1f%%, avg command wait %u ms",
+               (unsigned) counters.tx.frames, (unsigned) counters.tx.deferred,
+               counters.collision_rate * 100,
+               (unsigned) (counters.avg_cmd_wait_us / 1000));
+      ESP_LOGD(TAG, "Unchanged packets: %u skipped, %u changed",
+               (unsigned) counters.stats.unchanged_hits,
+               (unsigned) counters.stats.unchanged_misses);
+      // Loop stats belong to the protocol task when it runs, not to the main loop
+      if (!this->protocol_task_){
+        NAVIEN_LOOP_STATS loop = this->navien_link_->take_loop_stats();
+        ESP_LOGD(TAG, "Loop: %u calls (%u skipped), avg %u us, max %u us, longest UART write %u us, %u stalled frames, %u on a busy line",
+                 (unsigned) loop.calls, (unsigned) loop.skipped,
+                 (unsigned) (loop.calls ? loop.busy_us / loop.calls : 0),
+                 (unsigned) loop.max_us, (unsigned) loop.write_max_us,
+                 (unsigned) counters.stats.tx_stalls,
+                 (unsigned) counters.stats.tx_line_busy);
+        ESP_LOGD(TAG, "Decode: %u packets, avg %u cycles",
+                 (unsigned) this->decoded_cnt,
+                 (unsigned) (this->decoded_cnt ? this->decode_cycles / this->decoded_cnt : 0));
+        this->decode_cycles = 0;
+        this->decoded_cnt = 0;
+      }else{
+        ESP_LOGD(TAG, "Protocol task: %u events dropped", (unsigned) this->frame_events.dropped());
+      }
+#ifdef NAVIEN_RECORDER_SIZE
+      const NAVIEN_REC_STATS & rec = recorder_.get_stats();
+      ESP_LOGD(TAG, "Recording: %u frames (%u as deltas) in %u bytes, %u of %u bytes held",
+               (unsigned) rec.frames, (unsigned) rec.deltas, (unsigned) rec.stored_bytes,
+               (unsigned) (recorder_.end() - recorder_.oldest()), (unsigned) recorder_.capacity());
+#endif
+    }
 
     update_water_sensors();
     update_gas_sensors();
@@ -469,122 +640,6 @@ void NavienBase::send_scheduled_recirculation_off_cmd() {
     //this->setup();
   }
 
-  std::string Navien::op_state_to_str(OPERATING_STATE state) {
-    switch(state){
-      case STANDBY:
-        return "Standby";
-      case STARTUP:
-        return "Startup";
-      case DEMAND:
-        return "Demand";
-      case PRE_PURGE_1:
-        return "Pre Purge Stage 1";
-      case PRE_PURGE_2:
-        return "Pre Purge Stage 2";
-      case PRE_IGNITION:
-        return "Pre-Ignition";
-      case IGNITION:
-        return "Ignition";
-      case FLAME_ON:
-        return "Flame On";
-      case RAMP_UP:
-        return "Ramp Up";
-      case ACTIVE_COMBUSTION:
-        return "Active Combustion";
-      case WATER_ADJUSTMENT_VALVE_OPERATION:
-        return "Water Adjustment Valve Operation";
-      case FLAME_OFF:
-        return "Flame Off";
-      case POST_PURGE_1:
-        return "Post Purge Stage 1";
-      case POST_PURGE_2:
-        return "Post Purge Stage 2";
-      case SHUTTING_DOWN:
-        return "Shutting Down";
-      case DHW_WAIT:
-        return "DHW Wait/Set Point Match";
-      default:
-        char buf[64];
-        std::snprintf(
-            buf,
-            sizeof(buf),
-            "Unknown (%u)",
-            static_cast<unsigned int>(state));
-
-        return buf;
-      }
-  }
-
-  std::string Navien::heat_mode_to_str(DEVICE_HEATING_MODE mode) {
-    switch(mode){
-      case HEATING_MODE_IDLE:
-        return "Idle";
-      case HEATING_MODE_SPACE_HEATING:
-        return "Space Heating";
-      case HEATING_MODE_DOMESTIC_HOT_WATER_DEMAND:
-        return "Domestic Hot Water";
-      case HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING:
-        return "DHW Recirculating";
-      default:
-        return "unknown";
-    }
-  }
-
-  std::string Navien::device_type_to_str(DEVICE_TYPE type) {
-    switch(type){
-      case NO_DEVICE:
-        return "No Device";
-      case NPE:
-        return "NPE";
-      case NCB:
-        return "NCB";
-      case NHB:
-        return "NHB";
-      case CAS_NPE:
-        return "CAS NPE";
-      case CAS_NHB:
-        return "CAS NHB";
-      case NFB:
-        return "NFB";
-      case CAS_NFB:
-        return "CAS NFB";
-      case NFC:
-        return "NFC";
-      case NPN:
-        return "NPN";
-      case CAS_NPN:
-        return "CAS NPN";
-      case NPE2:
-        return "NPE2";
-      case CAS_NPE2:
-        return "CAS NPE2";
-      case NCB_H:
-        return "NCB-H";
-      case NVW:
-        return "NVW";
-      case CAS_NVW:
-        return "CAS NVW";
-      default:
-        return "unknown";
-    }
-  }
-
-  std::string Navien::device_recirc_mode_to_str(DEVICE_RECIRC_MODE state) {
-    switch(state){
-      case RECIRC_OFF:
-        return "Off";
-      case RECIRC_EXT_HOTBUTTON:
-        return "External HotButton";
-      case RECIRC_EXT_SCHEDULED:
-        return "External Scheduled";
-      case RECIRC_INT_SCHEDULED:
-        return "Internal Scheduled";
-      case RECIRC_UNKNOWN:
-      default:
-        return "unknown";
-    }
-  }
-
   void Navien::print_buffer(const uint8_t *data, size_t length) {
     char hex_buffer[100];
     hex_buffer[(3 * 32) + 1] = 0;
@@ -22,127 +22,44 @@
 #include "water_heater/navien_water_heater.h"
 #endif
 
+#include "navien_adaptive.h"
+#include "navien_decode.h"
 #include "navien_link.h"
+#include "navien_metrics.h"
 #include "navien_proto.h"
+#include "navien_publish.h"
+#include "navien_task.h"
+
+// Registry capacity, sensor.py sets it to the number of entities configured
+#ifndef NAVIEN_MAX_METRICS
+#define NAVIEN_MAX_METRICS METRIC_COUNT
+#endif
 
 namespace esphome {
 namespace navien {
 
 
-  typedef enum _DEVICE_POWER_STATE{
-    POWER_OFF,
-    POWER_ON
-  } DEVICE_POWER_STATE;
-
-  
-  typedef enum _DEVICE_RECIRC_MODE{
-    RECIRC_UNKNOWN,
-    RECIRC_OFF,
-    RECIRC_EXT_HOTBUTTON,
-    RECIRC_EXT_SCHEDULED,
-    RECIRC_INT_SCHEDULED,
-  } DEVICE_RECIRC_MODE;
-
-  typedef enum _DEVICE_UNITS{
-    CELSIUS,
-    FARENHEIT
-  } DEVICE_UNITS;
-
-  typedef enum _DEVICE_HEATING_MODE{
-    HEATING_MODE_IDLE = 0x00,
-    HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING = 0x08,
-    HEATING_MODE_SPACE_HEATING = 0x10,
-    HEATING_MODE_DOMESTIC_HOT_WATER_DEMAND = 0x20
-  } DEVICE_HEATING_MODE;
-
-
-  //based on https://github.com/rudybrian/PyNavienSmartController
-  typedef enum _DEVICE_TYPE{
-    NO_DEVICE,
-    NPE,
-    NCB,
-    NHB,
-    CAS_NPE,
-    CAS_NHB,
-    NFB,
-    CAS_NFB,
-    NFC,
-    NPN,
-    CAS_NPN,
-    NPE2,
-    CAS_NPE2,
-    NCB_H,
-    NVW,
-    CAS_NVW
-  } DEVICE_TYPE;
-
-
-  //based on https://github.com/ificator/navien_ha
-  typedef enum _OPERATING_STATE{
-    STANDBY = 0x14,
-    DEMAND = 0x15,
-    STARTUP = 0x20, 
-    PRE_PURGE_1 = 0x28,
-    PRE_PURGE_2 = 0x29,
-    PRE_IGNITION = 0x2A,
-    IGNITION = 0x2B,
-    FLAME_ON = 0x2C,
-    RAMP_UP = 0x2D,
-    ACTIVE_COMBUSTION = 0x33,
-    WATER_ADJUSTMENT_VALVE_OPERATION = 0x34,
-    FLAME_OFF = 0x3C,
-    POST_PURGE_1 = 0x46,
-    POST_PURGE_2 = 0x47,
-    SHUTTING_DOWN = 0x48,
-    DHW_WAIT = 0x49 //DHW Wait / Set Point Match depending on model
-  } OPERATING_STATE;
-
-  typedef struct{
-    struct{
-      float dhw_set_temp;
-      float outlet_temp;
-      float inlet_temp;
-      float flow_lpm;
-      uint8_t utilization;
-      bool boiler_active;
-      bool scheduled_recirc_allowed;
-      bool recirc_running;
-      uint16_t error_code;
-      uint8_t error_level;
-    } water;
-    struct{
-      float  dhw_set_temp;
-      float  outlet_temp;
-      float  inlet_temp;
-      uint16_t accumulated_gas_usage;
-      uint16_t current_gas_usage;
-      float  sh_set_temp;
-      float  sh_outlet_temp; // combi (and space heat?) models
-      float  sh_return_temp; // combi (and space heat?) models
-      float  outdoor_temp;
-      uint8_t heat_capacity;
-      uint16_t total_dhw_usage;
-      uint16_t total_operating_time;
-      uint16_t cumulative_dwh_usage_hours;
-      uint16_t cumulative_sh_usage_hours;
-      uint16_t cumulative_domestic_usage_cnt;
-      uint16_t days_since_install;
-    } gas;
-
-    uint16_t cumulative_domestic_usage_cnt;
-    uint16_t days_since_install;
-    std::string controller_version;
-    std::string panel_version;
-    OPERATING_STATE operating_state;
-    DEVICE_HEATING_MODE heating_mode;
-    DEVICE_TYPE device_type;
-    DEVICE_POWER_STATE  power;
-    DEVICE_RECIRC_MODE  recirculation;
-    DEVICE_UNITS        units;
-    bool hotbutton_mode_enabled;  // From GAS packet - true if HotButton mode is configured
-  } NAVIEN_STATE;
 
 
+  /**
+   * What Navien publishes besides the metrics (navien_metrics.h), each has its own
+   * NavienPublishFilter
+   */
+  typedef enum{
+    PUB_CLIMATE,
+    PUB_WATER_HEATER,
+    PUB_POWER_SWITCH,
+    PUB_ALLOW_RECIRC_SWITCH,
+    PUB_COUNT
+  } NAVIEN_PUB_ID;
+
+  // Unit of the temperature sensors
+  typedef enum{
+    TEMP_UNIT_CELSIUS,
+    TEMP_UNIT_FAHRENHEIT,
+    TEMP_UNIT_AUTO  // the one the heater displays, SYS_STATUS_2_DISPLAY_UNITS
+  } NAVIEN_TEMP_UNIT;
+
   // Forward declaration
 
   class NavienBase : public NavienLinkVisitorI {
@@ -153,50 +70,28 @@ namespace navien {
 
     void set_uart(esphome::uart::UARTComponent* uart) { uart_ = uart; }
     void set_src(uint8_t src) { src_ = src; }
+    void set_idle_timeout(uint32_t ms) { idle_timeout_ms_ = ms; }
+    void set_rx_threshold(uint8_t bytes) { rx_threshold_ = bytes; }
 
     void send_turn_on_cmd();
     void send_turn_off_cmd();
     void send_hot_button_cmd();
     void send_dhw_set_temp_cmd(float temp);
+    // Set temperature in the units given, e.g. Navien::display_units() to match the sensors
+    void send_dhw_set_temp_cmd(float temp, DEVICE_UNITS units);
     void send_scheduled_recirculation_on_cmd();
     void send_scheduled_recirculation_off_cmd();
 
   public:
-    void set_dhw_set_temp_sensor(sensor::Sensor *sensor) { dhw_set_temp_sensor = sensor; }
-    void set_inlet_temp_sensor(sensor::Sensor *sensor) { inlet_temp_sensor = sensor; }
-    void set_outlet_temp_sensor(sensor::Sensor *sensor) { outlet_temp_sensor = sensor; }
-    void set_gas_dhw_set_temp_sensor(sensor::Sensor *sensor) { gas_dhw_set_temp_sensor = sensor; }
-    void set_gas_inlet_temp_sensor(sensor::Sensor *sensor) { gas_inlet_temp_sensor = sensor; }
-    void set_gas_outlet_temp_sensor(sensor::Sensor *sensor) { gas_outlet_temp_sensor = sensor; }
-    void set_water_flow_sensor(sensor::Sensor *sensor) { water_flow_sensor = sensor; }
-    void set_water_utilization_sensor(sensor::Sensor *sensor) { water_utilization_sensor = sensor; }
-    void set_recirc_running_sensor(binary_sensor::BinarySensor *sensor) { recirc_running_sensor = sensor; }
-    void set_gas_total_sensor(sensor::Sensor *sensor) { gas_total_sensor = sensor; }
-    void set_gas_current_sensor(sensor::Sensor *sensor) { gas_current_sensor = sensor; }
-    void set_device_type_sensor(text_sensor::TextSensor *sensor) { device_type_sensor = sensor; }
-    void set_operating_state_sensor(text_sensor::TextSensor *sensor) { operating_state_sensor = sensor; }
     void set_real_time(bool rt){this->is_rt = rt;}
 
-    void set_heating_mode_sensor(text_sensor::TextSensor *sensor) { heating_mode_sensor = sensor; }
-    void set_conn_status_sensor(binary_sensor::BinarySensor *sensor) { conn_status_sensor = sensor; }
-    void set_recirc_mode_sensor(text_sensor::TextSensor *sensor) { recirc_mode_sensor = sensor; }  
-    void set_sh_set_temp_sensor(sensor::Sensor *sensor) { sh_set_temp_sensor = sensor; }
-    void set_sh_outlet_temp_sensor(sensor::Sensor *sensor) { sh_outlet_temp_sensor = sensor; }
-    void set_sh_return_temp_sensor(sensor::Sensor *sensor) { sh_return_temp_sensor = sensor; }
-    void set_outdoor_temp_sensor(sensor::Sensor *sensor) { outdoor_temp_sensor = sensor; }
-    void set_heat_capacity_sensor(sensor::Sensor *sensor) { heat_capacity_sensor = sensor; } 
-    void set_boiler_active_sensor(binary_sensor::BinarySensor *sensor) { boiler_active_sensor = sensor; } 
-    void set_days_since_install_sensor(sensor::Sensor *sensor) { days_since_install_sensor = sensor; }
-    void set_total_dhw_usage_sensor(sensor::Sensor *sensor) { total_dhw_usage_sensor = sensor; }
-    void set_total_operating_time_sensor(sensor::Sensor *sensor) { total_operating_time_sensor = sensor; }
-    void set_controller_version_sensor(text_sensor::TextSensor *sensor) { controller_version_sensor = sensor; }
-    void set_panel_version_sensor(text_sensor::TextSensor *sensor) { panel_version_sensor = sensor; }
-    void set_cumulative_dwh_usage_hours_sensor(sensor::Sensor *sensor) { cumulative_dwh_usage_hours_sensor = sensor; }
-    void set_cumulative_sh_usage_hours_sensor(sensor::Sensor *sensor) { cumulative_sh_usage_hours_sensor = sensor; }
-    void set_cumulative_domestic_usage_cnt_sensor(sensor::Sensor *sensor) { cumulative_domestic_usage_cnt_sensor = sensor; }
-    void set_other_navilink_installed_sensor(binary_sensor::BinarySensor *sensor) { other_navilink_installed_sensor = sensor; }
-    void set_error_code_sensor(sensor::Sensor * sensor) { error_code_sensor = sensor; }
-    void set_error_level_sensor(sensor::Sensor *sensor) { error_level_sensor = sensor; }
+    /**
+     * Publish a metric to the entity, the kind of the entity must be the one of the metric
+     * (NavienMetrics::DEFS). Only the metrics added are decoded and published.
+     */
+    void add_metric(NAVIEN_METRIC_ID id, sensor::Sensor * s) { this->add_metric(id, METRIC_SENSOR, s); }
+    void add_metric(NAVIEN_METRIC_ID id, binary_sensor::BinarySensor * s) { this->add_metric(id, METRIC_BINARY, s); }
+    void add_metric(NAVIEN_METRIC_ID id, text_sensor::TextSensor * s) { this->add_metric(id, METRIC_TEXT, s); }
 
 #ifdef USE_SWITCH
     /**
@@ -221,45 +116,10 @@ namespace navien {
 #endif
 
   protected:
-    /**
-     * Sensor definitions
-     */
+    void add_metric(NAVIEN_METRIC_ID id, NAVIEN_METRIC_KIND kind, void * entity);
 
-    sensor::Sensor *dhw_set_temp_sensor = nullptr;
-    sensor::Sensor *outlet_temp_sensor = nullptr;
-    sensor::Sensor *inlet_temp_sensor = nullptr;
-    sensor::Sensor *gas_dhw_set_temp_sensor = nullptr;
-    sensor::Sensor *gas_outlet_temp_sensor = nullptr;
-    sensor::Sensor *gas_inlet_temp_sensor = nullptr;
-    sensor::Sensor *water_flow_sensor = nullptr;
-    sensor::Sensor *water_utilization_sensor = nullptr;
-    sensor::Sensor *gas_total_sensor = nullptr;
-    sensor::Sensor *gas_current_sensor = nullptr;
-    sensor::Sensor *sh_set_temp_sensor = nullptr;
-    sensor::Sensor *sh_outlet_temp_sensor = nullptr;
-    sensor::Sensor *sh_return_temp_sensor = nullptr;
-    sensor::Sensor *outdoor_temp_sensor = nullptr;
-    sensor::Sensor *heat_capacity_sensor = nullptr;
-    sensor::Sensor *total_dhw_usage_sensor = nullptr;
-    sensor::Sensor *total_operating_time_sensor = nullptr;
-    sensor::Sensor *cumulative_dwh_usage_hours_sensor = nullptr;
-    sensor::Sensor *cumulative_sh_usage_hours_sensor = nullptr;
-    sensor::Sensor *cumulative_domestic_usage_cnt_sensor = nullptr;
-    sensor::Sensor *days_since_install_sensor = nullptr;
-    sensor::Sensor *error_code_sensor = nullptr;
-    sensor::Sensor *error_level_sensor = nullptr;
-
-    text_sensor::TextSensor *controller_version_sensor = nullptr;
-    text_sensor::TextSensor *panel_version_sensor = nullptr;
-    text_sensor::TextSensor *heating_mode_sensor = nullptr;
-    text_sensor::TextSensor *device_type_sensor = nullptr;
-    text_sensor::TextSensor *operating_state_sensor = nullptr;
-    text_sensor::TextSensor *recirc_mode_sensor = nullptr;
-
-    binary_sensor::BinarySensor *boiler_active_sensor = nullptr;
-    binary_sensor::BinarySensor *conn_status_sensor = nullptr;
-    binary_sensor::BinarySensor *recirc_running_sensor = nullptr;
-    binary_sensor::BinarySensor *other_navilink_installed_sensor = nullptr;
+    // Configured sensors, binary sensors and text sensors
+    NavienMetricRegistry<NAVIEN_MAX_METRICS> metrics;
 
 #ifdef USE_SWITCH
     switch_::Switch *power_switch = nullptr;
@@ -278,6 +138,12 @@ namespace navien {
     esphome::uart::UARTComponent* uart_;
     uint8_t src_;
     bool is_rt;
+
+    // How long the RS485 line must be quiet before NavienLink drops an incomplete packet
+    optional<uint32_t> idle_timeout_ms_;
+
+    // How many bytes the UART must hold before NavienLink drains it between packets
+    optional<uint8_t> rx_threshold_;
   };
 
   class Navien : public PollingComponent, public NavienBase {
@@ -292,9 +158,69 @@ namespace navien {
     virtual float get_setup_priority() const { return setup_priority::HARDWARE; }
     virtual void setup() override;
     void loop() override;
+
+    /**
+     * Run NavienLink and the decoding of the status packets in a task on the other
+     * core, see navien_task.h. Dual core ESP32 only. All cascade units share the link,
+     * so this applies to all of them.
+     */
+    void set_protocol_task(bool enabled) { protocol_task_enabled_ = enabled; }
+
+    /**
+     * Only publish a value that moved by more than deadband since it was last published.
+     * 0 (default) publishes any change.
+     */
+    void set_deadband(NAVIEN_METRIC_ID id, float deadband) {
+      if (NAVIEN_METRIC * m = this->metrics.find(id))
+        m->filter.deadband = deadband;
+    }
+
+    /**
+     * Publish the temperature sensors in a fixed unit or the one the heater displays.
+     * The climate and water heater stay in Celsius, ESPHome converts for them.
+     */
+    void set_temperature_unit(NAVIEN_TEMP_UNIT unit) { this->temp_unit_ = unit; }
+
+    // Units the temperature sensors are published in
+    DEVICE_UNITS display_units() const;
+
+    /**
+     * Republish unchanged values after this long, 0 - never
+     */
+    void set_heartbeat(uint32_t ms) { this->heartbeat_ms_ = ms; }
+
+    /**
+     * Update every fast_ms while the unit is active (see is_active()) and every slow_ms
+     * once it has been idle for hold_ms, instead of the fixed update_interval
+     */
+    void set_adaptive_interval(uint32_t fast_ms, uint32_t slow_ms, uint32_t hold_ms){
+      this->adaptive_.configure(fast_ms, slow_ms, hold_ms);
+      this->adaptive_enabled_ = true;
+    }
     void update() override;
     void dump_config() override;
 
+    /**
+     * Log the recorded traffic (navien_recorder.h) as "NAVREC <position> <hex>" lines, a few
+     * every loop(), for navien_recording (src/) to decode. Needs the recorder option,
+     * e.g. called from a template button.
+     */
+    void dump_recording();
+
+  protected:
+#ifdef NAVIEN_RECORDER_SIZE
+    // Log the next lines of the dump, called from loop()
+    void dump_recording_lines();
+
+    // Shared by the cascade units like the link, src 0 owns it
+    inline static NavienFrameRecorder recorder_;
+    bool dumping_ = false;
+    uint32_t dump_pos_ = 0;
+    uint32_t dump_end_ = 0;
+    static const uint8_t DUMP_LINE_BYTES = 32;
+    static const uint8_t DUMP_LINES_PER_LOOP = 4;
+#endif
+
   protected:
     // Debug helper to print hex buffers
     static void print_buffer(const uint8_t *data, size_t length);
@@ -307,38 +233,86 @@ namespace navien {
     virtual void update_water_sensors();
     virtual void update_gas_sensors();
 
-    /**
-     * Helper function to convert operating state enum to string
-     */
-    static std::string op_state_to_str(OPERATING_STATE state);
+    // Publish the metrics updated by source (NAVIEN_METRIC_SOURCE) that changed
+    void publish_metrics(uint8_t source);
 
-    /**
-     * Helper function to convert heating mode enum to string
-     */
-    static std::string heat_mode_to_str(DEVICE_HEATING_MODE mode);
+    // Sets the unit of measurement of the temperature sensors, TEMP_UNIT_AUTO only
+    void relabel_temperatures(DEVICE_UNITS units);
 
-    /**
-     * Helper function to convert device type enum to string
-     */
-    static std::string device_type_to_str(DEVICE_TYPE type);
+    NAVIEN_TEMP_UNIT temp_unit_ = TEMP_UNIT_CELSIUS;
+    // What the temperature sensors say their unit is, sensor.py sets Celsius for TEMP_UNIT_AUTO
+    DEVICE_UNITS labelled_units_ = CELSIUS;
 
     /**
-     * Helper function to convert recirculation mode enum to string
+     * Publish if the value changed (see NavienPublishFilter) and the entity is configured
      */
-    static std::string device_recirc_mode_to_str(DEVICE_RECIRC_MODE state);
+#ifdef USE_SWITCH
+    void publish(switch_::Switch * s, NAVIEN_PUB_ID id, bool value);
+#endif
+
+    // Whether a value published by other means than the above is due
+    bool publish_due(NAVIEN_PUB_ID id, uint32_t hash);
+
+    // Water flowing, burner sequence running or heating
+    static bool is_active(const NAVIEN_STATE & state);
+
+    // Switch the update interval with the activity, called from loop()
+    void adapt_interval();
+
+    bool adaptive_enabled_ = false;
+    NavienAdaptiveInterval adaptive_;
+
+    NavienPublishFilter pub_filters[PUB_COUNT];
+    uint32_t heartbeat_ms_ = DEFAULT_HEARTBEAT_MS;
+    static const uint32_t DEFAULT_HEARTBEAT_MS = 5 * 60 * 1000;
+
 
   protected:
     // Data, extracted from gas and water packers and stored
     // Once the "update" is called this data gets reported to readers.
     NAVIEN_STATE state = {};
 
+    // With the protocol task on, on_water/on_gas run in that task and decode into
+    // task_state. The main loop takes its copy in state from the snapshot.
+    inline static bool protocol_task_enabled_ = false;
+    inline static bool protocol_task_running_ = false;
+    bool protocol_task_ = false;
+    NAVIEN_STATE task_state = {};
+    NavienSeqlock<NAVIEN_STATE> state_snapshot;
+    NavienEventRing<NAVIEN_FRAME_EVENT, 16> frame_events;
+    NavienSeqlock<NAVIEN_LINK_COUNTERS> link_counters;
+
+    // Where on_water/on_gas decode into
+    NAVIEN_STATE & decoded() { return this->protocol_task_ ? this->task_state : this->state; }
+
+    // Publish task_state and tell the main loop, called in the protocol task
+    void hand_over(NAVIEN_FRAME_EVENT_TYPE type, const HEADER & hdr);
+
+    // Main loop side of the protocol task: take the snapshot and act on the events
+    void drain_frame_events();
+
+    // Publish the state of a lost connection, see on_error()
+    void publish_error();
+
+    static void protocol_task(void * navien);
+    static const uint32_t PROTOCOL_TASK_STACK = 4096;
+    // Above the main loop task, the protocol task sleeps between receive() calls
+    static const uint8_t  PROTOCOL_TASK_PRIORITY = 5;
+    // About 1/20 of a status packet at 19200 baud
+    static const uint32_t PROTOCOL_TASK_POLL_MS = 1;
+    // How often the task hands the link counters over for the log
+    static const uint32_t PROTOCOL_TASK_COUNTERS_MS = 1000;
+
+    void log_cmd_result(const NAVIEN_CMD_RESULT & result);
+
   protected:
     /**
      * NavienLinkVisitorI interface implementation
      */
-    virtual void on_water(const WATER_DATA & water, uint8_t src);
-    virtual void on_gas(const GAS_DATA & gas, uint8_t src);
+    virtual void on_water(const HEADER & hdr, const WATER_DATA & water);
+    virtual void on_gas(const HEADER & hdr, const GAS_DATA & gas);
     virtual void on_error();
+    virtual void on_cmd_result(const NAVIEN_CMD_RESULT & result);
 
   protected:
   /**
@@ -354,6 +328,13 @@ namespace navien {
     // How many packets were updated
     uint32_t updated_cnt;
 
+    // NavienLink::get_fresh_us() at the last update
+    uint32_t last_fresh_us = 0;
+
+    // CPU cycles spent in NavienDecoder and the number of packets decoded since the last update
+    uint32_t decode_cycles = 0;
+    uint32_t decoded_cnt = 0;
+
 
     // true if connected to Navien.
     // otherwie - false.
@@ -0,0 +1,65 @@
+/**
+ * Activity adaptive update interval of Navien.
+ *
+ * A heater sits in standby for hours and then has a draw or a burn that lasts minutes.
+ * Navien publishes every fast_ms while the unit is active - water flowing, burner
+ * sequence running, heating - and every slow_ms otherwise. It goes fast as soon as
+ * activity is seen and only back to slow after hold_ms without any, so the tail of a draw
+ * and short pauses between draws stay at full resolution and the interval doesn't flap.
+ *
+ * No ESPHome dependencies, the caller passes the time and applies the interval.
+ */
+
+#pragma once
+
+#include <cinttypes>
+
+namespace esphome {
+namespace navien {
+
+class NavienAdaptiveInterval{
+public:
+  void configure(uint32_t fast_ms, uint32_t slow_ms, uint32_t hold_ms){
+    this->fast_ms = fast_ms;
+    this->slow_ms = slow_ms;
+    this->hold_ms = hold_ms;
+  }
+
+  /**
+   * Called with the activity of the latest decoded state
+   * @return true if the interval changed, interval() has the new one
+   */
+  bool on_activity(bool active, uint32_t now_ms){
+    if (active)
+      this->last_active_ms = now_ms;
+    bool fast = active || (this->fast && now_ms - this->last_active_ms < this->hold_ms);
+    if (this->decided && fast == this->fast)
+      return false;
+    this->decided = true;
+    this->fast = fast;
+    this->switches++;
+    return true;
+  }
+
+  uint32_t interval() const { return this->fast ? this->fast_ms : this->slow_ms; }
+  bool is_fast() const { return this->fast; }
+  bool is_decided() const { return this->decided; }
+  uint32_t get_switches() const { return this->switches; }
+
+  static const uint32_t DEFAULT_FAST_MS = 1000;
+  static const uint32_t DEFAULT_SLOW_MS = 60000;
+  static const uint32_t DEFAULT_HOLD_MS = 30000;
+
+protected:
+  uint32_t fast_ms = DEFAULT_FAST_MS;
+  uint32_t slow_ms = DEFAULT_SLOW_MS;
+  uint32_t hold_ms = DEFAULT_HOLD_MS;
+
+  bool     decided = false;   // nothing decided before the first state
+  bool     fast = false;
+  uint32_t last_active_ms = 0;
+  uint32_t switches = 0;
+};
+
+}  // namespace navien
+}  // namespace esphome
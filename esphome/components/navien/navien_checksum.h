@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2024 Hovhannes Tumanyan (htumanyan)
+ *
+ * Table driven implementation of the Navien packet checksum (see doc/checksum.md).
+ *
+ * The reference algorithm shifts the running value left by one bit per input byte, folds
+ * the carry back in by XOR-ing the seed and then XORs the input byte into the lower byte:
+ *
+ *   r = r << 1; if (r > 0xff) r = (r & 0xff) ^ seed; r = (uint8_t) r ^ byte;
+ *
+ * The shift/fold part only depends on the current 8 bit value, so it is precomputed into a
+ * 256 entry table per seed at compile time and each byte costs one lookup and one XOR.
+ * NavienChecksum keeps the running value so it can be fed as bytes arrive off the wire.
+ */
+
+#pragma once
+
+#include <cinttypes>
+
+#include "navien_proto.h"
+
+namespace esphome {
+namespace navien {
+
+typedef struct {
+  uint8_t entry[256];
+} CHECKSUM_TABLE;
+
+constexpr CHECKSUM_TABLE make_checksum_table(uint16_t seed){
+  CHECKSUM_TABLE table = {};
+  for (uint16_t r = 0; r < 256; r++){
+    uint16_t v = r << 1;
+    if (v > 0xff)
+      v = (v & 0xff) ^ seed;
+    table.entry[r] = (uint8_t) v;
+  }
+  return table;
+}
+
+constexpr CHECKSUM_TABLE CHECKSUM_TABLE_4B = make_checksum_table(CHECKSUM_SEED_4B);
+constexpr CHECKSUM_TABLE CHECKSUM_TABLE_62 = make_checksum_table(CHECKSUM_SEED_62);
+
+/**
+ * Running checksum over a packet that is fed incrementally.
+ */
+class NavienChecksum {
+public:
+  NavienChecksum(uint16_t seed = CHECKSUM_SEED_62) { this->reset(seed); }
+
+  /**
+   * Start a new checksum computation
+   * @param seed - either CHECKSUM_SEED_4B or CHECKSUM_SEED_62
+   */
+  void reset(uint16_t seed){
+    this->table = seed == CHECKSUM_SEED_4B ? &CHECKSUM_TABLE_4B : &CHECKSUM_TABLE_62;
+    this->value_ = 0xff;
+    this->count = 0;
+  }
+
+  void update(uint8_t byte){
+    this->value_ = this->table->entry[this->value_] ^ byte;
+    this->count++;
+  }
+
+  void update(const uint8_t * buffer, uint8_t len){
+    const uint8_t * t = this->table->entry;
+    uint8_t v = this->value_;
+    for (uint8_t i = 0; i < len; i++)
+      v = t[v] ^ buffer[i];
+    this->value_ = v;
+    this->count += len;
+  }
+
+  /**
+   * The checksum of all bytes fed so far. Buffers shorter than 2 bytes checksum to 0.
+   */
+  uint8_t value() const { return this->count < 2 ? 0x00 : this->value_; }
+
+  /**
+   * One shot computation over a whole buffer
+   */
+  static uint8_t compute(const uint8_t * buffer, uint8_t len, uint16_t seed){
+    NavienChecksum c(seed);
+    c.update(buffer, len);
+    return c.value();
+  }
+
+protected:
+  const CHECKSUM_TABLE * table;
+  uint8_t  value_;
+  uint16_t count;
+};
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,276 @@
+/**
+ * Command queue of NavienLink.
+ *
+ * Commands are produced by ESPHome entities (switches, buttons, climate, API callbacks) and
+ * consumed by NavienLink::receive() which transmits one command after each received packet.
+ * Producers may run in a different context than the consumer (the other core of an ESP32,
+ * an API callback), so each lane is a fixed capacity bounded ring with per-slot sequence
+ * numbers (multiple producers, single consumer) built on the compiler __atomic builtins.
+ * Nothing is allocated after construction and a full lane drops the new command instead
+ * of blocking.
+ *
+ * Commands that set a state (power, DHW setpoint, scheduled recirculation) don't go through
+ * the rings. They are posted as a value into a latest-wins slot per kind, so a burst of
+ * setpoint changes from a slider results in a single command with the last value.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstring>
+
+namespace esphome {
+namespace navien {
+
+/**
+ * What a command is expected to change in the WATER_DATA status packets,
+ * used by NavienLink to confirm the delivery of the command.
+ */
+typedef enum{
+  CMD_EFFECT_NONE,              // fire and forget
+  CMD_EFFECT_POWER,             // system_power & POWER_STATUS_ON_OFF_MASK
+  CMD_EFFECT_DHW_SET_TEMP,      // dhw_set_temp
+  CMD_EFFECT_RECIRC_SCHEDULED,  // recirculation_enabled & RECIRC_STATUS_FLAG_SCHEDULED_ON
+  CMD_EFFECT_MAX
+} NAVIEN_CMD_EFFECT;
+
+typedef struct _NAVIEN_CMD{
+  uint8_t   buffer[64];
+  uint8_t   len;
+  uint8_t   effect;    // NAVIEN_CMD_EFFECT
+  uint8_t   expected;  // value of the effect field that confirms the command
+  uint32_t  queued_us; // when the command was queued
+  _NAVIEN_CMD() : len(0), effect(CMD_EFFECT_NONE), expected(0), queued_us(0) {}
+  _NAVIEN_CMD(const uint8_t * b, uint8_t l) : effect(CMD_EFFECT_NONE), expected(0), queued_us(0) { set(b, l); }
+  void set(const uint8_t * b, uint8_t l) {
+    len = l < sizeof(buffer) ? l : static_cast<uint8_t>(sizeof(buffer));
+    memcpy(buffer, b, len);
+  }
+} NAVIEN_CMD;
+
+/**
+ * Transmit priority of a command. Lower value goes out first. The NAVILINK_PRESENT keepalive
+ * is not queued, NavienLink sends it only when all lanes are empty.
+ */
+typedef enum{
+  CMD_PRIO_HIGH,       // hot button, power - user is waiting for the result
+  CMD_PRIO_NORMAL,     // setpoint and recirculation schedule changes
+  CMD_PRIO_MAX
+} NAVIEN_CMD_PRIORITY;
+
+/**
+ * Bounded multi producer, single consumer ring of NAVIEN_CMD.
+ * @param N - capacity, must be a power of 2
+ */
+template<uint8_t N>
+class NavienCmdRing{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "NavienCmdRing capacity must be a power of 2");
+
+public:
+  NavienCmdRing() {
+    for (uint32_t i = 0; i < N; i++)
+      this->slots[i].seq = i;
+  }
+
+  /**
+   * Enqueue a copy of the command. Safe to call from several contexts at once.
+   * @return false and counts a drop if the ring is full
+   */
+  bool push(const NAVIEN_CMD & cmd){
+    uint32_t pos = __atomic_load_n(&this->enqueue_pos, __ATOMIC_RELAXED);
+    SLOT * slot;
+    for (;;){
+      slot = &this->slots[pos & (N - 1)];
+      int32_t diff = (int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+      if (diff == 0){
+        if (__atomic_compare_exchange_n(&this->enqueue_pos, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          break;
+      }else if (diff < 0){
+        __atomic_fetch_add(&this->dropped_, 1, __ATOMIC_RELAXED);
+        return false;
+      }else{
+        pos = __atomic_load_n(&this->enqueue_pos, __ATOMIC_RELAXED);
+      }
+    }
+    slot->cmd = cmd;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  /**
+   * Dequeue the oldest command. Must only be called from the consumer context.
+   * @return false if the ring is empty
+   */
+  bool pop(NAVIEN_CMD & cmd){
+    uint32_t pos = this->dequeue_pos;
+    SLOT * slot = &this->slots[pos & (N - 1)];
+    if ((int32_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0)
+      return false;
+    cmd = slot->cmd;
+    __atomic_store_n(&slot->seq, pos + N, __ATOMIC_RELEASE);
+    __atomic_store_n(&this->dequeue_pos, pos + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  /**
+   * Number of queued commands. Approximate while producers are active.
+   */
+  uint8_t depth() const {
+    uint32_t head = __atomic_load_n(&this->dequeue_pos, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&this->enqueue_pos, __ATOMIC_ACQUIRE);
+    return tail - head > N ? N : (uint8_t) (tail - head);
+  }
+
+  bool empty() const { return this->depth() == 0; }
+
+  // Number of commands rejected because the ring was full
+  uint32_t dropped() const { return __atomic_load_n(&this->dropped_, __ATOMIC_RELAXED); }
+
+  static const uint8_t CAPACITY = N;
+
+protected:
+  typedef struct{
+    uint32_t   seq;
+    NAVIEN_CMD cmd;
+  } SLOT;
+
+  SLOT     slots[N];
+  uint32_t enqueue_pos = 0;
+  uint32_t dequeue_pos = 0;
+  uint32_t dropped_ = 0;
+};
+
+/**
+ * Priority laned command queue. pop() returns the oldest command of the highest priority
+ * non-empty lane, commands within a lane keep their order. Within a lane, commands from the
+ * ring go before the latest-wins slots of that lane.
+ */
+class NavienCmdQueue{
+public:
+  static const uint8_t LANE_CAPACITY = 8;
+
+  // Lane of the latest-wins slot of each command kind
+  static NAVIEN_CMD_PRIORITY effect_prio(uint8_t effect){
+    return effect == CMD_EFFECT_POWER ? CMD_PRIO_HIGH : CMD_PRIO_NORMAL;
+  }
+
+  /**
+   * Post a state setting command, superseding one of the same kind that hasn't been
+   * popped yet. Safe to call from several contexts at once.
+   * @param effect - command kind, CMD_EFFECT_NONE is not allowed
+   * @param value  - the expected value of the effect, see NAVIEN_CMD::expected
+   * @param now_us - post time, reported as NAVIEN_CMD::queued_us
+   * @return true if a pending command was superseded
+   */
+  bool post(NAVIEN_CMD_EFFECT effect, uint8_t value, uint32_t now_us = 0){
+    if (effect == CMD_EFFECT_NONE || effect >= CMD_EFFECT_MAX)
+      return false;
+    __atomic_store_n(&this->latest_us[effect], now_us, __ATOMIC_RELAXED);
+    uint32_t prev = __atomic_exchange_n(&this->latest[effect], SLOT_PENDING | value, __ATOMIC_ACQ_REL);
+    if (!(prev & SLOT_PENDING))
+      return false;
+    __atomic_fetch_add(&this->coalesced_, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+
+  bool push(const NAVIEN_CMD & cmd, NAVIEN_CMD_PRIORITY prio){
+    return prio < CMD_PRIO_MAX && this->lanes[prio].push(cmd);
+  }
+
+  bool push(const uint8_t * buffer, uint8_t len, NAVIEN_CMD_PRIORITY prio){
+    return this->push(NAVIEN_CMD(buffer, len), prio);
+  }
+
+  /**
+   * Value of the pending command of the given kind, without taking it
+   * @return false if nothing is pending
+   */
+  bool peek(NAVIEN_CMD_EFFECT effect, uint8_t & value) const {
+    uint32_t v = __atomic_load_n(&this->latest[effect], __ATOMIC_ACQUIRE);
+    value = (uint8_t) v;
+    return v & SLOT_PENDING;
+  }
+
+  // When the pending command of the given kind was posted
+  uint32_t posted_us(NAVIEN_CMD_EFFECT effect) const {
+    return __atomic_load_n(&this->latest_us[effect], __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Take the pending command of the given kind if it still has the value returned by peek().
+   * Fails if a producer has posted a newer value since. Consumer context only.
+   */
+  bool take(NAVIEN_CMD_EFFECT effect, uint8_t value){
+    uint32_t expected = SLOT_PENDING | value;
+    return __atomic_compare_exchange_n(&this->latest[effect], &expected, 0, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+
+  /**
+   * Dequeue the next command. A command taken from a latest-wins slot only has effect
+   * and expected set, its len is 0 and the caller builds the packet.
+   * Must only be called from the consumer context.
+   */
+  bool pop(NAVIEN_CMD & cmd){
+    for (uint8_t i = 0; i < CMD_PRIO_MAX; i++){
+      if (this->lanes[i].pop(cmd))
+        return true;
+      for (uint8_t e = CMD_EFFECT_NONE + 1; e < CMD_EFFECT_MAX; e++){
+        if (effect_prio(e) != i || !(__atomic_load_n(&this->latest[e], __ATOMIC_RELAXED) & SLOT_PENDING))
+          continue;
+        uint32_t v = __atomic_exchange_n(&this->latest[e], 0, __ATOMIC_ACQ_REL);
+        if (v & SLOT_PENDING){
+          cmd.len = 0;
+          cmd.effect = e;
+          cmd.expected = (uint8_t) v;
+          cmd.queued_us = this->posted_us(static_cast<NAVIEN_CMD_EFFECT>(e));
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool empty() const {
+    for (uint8_t i = 0; i < CMD_PRIO_MAX; i++)
+      if (!this->lanes[i].empty())
+        return false;
+    for (uint8_t e = CMD_EFFECT_NONE + 1; e < CMD_EFFECT_MAX; e++)
+      if (__atomic_load_n(&this->latest[e], __ATOMIC_RELAXED) & SLOT_PENDING)
+        return false;
+    return true;
+  }
+
+  uint8_t depth(NAVIEN_CMD_PRIORITY prio) const {
+    uint8_t depth = this->lanes[prio].depth();
+    for (uint8_t e = CMD_EFFECT_NONE + 1; e < CMD_EFFECT_MAX; e++)
+      if (effect_prio(e) == prio && (__atomic_load_n(&this->latest[e], __ATOMIC_RELAXED) & SLOT_PENDING))
+        depth++;
+    return depth;
+  }
+  uint32_t dropped(NAVIEN_CMD_PRIORITY prio) const { return this->lanes[prio].dropped(); }
+
+  uint32_t dropped() const {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < CMD_PRIO_MAX; i++)
+      total += this->lanes[i].dropped();
+    return total;
+  }
+
+  // Number of posted commands superseded by a newer one of the same kind
+  uint32_t coalesced() const { return __atomic_load_n(&this->coalesced_, __ATOMIC_RELAXED); }
+
+protected:
+  static const uint32_t SLOT_PENDING = 0x100;
+
+  NavienCmdRing<LANE_CAPACITY> lanes[CMD_PRIO_MAX];
+
+  // Latest-wins slots, SLOT_PENDING | value when a command is pending
+  uint32_t latest[CMD_EFFECT_MAX] = {};
+  uint32_t latest_us[CMD_EFFECT_MAX] = {};
+  uint32_t coalesced_ = 0;
+};
+
+}  // namespace navien
+}  // namespace esphome
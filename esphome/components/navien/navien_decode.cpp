@@ -0,0 +1,259 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include "navien_decode.h"
+#include "navien_metrics.h"
+
+namespace esphome {
+namespace navien {
+
+  // Indexed by DEVICE_TYPE
+  static const char * const DEVICE_TYPE_STR[] = {
+    "No Device", "NPE", "NCB", "NHB", "CAS NPE", "CAS NHB", "NFB", "CAS NFB",
+    "NFC", "NPN", "CAS NPN", "NPE2", "CAS NPE2", "NCB-H", "NVW", "CAS NVW"
+  };
+
+  // Indexed by DEVICE_RECIRC_MODE
+  static const char * const RECIRC_MODE_STR[] = {
+    "unknown", "Off", "External HotButton", "External Scheduled", "Internal Scheduled"
+  };
+
+  /**
+   * A field of NAVIEN_STATE copied from a packet as is, decoded only if its metric is built
+   * (NAVIEN_METRIC_MASK). Fields Navien itself needs - power, set and outlet temperature,
+   * flow, states and modes - are decoded in code below whatever the configuration.
+   */
+  typedef struct{
+    uint8_t  metric;   // NAVIEN_METRIC_ID
+    uint8_t  hi;       // offset in WATER_DATA/GAS_DATA, of the high byte of 16 bit fields
+    uint8_t  lo;       // offset of the low byte of 16 bit fields, NO_LO for 8 bit ones
+    uint16_t dst;      // offset in NAVIEN_STATE of the uint8_t or uint16_t
+  } NAVIEN_FIELD;
+
+  static constexpr uint8_t NO_LO = 0xFF;
+
+#define FIELD8(metric, packet, from, to) \
+  {metric, offsetof(packet, from), NO_LO, offsetof(NAVIEN_STATE, to)}
+#define FIELD16(metric, packet, from, to) \
+  {metric, offsetof(packet, from##_hi), offsetof(packet, from##_lo), offsetof(NAVIEN_STATE, to)}
+
+  static constexpr NAVIEN_FIELD WATER_FIELDS[] = {
+    FIELD8(METRIC_INLET_TEMP, WATER_DATA, inlet_temp, water.inlet_temp),
+    FIELD8(METRIC_WATER_UTILIZATION, WATER_DATA, operating_capacity, water.utilization),
+    FIELD16(METRIC_ERROR_CODE, WATER_DATA, error_code, water.error_code),
+    FIELD8(METRIC_ERROR_LEVEL, WATER_DATA, error_level, water.error_level),
+  };
+
+  static constexpr NAVIEN_FIELD GAS_FIELDS[] = {
+    FIELD8(METRIC_DHW_SET_TEMP, GAS_DATA, dhw_set_temp, gas.dhw_set_temp),
+    FIELD8(METRIC_OUTLET_TEMP, GAS_DATA, outlet_temp, gas.outlet_temp),
+    FIELD8(METRIC_INLET_TEMP, GAS_DATA, inlet_temp, gas.inlet_temp),
+    FIELD8(METRIC_SH_SET_TEMP, GAS_DATA, sh_set_temp, gas.sh_set_temp),
+    FIELD8(METRIC_SH_OUTLET_TEMP, GAS_DATA, sh_outlet_temp, gas.sh_outlet_temp),
+    FIELD8(METRIC_SH_RETURN_TEMP, GAS_DATA, sh_return_temp, gas.sh_return_temp),
+    FIELD8(METRIC_OUTDOOR_TEMP, GAS_DATA, outdoor_temp, gas.outdoor_temp),
+    FIELD8(METRIC_HEAT_CAPACITY, GAS_DATA, heat_capacity, gas.heat_capacity),
+    FIELD16(METRIC_TOTAL_DHW_USAGE, GAS_DATA, cumulative_domestic_usage_cnt, gas.total_dhw_usage),
+    FIELD16(METRIC_TOTAL_OPERATING_TIME, GAS_DATA, total_operating_time, gas.total_operating_time),
+    FIELD16(METRIC_GAS_TOTAL, GAS_DATA, cumulative_gas, gas.accumulated_gas_usage),
+    FIELD16(METRIC_GAS_CURRENT, GAS_DATA, current_gas, gas.current_gas_usage),
+    FIELD16(METRIC_CUMULATIVE_DHW_USAGE_HOURS, GAS_DATA, cumulative_dwh_usage_hours, gas.cumulative_dwh_usage_hours),
+    FIELD16(METRIC_CUMULATIVE_SH_USAGE_HOURS, GAS_DATA, cumulative_sh_usage_hours, gas.cumulative_sh_usage_hours),
+    FIELD16(METRIC_DAYS_SINCE_INSTALL, GAS_DATA, days_since_install, days_since_install),
+    FIELD16(METRIC_CUMULATIVE_DOMESTIC_USAGE_CNT, GAS_DATA, cumulative_domestic_usage_cnt, cumulative_domestic_usage_cnt),
+  };
+
+  // Unrolled at compile time, a field of a metric that isn't built leaves no code
+  template<const auto & FIELDS, size_t I>
+  static inline void copy_field(const uint8_t * packet, uint8_t * state){
+    constexpr NAVIEN_FIELD f = FIELDS[I];
+    if constexpr (NavienMetrics::built(static_cast<NAVIEN_METRIC_ID>(f.metric))){
+      if constexpr (f.lo == NO_LO){
+        state[f.dst] = packet[f.hi];
+      }else{
+        uint16_t v = packet[f.hi] << 8 | packet[f.lo];
+        memcpy(&state[f.dst], &v, sizeof(v));
+      }
+    }
+  }
+
+  template<const auto & FIELDS, size_t... I>
+  static inline void copy_fields(const uint8_t * packet, NAVIEN_STATE & state, std::index_sequence<I...>){
+    (copy_field<FIELDS, I>(packet, reinterpret_cast<uint8_t *>(&state)), ...);
+  }
+
+  template<const auto & FIELDS>
+  static inline void copy_fields(const void * packet, NAVIEN_STATE & state){
+    copy_fields<FIELDS>(static_cast<const uint8_t *>(packet), state,
+                        std::make_index_sequence<sizeof(FIELDS) / sizeof(FIELDS[0])>());
+  }
+
+  void NavienDecoder::decode_water(const HEADER & hdr, const WATER_DATA & water, NAVIEN_STATE & state){
+    bool ncb_h = hdr.sys_type == PACKET_SYS_TYPE_NCB_H || state.device_type == NCB_H;
+
+    if (water.system_power & POWER_STATUS_ON_OFF_MASK){
+      state.power = POWER_ON;
+    }else{
+      state.power = POWER_OFF;
+    }
+
+    if (ncb_h) {
+      // NCB_H units don't seem to report their recirculation setting in the packets
+      /* TODO this might also be true of other device types that use packet type 0x06 */
+      state.recirculation = RECIRC_UNKNOWN;
+    }else if (water.system_status & SYS_STATUS_FLAG_RECIRC_INT_SCHEDULED){
+      state.recirculation = RECIRC_INT_SCHEDULED;
+    }else if (water.system_status & SYS_STATUS_FLAG_RECIRC_EXT_SCHEDULED){
+      state.recirculation = RECIRC_EXT_SCHEDULED;
+    }else if (state.hotbutton_mode_enabled){
+      // hotbutton_mode_enabled actually comes from gas packets
+      state.recirculation = RECIRC_EXT_HOTBUTTON;
+    }else{
+      state.recirculation = RECIRC_OFF;
+    }
+
+    state.heating_mode = static_cast<DEVICE_HEATING_MODE>(water.heating_mode);
+
+    state.operating_state = static_cast<OPERATING_STATE>(water.operating_state);
+    // Climate, water heater and the adaptive update interval
+    state.water.dhw_set_temp = water.dhw_set_temp;
+    state.water.outlet_temp = water.outlet_temp;
+    state.water.flow = water.water_flow;
+    state.water.scheduled_recirc_allowed = water.recirculation_enabled & RECIRC_STATUS_FLAG_SCHEDULED_ON;
+    copy_fields<WATER_FIELDS>(&water, state);
+
+    if (NavienMetrics::built(METRIC_BOILER_ACTIVE))
+      state.water.boiler_active = water.boiler_active & 0x01;
+    // Recirculation running detection varies by device type. The second byte of the header
+    // is 0x05 on NPE and 0x06 on NCB_H, device_type from the gas packet is the fallback until
+    // other device types are known.
+    if (NavienMetrics::built(METRIC_RECIRC_RUNNING)) {
+      if (ncb_h) {
+        // NCB_H units: pump running indicated by system_power bit 5
+        state.water.recirc_running = water.system_power & RECIRCULATION_ON_OFF_MASK;
+      } else {
+        // NPE and other units: scheduled (heating_mode 0x08) or hotbutton (byte 33 bit 0)
+        state.water.recirc_running =
+            (water.heating_mode & HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING) ||
+            (water.recirculation_enabled & RECIRC_STATUS_FLAG_HOTBUTTON_ON);
+      }
+    }
+  }
+
+  void NavienDecoder::decode_gas(const GAS_DATA & gas, NAVIEN_STATE & state){
+    // Device type tells NCB-H water packets apart
+    state.device_type = static_cast<DEVICE_TYPE>(gas.device_type);
+    copy_fields<GAS_FIELDS>(&gas, state);
+
+    if (gas.system_status_2 & SYS_STATUS_2_DISPLAY_UNITS){
+      state.units = FARENHEIT;
+    }else{
+      state.units = CELSIUS;
+    }
+
+    if (NavienMetrics::built(METRIC_CONTROLLER_VERSION))
+      version_to_str(gas.controller_version, state.controller_version);
+    if (NavienMetrics::built(METRIC_PANEL_VERSION))
+      version_to_str(gas.panel_version, state.panel_version);
+
+    state.hotbutton_mode_enabled = gas.system_status_2 & SYS_STATUS_2_HOTBUTTON_ENABLED;
+  }
+
+  void NavienDecoder::version_to_str(uint8_t version, char (&out)[4]){
+    // First two decimal digits, e.g. 12 -> "1.2", 5 -> "0.5"
+    uint8_t v = version < 100 ? version : version / 10 % 100;
+    out[0] = '0' + v / 10;
+    out[1] = '.';
+    out[2] = '0' + v % 10;
+    out[3] = 0;
+  }
+
+  float NavienDecoder::outdoor_temp(uint8_t raw, DEVICE_UNITS units){
+    // No probe connected, see NavienLink::ot2c()
+    if (raw == 0x9E)
+      return NAN;
+    int8_t c = raw & 0x80 ? -(raw & 0x7F) : raw & 0x7F;
+    return units == FARENHEIT ? c * 1.8f + 32.f : c;
+  }
+
+  uint8_t NavienDecoder::temp_to_raw(float t, DEVICE_UNITS units){
+    float raw = units == FARENHEIT ? (t - 32.f) / 0.9f : t * 2.f;
+    // NaN too
+    if (!(raw > 0.f))
+      return 0;
+    if (raw >= 255.f)
+      return 255;
+    return (uint8_t) (raw + 0.5f);
+  }
+
+  const char * NavienDecoder::op_state_to_str(OPERATING_STATE state, char * buf, size_t len) {
+    switch(state){
+      case STANDBY:
+        return "Standby";
+      case STARTUP:
+        return "Startup";
+      case DEMAND:
+        return "Demand";
+      case PRE_PURGE_1:
+        return "Pre Purge Stage 1";
+      case PRE_PURGE_2:
+        return "Pre Purge Stage 2";
+      case PRE_IGNITION:
+        return "Pre-Ignition";
+      case IGNITION:
+        return "Ignition";
+      case FLAME_ON:
+        return "Flame On";
+      case RAMP_UP:
+        return "Ramp Up";
+      case ACTIVE_COMBUSTION:
+        return "Active Combustion";
+      case WATER_ADJUSTMENT_VALVE_OPERATION:
+        return "Water Adjustment Valve Operation";
+      case FLAME_OFF:
+        return "Flame Off";
+      case POST_PURGE_1:
+        return "Post Purge Stage 1";
+      case POST_PURGE_2:
+        return "Post Purge Stage 2";
+      case SHUTTING_DOWN:
+        return "Shutting Down";
+      case DHW_WAIT:
+        return "DHW Wait/Set Point Match";
+      default:
+        snprintf(buf, len, "Unknown (%u)", static_cast<unsigned int>(state));
+        return buf;
+      }
+  }
+
+  const char * NavienDecoder::heat_mode_to_str(DEVICE_HEATING_MODE mode) {
+    switch(mode){
+      case HEATING_MODE_IDLE:
+        return "Idle";
+      case HEATING_MODE_SPACE_HEATING:
+        return "Space Heating";
+      case HEATING_MODE_DOMESTIC_HOT_WATER_DEMAND:
+        return "Domestic Hot Water";
+      case HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING:
+        return "DHW Recirculating";
+      default:
+        return "unknown";
+    }
+  }
+
+  const char * NavienDecoder::device_type_to_str(DEVICE_TYPE type) {
+    if ((unsigned) type < sizeof(DEVICE_TYPE_STR) / sizeof(DEVICE_TYPE_STR[0]))
+      return DEVICE_TYPE_STR[type];
+    return "unknown";
+  }
+
+  const char * NavienDecoder::recirc_mode_to_str(DEVICE_RECIRC_MODE mode) {
+    if ((unsigned) mode < sizeof(RECIRC_MODE_STR) / sizeof(RECIRC_MODE_STR[0]))
+      return RECIRC_MODE_STR[mode];
+    return "unknown";
+  }
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,180 @@
+/**
+ * Decoding of the status packets into NAVIEN_STATE, and the text shown for its enums.
+ *
+ * Runs for every water and gas packet (in the protocol task when it is on), so it doesn't
+ * allocate: the versions are formatted into fixed buffers in NAVIEN_STATE and the enum
+ * names are string literals. Doesn't depend on ESPHome, the host build decodes with it too.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+#include "navien_proto.h"
+
+namespace esphome {
+namespace navien {
+
+  typedef enum _DEVICE_POWER_STATE{
+    POWER_OFF,
+    POWER_ON
+  } DEVICE_POWER_STATE;
+
+  
+  typedef enum _DEVICE_RECIRC_MODE{
+    RECIRC_UNKNOWN,
+    RECIRC_OFF,
+    RECIRC_EXT_HOTBUTTON,
+    RECIRC_EXT_SCHEDULED,
+    RECIRC_INT_SCHEDULED,
+  } DEVICE_RECIRC_MODE;
+
+  typedef enum _DEVICE_UNITS{
+    CELSIUS,
+    FARENHEIT
+  } DEVICE_UNITS;
+
+  typedef enum _DEVICE_HEATING_MODE{
+    HEATING_MODE_IDLE = 0x00,
+    HEATING_MODE_DOMESTIC_HOT_WATER_RECIRCULATING = 0x08,
+    HEATING_MODE_SPACE_HEATING = 0x10,
+    HEATING_MODE_DOMESTIC_HOT_WATER_DEMAND = 0x20
+  } DEVICE_HEATING_MODE;
+
+
+  //based on https://github.com/rudybrian/PyNavienSmartController
+  typedef enum _DEVICE_TYPE{
+    NO_DEVICE,
+    NPE,
+    NCB,
+    NHB,
+    CAS_NPE,
+    CAS_NHB,
+    NFB,
+    CAS_NFB,
+    NFC,
+    NPN,
+    CAS_NPN,
+    NPE2,
+    CAS_NPE2,
+    NCB_H,
+    NVW,
+    CAS_NVW
+  } DEVICE_TYPE;
+
+
+  //based on https://github.com/ificator/navien_ha
+  typedef enum _OPERATING_STATE{
+    STANDBY = 0x14,
+    DEMAND = 0x15,
+    STARTUP = 0x20, 
+    PRE_PURGE_1 = 0x28,
+    PRE_PURGE_2 = 0x29,
+    PRE_IGNITION = 0x2A,
+    IGNITION = 0x2B,
+    FLAME_ON = 0x2C,
+    RAMP_UP = 0x2D,
+    ACTIVE_COMBUSTION = 0x33,
+    WATER_ADJUSTMENT_VALVE_OPERATION = 0x34,
+    FLAME_OFF = 0x3C,
+    POST_PURGE_1 = 0x46,
+    POST_PURGE_2 = 0x47,
+    SHUTTING_DOWN = 0x48,
+    DHW_WAIT = 0x49 //DHW Wait / Set Point Match depending on model
+  } OPERATING_STATE;
+
+  /**
+   * Decoded state of a unit. Temperatures, flow and percentages stay in the units of the
+   * wire and are only converted to float when published, see the NavienDecoder helpers:
+   *  - temperatures in 0.5 C (NavienLink::t2c),
+   *  - outdoor temperature as sent, sign and magnitude in 1 C (NavienLink::ot2c),
+   *  - flow in 0.1 l/min (NavienLink::flow2lpm),
+   *  - utilization and heat capacity in 0.5 % (NavienDecoder::half).
+   */
+  typedef struct{
+    struct{
+      uint8_t dhw_set_temp;
+      uint8_t outlet_temp;
+      uint8_t inlet_temp;
+      uint8_t flow;
+      uint8_t utilization;
+      bool boiler_active;
+      bool scheduled_recirc_allowed;
+      bool recirc_running;
+      uint16_t error_code;
+      uint8_t error_level;
+    } water;
+    struct{
+      uint8_t  dhw_set_temp;
+      uint8_t  outlet_temp;
+      uint8_t  inlet_temp;
+      uint16_t accumulated_gas_usage;
+      uint16_t current_gas_usage;
+      uint8_t  sh_set_temp;
+      uint8_t  sh_outlet_temp; // combi (and space heat?) models
+      uint8_t  sh_return_temp; // combi (and space heat?) models
+      uint8_t  outdoor_temp;
+      uint8_t heat_capacity;
+      uint16_t total_dhw_usage;
+      uint16_t total_operating_time;
+      uint16_t cumulative_dwh_usage_hours;
+      uint16_t cumulative_sh_usage_hours;
+      uint16_t cumulative_domestic_usage_cnt;
+      uint16_t days_since_install;
+    } gas;
+
+    uint16_t cumulative_domestic_usage_cnt;
+    uint16_t days_since_install;
+    char controller_version[4];  // "1.2"
+    char panel_version[4];
+    OPERATING_STATE operating_state;
+    DEVICE_HEATING_MODE heating_mode;
+    DEVICE_TYPE device_type;
+    DEVICE_POWER_STATE  power;
+    DEVICE_RECIRC_MODE  recirculation;
+    DEVICE_UNITS        units;
+    bool hotbutton_mode_enabled;  // From GAS packet - true if HotButton mode is configured
+  } NAVIEN_STATE;
+
+  class NavienDecoder{
+  public:
+    // Water packet of a unit into its state. Uses hotbutton_mode_enabled of the last gas packet.
+    static void decode_water(const HEADER & hdr, const WATER_DATA & water, NAVIEN_STATE & state);
+
+    // Gas packet of a unit into its state
+    static void decode_gas(const GAS_DATA & gas, NAVIEN_STATE & state);
+
+    /**
+     * Text of the enums, string literals.
+     * op_state_to_str() formats unknown states into buf.
+     */
+    static const char * op_state_to_str(OPERATING_STATE state, char * buf, size_t len);
+    static const char * heat_mode_to_str(DEVICE_HEATING_MODE mode);
+    static const char * device_type_to_str(DEVICE_TYPE type);
+    static const char * recirc_mode_to_str(DEVICE_RECIRC_MODE mode);
+
+    // Size of the buffer op_state_to_str() needs
+    static const size_t OP_STATE_STR_MAX = 16;
+
+    // "1.2" from 12
+    static void version_to_str(uint8_t version, char (&out)[4]);
+
+    // Utilization and heat capacity, 0.5 % units
+    static float half(uint8_t raw) { return raw * 0.5f; }
+
+    /**
+     * Temperatures in the units given, straight from the wire, for the sensors to show what
+     * the heater displays without a float round trip through Celsius:
+     *  - temp() of the 0.5 C values, 0.9 F a step,
+     *  - outdoor_temp() of the sign and magnitude 1 C value, NAN without a probe.
+     */
+    static float temp(uint8_t raw, DEVICE_UNITS units) { return units == FARENHEIT ? raw * 0.9f + 32.f : raw * 0.5f; }
+    static float outdoor_temp(uint8_t raw, DEVICE_UNITS units);
+
+    // Inverse of temp(), the nearest wire value of a set temperature, rounded once
+    static uint8_t temp_to_raw(float t, DEVICE_UNITS units);
+  };
+
+}  // namespace navien
+}  // namespace esphome
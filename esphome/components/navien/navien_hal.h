@@ -0,0 +1,59 @@
+/**
+ * Time source for the protocol core.
+ *
+ * Inside ESPHome this is the platform microsecond counter. In the host build (NAVIEN_HOST)
+ * it defaults to the monotonic clock and can be swapped for a simulated one, which is what
+ * the replay tool does to make a capture play back at wire speed regardless of how fast
+ * the workstation parses it.
+ *
+ * navien_cycles() is a free running CPU cycle counter for timing short code paths such as
+ * the decoding of one packet, it wraps around and only differences are meaningful.
+ */
+
+#pragma once
+
+#include <cinttypes>
+
+#ifdef NAVIEN_HOST
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#else
+#include "esphome/core/hal.h"
+#endif
+
+namespace esphome {
+namespace navien {
+
+#ifdef NAVIEN_HOST
+
+inline uint32_t navien_host_steady_micros(){
+  return (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t (*navien_host_micros)() = navien_host_steady_micros;
+
+inline uint32_t navien_micros(){ return navien_host_micros(); }
+
+inline uint32_t navien_cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+  return (uint32_t) __rdtsc();
+#else
+  // Nanoseconds where there is no cycle counter we know of
+  return (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#else
+
+inline uint32_t navien_micros(){ return micros(); }
+
+inline uint32_t navien_cycles(){ return arch_get_cpu_cycle_count(); }
+
+#endif
+
+}  // namespace navien
+}  // namespace esphome
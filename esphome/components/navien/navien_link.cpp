@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 
-#include "esphome.h"
-#include "esphome/core/log.h"
-#include "navien.h"
+#include "navien_hal.h"
+#include "navien_link.h"
+#include "navien_log.h"
 
 
 namespace esphome {
@@ -25,236 +27,780 @@ NavienLink *NavienLink::get_instance(NavienUartI *uart) {
 }
 
 
-bool NavienLink::seek_to_marker(){
-  if (uart == nullptr) {
-    return false;
-  }
-  uint8_t byte;
-
-  int available = uart->available();
-  for (int i = 0; i < available; i++){
-    uart->peek_byte(&byte);
-    if (byte == PACKET_MARKER)
-      return true;
-    
-    uart->read_byte(&byte);
-  }
-  return false;
-}
-
-
 void NavienLink::parse_control_packet(){
-  ESP_LOGV(TAG, "Got Control Packet => %d bytes", this->recv_buffer.hdr.len + HDR_SIZE);
+  ESP_LOGV(TAG, "Got Control Packet => %d bytes", this->recv_frame->hdr.len + HDR_SIZE);
   if (!this->other_navilink_installed
-      && this->recv_buffer.hdr.len == NAVILINK_PRESENT[offsetof(HEADER, len)]
-      && std::memcmp(this->recv_buffer.raw_data, NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)) == 0){
+      && this->recv_frame->hdr.len == NAVILINK_PRESENT[offsetof(HEADER, len)]
+      && std::memcmp(this->recv_frame->raw_data, NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)) == 0){
     /* This is a NAVILINK_PRESENT_PKT that wasn't sent by us, so anothe NaviLink is also hooked up */
-    ESP_LOGW(TAG, "Detected NAVILINK_PRESENT packet from another NaviLink device, will stop sending NAVILINK_PRESENT packets until rebooted %d", sizeof(NAVILINK_PRESENT));
+    ESP_LOGW(TAG, "Detected NAVILINK_PRESENT packet from another NaviLink device, will stop sending NAVILINK_PRESENT packets until rebooted %d", (int) sizeof(NAVILINK_PRESENT));
     this->other_navilink_installed = true;
+    this->tx_sched.on_foreign_controller();
   }
-  //  Navien::print_buffer(this->recv_buffer.raw_data, this->recv_buffer.hdr.len + HDR_SIZE);
+  //  Navien::print_buffer(this->recv_frame->raw_data, this->recv_frame->hdr.len + HDR_SIZE);
 }
   
+NavienLinkVisitorI * NavienLink::route(const HEADER & hdr) const {
+  uint8_t idx = hdr.src - PACKET_SRC_STATUS;
+  return idx < NAVIEN_CASCADE_MAX ? visitors_[idx] : nullptr;
+}
+
+bool NavienLink::unchanged(const HEADER & hdr){
+  uint8_t unit = hdr.src - PACKET_SRC_STATUS;
+  if (unit >= NAVIEN_CASCADE_MAX || (hdr.dst != PACKET_DST_WATER && hdr.dst != PACKET_DST_GAS))
+    return false;
+  // Read by the main loop while the protocol task runs
+  __atomic_store_n(&this->fresh_us[unit], this->recv_time.last_byte_us, __ATOMIC_RELAXED);
+  if (!this->skip_unchanged)
+    return false;
+
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  const uint8_t * p = this->recv_frame->raw_data;
+  for (uint16_t i = 0; i < HDR_SIZE + hdr.len; i++)
+    hash = (hash ^ p[i]) * 16777619u;
+
+  uint8_t kind = hdr.dst == PACKET_DST_GAS ? 1 : 0;
+  NAVIEN_FRAME_DIGEST & d = this->digests[unit][kind];
+  if (d.valid && d.hash == hash) {
+    this->stats.unchanged_hits++;
+    return true;
+  }
+  // Water is decoded using the last gas packet (hot button mode), a changed gas
+  // packet must reach the visitors with the next water packet too
+  if (kind == 1)
+    this->digests[unit][0].valid = false;
+  d.hash = hash;
+  d.valid = true;
+  this->stats.unchanged_misses++;
+  return false;
+}
+
+void NavienLink::forget_digests(){
+  for (uint8_t i = 0; i < NAVIEN_CASCADE_MAX; i++)
+    this->digests[i][0].valid = this->digests[i][1].valid = false;
+}
+
 void NavienLink::parse_status_packet(){
-  switch(this->recv_buffer.hdr.dst){
+  const HEADER & hdr = this->recv_frame->hdr;
+  NavienLinkVisitorI * owner = this->route(hdr);
+
+  // Command delivery needs every water packet, the visitors only the changed ones
+  if (hdr.dst == PACKET_DST_WATER && hdr.src == PACKET_SRC_STATUS)
+    this->check_deliveries(recv_frame->water);
+  if (this->unchanged(hdr))
+    return;
+
+  switch(hdr.dst){
   case PACKET_DST_WATER:
     ESP_LOGD(TAG, "SRC:0x%02X B8: 0x%02X, B32: 0x%02X, r_enabled: 0x%02X",
-             this->recv_buffer.hdr.src,
-             this->recv_buffer.water.unknown_06,
-             this->recv_buffer.water.unknown_32,
-             this->recv_buffer.water.recirculation_enabled);
-    for (uint8_t i = 0; i < NAVIEN_CASCADE_MAX; ++i)
-      if (visitors_[i]) visitors_[i]->on_water(recv_buffer.water, recv_buffer.hdr.src);
+             hdr.src,
+             this->recv_frame->water.unknown_06,
+             this->recv_frame->water.unknown_32,
+             this->recv_frame->water.recirculation_enabled);
+    if (owner) owner->on_water(hdr, recv_frame->water);
+    for (uint8_t i = 0; i < ALL_SOURCES_VISITORS_MAX && all_sources_visitors_[i]; ++i)
+      all_sources_visitors_[i]->on_water(hdr, recv_frame->water);
     break;
   case PACKET_DST_GAS:
-    ESP_LOGD(TAG, "SRC:0x%02X => Gas", this->recv_buffer.hdr.src);
-    for (uint8_t i = 0; i < NAVIEN_CASCADE_MAX; ++i)
-      if (visitors_[i]) visitors_[i]->on_gas(recv_buffer.gas, recv_buffer.hdr.src);
+    ESP_LOGD(TAG, "SRC:0x%02X => Gas", hdr.src);
+    if (owner) owner->on_gas(hdr, recv_frame->gas);
+    for (uint8_t i = 0; i < ALL_SOURCES_VISITORS_MAX && all_sources_visitors_[i]; ++i)
+      all_sources_visitors_[i]->on_gas(hdr, recv_frame->gas);
     break;
   }
 }
   
-void NavienLink::parse_packet(){
+uint16_t NavienLink::checksum_seed(const HEADER & hdr){
+  // Status packets from the master unit use 0x4B, everything else (cascade
+  // units, control packets) uses 0x62. See doc/checksum.md
+  if (hdr.direction == PACKET_DIR_STATUS && hdr.src == PACKET_SRC_STATUS)
+    return CHECKSUM_SEED_4B;
+  return CHECKSUM_SEED_62;
+}
+
+bool NavienLink::verify_packet(){
   uint8_t crc_c = 0x00;
   uint8_t crc_r = 0x00;
 
-  //NavienLink::print_buffer(this->recv_buffer.raw_data, HDR_SIZE + this->recv_buffer.hdr.len + 1);
-  crc_r = this->recv_buffer.raw_data[HDR_SIZE + this->recv_buffer.hdr.len];
-  
-  switch(this->recv_buffer.hdr.direction){
-  case PACKET_DIR_STATUS: {
-    uint16_t seed;
-    if (this->recv_buffer.hdr.src == PACKET_SRC_STATUS) {
-      seed = CHECKSUM_SEED_4B;
-    } else {
-      seed = CHECKSUM_SEED_62;
+  //NavienLink::print_buffer(this->recv_frame->raw_data, HDR_SIZE + this->recv_frame->hdr.len + 1);
+  crc_r = this->recv_frame->raw_data[HDR_SIZE + this->recv_frame->hdr.len];
+
+  // The checksum has been accumulated while the packet was being received
+  crc_c = this->recv_checksum.value();
+
+  switch(this->recv_frame->hdr.direction){
+  case PACKET_DIR_STATUS:
+    if (crc_c != crc_r){
+      ESP_LOGE(TAG, "SRC:0x%02X Status Packet checksum error: 0x%02X (calc) != 0x%02X (recv), seed=0x%02X", this->recv_frame->hdr.src, crc_c, crc_r, checksum_seed(this->recv_frame->hdr));
+      NavienLink::print_buffer(this->recv_frame->raw_data, HDR_SIZE + this->recv_frame->hdr.len + 1);
+      return false;
     }
-    crc_c = NavienLink::checksum(this->recv_buffer.raw_data, HDR_SIZE + this->recv_buffer.hdr.len, seed);
+    return true;
+  case PACKET_DIR_CONTROL:
+    // See parse_packet() - we don't know the checksum of control packets between cascaded units
+    if (this->recv_frame->hdr.src != PACKET_SRC_CONTROL)
+      return true;
     if (crc_c != crc_r){
-      ESP_LOGE(TAG, "SRC:0x%02X Status Packet checksum error: 0x%02X (calc) != 0x%02X (recv), seed=0x%02X", this->recv_buffer.hdr.src, crc_c, crc_r, seed);
-      NavienLink::print_buffer(this->recv_buffer.raw_data, HDR_SIZE + this->recv_buffer.hdr.len + 1);
-      break;
+      ESP_LOGE(TAG, "SRC:0x%02X Control Packet checksum error: 0x%02X (calc) != 0x%02X (recv), seed=0x%02X", this->recv_frame->hdr.src, crc_c, crc_r, CHECKSUM_SEED_62);
+      this->on_error();
+      NavienLink::print_buffer(this->recv_frame->raw_data, HDR_SIZE + this->recv_frame->hdr.len + 1);
+      return false;
     }
+    return true;
+  }
+  return false;
+}
+
+void NavienLink::parse_packet(){
+  switch(this->recv_frame->hdr.direction){
+  case PACKET_DIR_STATUS:
     parse_status_packet();
     break;
-  }
   case PACKET_DIR_CONTROL:
   /**
    * The condition below was obsrved in cascade setup where there are lots of 
    * messages, apparently between Navien units and that have some other checksum algorithm that 
    * we're yet to discover. For now we simply ignore those packets. 
    */
-    if (this->recv_buffer.hdr.src != PACKET_SRC_CONTROL) {
-      ESP_LOGD(TAG, "Control packet from SRC:0x%02X - we don't know how to handle it yet", this->recv_buffer.hdr.src);
+    if (this->recv_frame->hdr.src != PACKET_SRC_CONTROL) {
+      ESP_LOGD(TAG, "Control packet from SRC:0x%02X - we don't know how to handle it yet", this->recv_frame->hdr.src);
       return;
     }
-    crc_c = NavienLink::checksum(this->recv_buffer.raw_data, HDR_SIZE + this->recv_buffer.hdr.len, CHECKSUM_SEED_62);
-    if (crc_c != crc_r){
-      ESP_LOGE(TAG, "SRC:0x%02X Control Packet checksum error: 0x%02X (calc) != 0x%02X (recv), seed=0x%02X", this->recv_buffer.hdr.src, crc_c, crc_r, CHECKSUM_SEED_62);
-      this->on_error();
-      NavienLink::print_buffer(this->recv_buffer.raw_data, HDR_SIZE + this->recv_buffer.hdr.len + 1);
-      break;
-    }
     parse_control_packet();
     break;
   }
-
-  //  ESP_LOGV(TAG, "Calculated checksum over %d bytes => 0x%02X", HDR_SIZE + this->recv_buffer.hdr.len, crc);
-
 }
 
 
 void NavienLink::on_error() {
   ESP_LOGD(TAG, "Notifying visitors of communication error");
+  // Visitors reset what they know, the next packets must reach them
+  this->forget_digests();
   for (uint8_t i = 0; i < NAVIEN_CASCADE_MAX; ++i) {
     if (visitors_[i]) {
       visitors_[i]->on_error();
     }
   }
+  for (uint8_t i = 0; i < ALL_SOURCES_VISITORS_MAX && all_sources_visitors_[i]; ++i) {
+    all_sources_visitors_[i]->on_error();
+  }
 }
 
   
+uint16_t NavienLink::fill_rx_buffer(){
+  RX_BUFFER & rx = this->rx_buffer;
+
+  // Whatever is left unread is at most one partial frame. Move it to the front
+  // so that the next frame can be received and parsed contiguously, in place.
+  if (rx.head == rx.tail) {
+    rx.head = rx.tail = 0;
+  } else if (rx.head > 0) {
+    memmove(rx.data, rx.data + rx.head, rx.tail - rx.head);
+    rx.tail -= rx.head;
+    rx.head = 0;
+  }
+
+  uint16_t total = 0;
+  int available = uart->available();
+  rx.fill_start = rx.tail;
+  while (available > 0 && rx.tail < RX_BUFFER_SIZE) {
+    uint8_t chunk = std::min<int>(std::min<int>(available, RX_BUFFER_SIZE - rx.tail), UINT8_MAX);
+    if (!uart->read_array(rx.data + rx.tail, chunk)) {
+      ESP_LOGW(TAG, "Failed to read %d bytes", chunk);
+      break;
+    }
+    rx.tail += chunk;
+    total += chunk;
+    available -= chunk;
+  }
+  if (total > 0) {
+    rx.fill_us = navien_micros();
+    rx.fills++;
+    this->last_rx_us = rx.fill_us;
+  }
+  return total;
+}
+
+uint32_t NavienLink::arrival_time(uint16_t index) const {
+  // The UART doesn't timestamp bytes. The best estimate we have is that the bytes of the
+  // last fill arrived back to back and the last one of them just before we read it.
+  const RX_BUFFER & rx = this->rx_buffer;
+  return rx.fill_us - (uint32_t) (rx.tail - 1 - index) * BYTE_TIME_US;
+}
+
+void NavienLink::parse_rx_buffer(){
+  RX_BUFFER & rx = this->rx_buffer;
+
+  while (rx.head < rx.tail) {
+    uint8_t * start = rx.data + rx.head;
+    uint16_t count = rx.tail - rx.head;
+
+    if (this->echo.pending) {
+      uint8_t echo = this->match_echo(start, count);
+      if (echo == ECHO_INCOMPLETE) {
+        this->rx_wanted = this->echo.len - count;
+        return;
+      }
+      if (echo == ECHO_MATCHED) {
+        this->skip(this->echo.len);
+        continue;
+      }
+    }
+
+    if (*start != PACKET_MARKER) {
+      const uint8_t * marker = static_cast<const uint8_t *>(memchr(start, PACKET_MARKER, count));
+      if (marker == nullptr) {
+        // Nothing but line noise, drop it all and wait for more bytes to come.
+        this->stats.noise_bytes += count;
+        this->skip(count);
+        this->rx_wanted = this->rx_threshold;
+        return;
+      }
+      this->stats.noise_bytes += marker - start;
+      this->skip(marker - start);
+      ESP_LOGV(TAG, "Marker Found");
+      continue;
+    }
+
+    if (!this->recv_started) {
+      this->recv_started = true;
+      this->recv_time.first_byte_us = this->arrival_time(rx.head);
+      this->recv_fill = rx.head >= rx.fill_start ? rx.fills : rx.fills - 1;
+    }
+
+    if (count < HDR_SIZE) {
+      ESP_LOGV(TAG, "Only %d bytes available - less than header size", count);
+      this->rx_wanted = HDR_SIZE - count;
+      return;
+    }
+
+    const HEADER * hdr = reinterpret_cast<const HEADER *>(start);
+    // +1 here is for the checksum - it is in the last byte
+    uint16_t len = HDR_SIZE + hdr->len + 1;
+
+    // A 0xF7 inside a payload (or line noise) looks just like a marker. Reject it right
+    // away if the header can't be real rather than waiting for the bogus length to arrive.
+    if (len > sizeof(RECV_BUFFER)
+        || (hdr->direction != PACKET_DIR_STATUS && hdr->direction != PACKET_DIR_CONTROL)) {
+      ESP_LOGV(TAG, "False marker: direction 0x%02X, length %d", hdr->direction, len);
+      this->stats.false_markers++;
+      if (this->recorder != nullptr)
+        this->recorder->on_rejected(start, HDR_SIZE, REJECT_FALSE_MARKER, this->recv_time.first_byte_us);
+      this->resync();
+      continue;
+    }
+
+    // Fold whatever part of the packet has arrived so far into the running checksum,
+    // so the check is complete once the last byte lands. The trailing checksum byte
+    // itself is not part of the checksum.
+    if (this->recv_checksum_len == 0) {
+      this->recv_checksum.reset(checksum_seed(*hdr));
+    }
+    uint16_t covered = std::min<uint16_t>(count, len - 1);
+    this->recv_checksum.update(start + this->recv_checksum_len, covered - this->recv_checksum_len);
+    this->recv_checksum_len = covered;
+
+    if (count < len) {
+      ESP_LOGV(TAG, "Got %d of %d packet bytes", count, len);
+      this->rx_wanted = len - count;
+      return;
+    }
+    ESP_LOGV(TAG, "Got Packet => %d bytes", len);
+    this->recv_time.last_byte_us = this->arrival_time(rx.head + len - 1);
+
+    this->recv_frame = reinterpret_cast<const RECV_BUFFER *>(start);
+    if (!this->verify_packet()) {
+      // Don't throw the packet away. A real packet may have started anywhere
+      // inside it, so rescan from the byte right after the marker.
+      this->stats.checksum_errors++;
+      if (this->recorder != nullptr)
+        this->recorder->on_rejected(start, len, REJECT_CHECKSUM, this->recv_time.first_byte_us);
+      this->resync();
+      continue;
+    }
+    this->stats.packets++;
+    if (this->recorder != nullptr)
+      this->recorder->on_frame(start, len, this->recv_time.first_byte_us);
+    for (uint8_t i = 0; i < ALL_SOURCES_VISITORS_MAX && all_sources_visitors_[i]; ++i)
+      all_sources_visitors_[i]->on_packet(start, len);
+
+    // Two packets of one fill look back to back, there is no telling the gap between them
+    this->tx_sched.on_packet(*hdr, this->recv_time.first_byte_us, this->recv_time.last_byte_us,
+                             this->line_errors(), this->recv_fill != this->prev_packet_fill);
+    this->prev_packet_fill = rx.fills;
+    this->send_queued();
+
+    // Navien::print_buffer(start, len);
+    this->parse_packet();
+
+    this->skip(len);
+  }
+  this->rx_wanted = this->rx_threshold;
+}
+
+uint8_t NavienLink::match_echo(const uint8_t * start, uint16_t count){
+  NAVIEN_ECHO & echo = this->echo;
+  uint16_t n = std::min<uint16_t>(count, echo.len);
+  if (std::memcmp(start, echo.buffer, n) == 0) {
+    if (n < echo.len)
+      return ECHO_INCOMPLETE;
+    echo.pending = false;
+    this->echo_seen = true;
+    this->stats.echo_ok++;
+    this->stats.echo_latency_us = this->arrival_time(this->rx_buffer.head + echo.len - 1) - echo.tx_us;
+    this->tx_sched.on_echo(true);
+    for (uint8_t i = 0; i < CMD_EFFECT_MAX; i++) {
+      NAVIEN_DELIVERY & d = this->deliveries[i];
+      if ((echo.effects & (1 << i)) && d.active && d.echo_us == 0)
+        d.echo_us = this->stats.echo_latency_us;
+    }
+    ESP_LOGV(TAG, "Echo of our %d byte frame after %u us", echo.len, (unsigned) this->stats.echo_latency_us);
+    return ECHO_MATCHED;
+  }
+
+  echo.pending = false;
+  if (!this->echo_seen)
+    return ECHO_MISMATCH;  // not an echoing transceiver, or we don't know yet
+
+  // Something else drove the line while we were transmitting, or the echo got lost
+  this->stats.echo_corrupt++;
+  this->tx_sched.on_echo(false);
+  echo.resend = !echo.keepalive;
+  ESP_LOGD(TAG, "Echo of our %d byte frame corrupted%s", echo.len, echo.resend ? ", resending" : "");
+  return ECHO_MISMATCH;
+}
+
+void NavienLink::skip(uint16_t count){
+  this->rx_buffer.head += count;
+  this->recv_checksum_len = 0;
+  this->recv_started = false;
+}
+
+void NavienLink::resync(){
+  this->skip(1);
+}
+
+void NavienLink::send_queued(){
+  if (this->echo.staged) {
+    // Another packet came in before the staged frame was written, its slot is gone
+    this->echo.staged = false;
+    this->echo.resend = !this->echo.keepalive;
+  }
+  if (this->listen_only)
+    return;
+  uint32_t now = navien_micros();
+  NAVIEN_DELIVERY * retry = this->due_delivery();
+  if (this->cmd_queue.empty() && retry == nullptr && !this->echo.resend) {
+    if (!this->other_navilink_installed && this->tx_sched.clear_to_send(now, sizeof(NAVILINK_PRESENT))) {
+      // If there's no pending command, send a NAVILINK_PRESENT packet so the unit knows we're here.
+      // When the unit is in an automatic recirculation mode, this tell is that we're controlling 
+      // when it does and does not recirculate (and it triggers the "Recirculation settings must be 
+      // configured through the NaviLink app" message on the unit's front panel when you try to
+      // change the recirculation setting)
+      this->stage_tx(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT), 0, true);
+      // NavienLink::print_buffer(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT));
+    }
+    return;
+  }
+
+  // There are queued commands or retransmissions. Only send when we are sure the bus is clear to avoid collisions.
+  if (this->other_navilink_installed && std::memcmp(this->recv_frame->raw_data, NAVILINK_PRESENT, 5) != 0)
+    return;
+  if (!this->tx_sched.clear_to_send(now, CONTROL_CMD_LEN))
+    return;
+
+  NAVIEN_CMD cmd;
+  if (this->echo.resend) {
+    // The echo of the last frame was corrupted, or the frame never made it out of the
+    // UART. Don't wait for the retry to be due.
+    this->echo.resend = false;
+    uint8_t effects = this->echo.effects;
+    if (this->echo.written) {
+      for (uint8_t i = 0; i < CMD_EFFECT_MAX; i++) {
+        if (effects & (1 << i) && this->deliveries[i].active)
+          this->retransmitted(this->deliveries[i]);
+      }
+      if (effects == 0)
+        this->stats.cmd_retransmits++;
+    }
+    this->stage_tx(this->echo.buffer, this->echo.len, effects, false);
+  } else if (this->cmd_queue.pop(cmd)) {
+    if (cmd.len == 0 && !NavienLink::build_cmd(cmd))
+      return;
+    uint8_t effects = 0;
+    if (cmd.effect != CMD_EFFECT_NONE) {
+      this->track_delivery(cmd);
+      effects = 1 << cmd.effect;
+    }
+    this->tx_sched.on_cmd_sent(now, cmd.queued_us);
+    effects |= this->fuse_pending(cmd);
+    this->stage_tx(cmd.buffer, cmd.len, effects, false);
+    // NavienLink::print_buffer(cmd.buffer, cmd.len);
+  } else if (retry != nullptr) {
+    cmd = retry->cmd;
+    this->retransmitted(*retry);
+    uint8_t effects = 1 << retry->cmd.effect;
+    // Other retransmissions that are due go in the same frame when they don't conflict
+    for (NAVIEN_DELIVERY * d = this->due_delivery(); d != nullptr; d = this->due_delivery()) {
+      if (!NavienLink::can_fuse_cmd(cmd, d->cmd))
+        break;
+      NavienLink::fuse_cmd(cmd, d->cmd);
+      this->retransmitted(*d);
+      effects |= 1 << d->cmd.effect;
+      this->stats.cmd_fused++;
+    }
+    this->stage_tx(cmd.buffer, cmd.len, effects, false);
+  }
+}
+
+void NavienLink::stage_tx(const uint8_t * buffer, uint8_t len, uint8_t effects, bool keepalive){
+  NAVIEN_ECHO & echo = this->echo;
+  if (buffer != echo.buffer)
+    std::memcpy(echo.buffer, buffer, len);
+  echo.len = len;
+  echo.effects = effects;
+  echo.keepalive = keepalive;
+  echo.staged = true;
+  echo.written = false;
+  echo.pending = false;
+}
+
+void NavienLink::flush_tx(){
+  NAVIEN_ECHO & echo = this->echo;
+  if (!echo.staged)
+    return;
+  echo.staged = false;
+
+  // The heater's next packet has already started, writing now would collide with it
+  if (this->rx_buffer.head < this->rx_buffer.tail || uart->available() > 0) {
+    this->stats.tx_line_busy++;
+    echo.resend = !echo.keepalive;
+    ESP_LOGD(TAG, "Packet coming in, %d byte frame deferred", echo.len);
+    return;
+  }
+
+  int room = uart->available_for_write();
+  if (room >= 0 && room < echo.len) {
+    // Writing now would hold the loop until the UART drains
+    this->stats.tx_stalls++;
+    echo.resend = !echo.keepalive;
+    ESP_LOGD(TAG, "UART has room for %d of %d bytes, frame deferred", room, echo.len);
+    return;
+  }
+
+  uint32_t now = navien_micros();
+  uart->write_array(echo.buffer, echo.len);
+  uint32_t spent = navien_micros() - now;
+  this->loop_stats.write_us += spent;
+  this->loop_stats.write_max_us = std::max(this->loop_stats.write_max_us, spent);
+
+  if (this->recorder != nullptr)
+    this->recorder->on_tx(echo.buffer, echo.len, now);
+
+  echo.written = true;
+  echo.pending = true;
+  echo.tx_us = now;
+  // Retries of the commands in the frame are counted from here, not from when it was staged
+  for (uint8_t i = 0; i < CMD_EFFECT_MAX; i++) {
+    NAVIEN_DELIVERY & d = this->deliveries[i];
+    if (!(echo.effects & (1 << i)) || !d.active)
+      continue;
+    d.tx_packet = this->stats.packets;
+    d.packets_since_tx = 0;
+    if (!d.written) {
+      d.written = true;
+      d.first_tx_us = now;
+    }
+  }
+  this->tx_sched.on_transmit(now, echo.len, this->line_errors());
+}
+
+void NavienLink::retransmitted(NAVIEN_DELIVERY & d){
+  d.attempts++;
+  d.packets_since_tx = 0;
+  d.tx_packet = this->stats.packets;
+  this->stats.cmd_retransmits++;
+  ESP_LOGD(TAG, "Retransmitting command, effect %d, attempt %d", d.cmd.effect, d.attempts);
+}
+
+uint8_t NavienLink::fuse_pending(NAVIEN_CMD & cmd){
+  uint8_t effects = 0;
+  for (uint8_t e = CMD_EFFECT_NONE + 1; e < CMD_EFFECT_MAX; e++) {
+    NAVIEN_CMD other;
+    uint8_t value;
+    if (!this->cmd_queue.peek(static_cast<NAVIEN_CMD_EFFECT>(e), value))
+      continue;
+    other.effect = e;
+    other.expected = value;
+    if (!NavienLink::build_cmd(other) || !NavienLink::can_fuse_cmd(cmd, other))
+      continue;
+    // A newer value may have been posted since the peek, it then waits for the next slot
+    if (!this->cmd_queue.take(static_cast<NAVIEN_CMD_EFFECT>(e), value))
+      continue;
+    NavienLink::fuse_cmd(cmd, other);
+    this->track_delivery(other);
+    this->tx_sched.on_cmd_sent(navien_micros(), this->cmd_queue.posted_us(static_cast<NAVIEN_CMD_EFFECT>(e)));
+    this->stats.cmd_fused++;
+    effects |= 1 << e;
+    ESP_LOGD(TAG, "Command with effect %d fused into the frame of effect %d", e, cmd.effect);
+  }
+  return effects;
+}
+
+bool NavienLink::can_fuse_cmd(const NAVIEN_CMD & a, const NAVIEN_CMD & b){
+  if (a.len != CONTROL_CMD_LEN || b.len != CONTROL_CMD_LEN
+      || a.buffer[HDR_SIZE] != CONTROL_CMD_TYPE || b.buffer[HDR_SIZE] != CONTROL_CMD_TYPE
+      || std::memcmp(a.buffer, b.buffer, HDR_SIZE) != 0)
+    return false;
+  // A frame with no field set is meaningful by itself (hot button release), keep it alone
+  bool a_set = false, b_set = false;
+  for (uint8_t i = HDR_SIZE + 1; i < CONTROL_CMD_LEN - 1; i++) {
+    if (a.buffer[i] && b.buffer[i] && a.buffer[i] != b.buffer[i])
+      return false;
+    a_set |= a.buffer[i] != 0;
+    b_set |= b.buffer[i] != 0;
+  }
+  return a_set && b_set;
+}
+
+void NavienLink::fuse_cmd(NAVIEN_CMD & cmd, const NAVIEN_CMD & other){
+  for (uint8_t i = HDR_SIZE + 1; i < CONTROL_CMD_LEN - 1; i++)
+    cmd.buffer[i] |= other.buffer[i];
+  cmd.buffer[CONTROL_CMD_LEN - 1] = NavienLink::checksum(cmd.buffer, CONTROL_CMD_LEN - 1, CHECKSUM_SEED_62);
+}
+
+void NavienLink::track_delivery(const NAVIEN_CMD & cmd){
+  NAVIEN_DELIVERY & d = this->deliveries[cmd.effect];
+  if (d.active)
+    ESP_LOGD(TAG, "Command with effect %d superseded before it was confirmed", cmd.effect);
+  d.cmd = cmd;
+  d.active = true;
+  d.written = false;
+  d.attempts = 1;
+  d.packets_since_tx = 0;
+  d.tx_packet = this->stats.packets;
+  d.first_tx_us = navien_micros();
+  d.echo_us = 0;
+}
+
+NAVIEN_DELIVERY * NavienLink::due_delivery(){
+  for (uint8_t i = 0; i < CMD_EFFECT_MAX; i++) {
+    NAVIEN_DELIVERY & d = this->deliveries[i];
+    if (d.active && d.packets_since_tx >= DELIVERY_RETRY_PACKETS && d.attempts < DELIVERY_MAX_ATTEMPTS)
+      return &d;
+  }
+  return nullptr;
+}
+
+static uint8_t delivery_effect_value(uint8_t effect, const WATER_DATA & water){
+  switch(effect){
+  case CMD_EFFECT_POWER:
+    return water.system_power & POWER_STATUS_ON_OFF_MASK;
+  case CMD_EFFECT_DHW_SET_TEMP:
+    return water.dhw_set_temp;
+  case CMD_EFFECT_RECIRC_SCHEDULED:
+    return water.recirculation_enabled & RECIRC_STATUS_FLAG_SCHEDULED_ON;
+  }
+  return 0;
+}
+
+void NavienLink::check_deliveries(const WATER_DATA & water){
+  for (uint8_t i = 0; i < CMD_EFFECT_MAX; i++) {
+    NAVIEN_DELIVERY & d = this->deliveries[i];
+    // The packet that gave us the transmit slot was sent before the command
+    if (!d.active || d.tx_packet == this->stats.packets)
+      continue;
+
+    if (delivery_effect_value(d.cmd.effect, water) == d.cmd.expected) {
+      this->finish_delivery(d, true);
+      continue;
+    }
+
+    // A frame that didn't make it out in its slot is still waiting for the next one
+    if (d.written)
+      d.packets_since_tx++;
+    if (this->recv_time.last_byte_us - d.first_tx_us > DELIVERY_TIMEOUT_US
+        || (d.attempts >= DELIVERY_MAX_ATTEMPTS && d.packets_since_tx >= DELIVERY_RETRY_PACKETS))
+      this->finish_delivery(d, false);
+  }
+}
+
+void NavienLink::finish_delivery(NAVIEN_DELIVERY & d, bool confirmed){
+  NAVIEN_CMD_RESULT result;
+  result.effect = static_cast<NAVIEN_CMD_EFFECT>(d.cmd.effect);
+  result.confirmed = confirmed;
+  result.attempts = d.attempts;
+  result.latency_us = this->recv_time.last_byte_us - d.first_tx_us;
+  result.echo_us = d.echo_us;
+  d.active = false;
+
+  if (confirmed) {
+    this->stats.cmd_confirmed++;
+    ESP_LOGD(TAG, "Command with effect %d confirmed after %d attempt(s), %u us",
+             result.effect, result.attempts, (unsigned) result.latency_us);
+  } else {
+    this->stats.cmd_failed++;
+    ESP_LOGW(TAG, "Command with effect %d not confirmed after %d attempt(s), giving up",
+             result.effect, result.attempts);
+  }
+
+  NavienLinkVisitorI * owner = this->visitors_[0];
+  if (owner) owner->on_cmd_result(result);
+  for (uint8_t i = 0; i < ALL_SOURCES_VISITORS_MAX && all_sources_visitors_[i]; ++i)
+    all_sources_visitors_[i]->on_cmd_result(result);
+}
+
 void NavienLink::receive() {
   if (uart == nullptr) {
     ESP_LOGE(TAG, "UART pointer is null; skipping receive");
     return;
   }
 
-  int available = uart->available();
-  if (!available) {
+  if (!this->rx_due()) {
+    this->loop_stats.skipped++;
     return;
   }
 
-  ESP_LOGV(TAG, "%d bytes available", available);
-  while (available) {
-    switch (this->recv_state) {
-      case INITIAL:
-        if (this->seek_to_marker()) {
-          this->recv_state = MARKER_FOUND;
-          ESP_LOGV(TAG, "Marker Found");
-          break;
-        }
-        // No marker found and no data left to read. Exit and wait for more bytes to come.
-        return;
-      case MARKER_FOUND:
-        available = uart->available();
-        if (available < HDR_SIZE) {
-          ESP_LOGV(TAG, "Only %d bytes available - less than header size", available);
-          return;
-        }
-        if (!uart->read_array(this->recv_buffer.raw_data, HDR_SIZE)) {
-          ESP_LOGW(TAG, "Failed to read header");
-          this->on_error();
-          break;
-        }
-        this->recv_state = HEADER_PARSED;
-        ESP_LOGV(TAG, "Parsed header. %d bytes of body left", this->recv_buffer.hdr.len);
-        // fall through
-      case HEADER_PARSED: {
-        available = uart->available();
-
-        // +1 here is for the checksum - it is in the last byte
-        uint8_t len = this->recv_buffer.hdr.len + 1;
-        if (available < len) {
-          ESP_LOGV(TAG, "Only %d data bytes available - less than len", available);
-          return;
-        }
-        if (!uart->read_array(this->recv_buffer.raw_data + HDR_SIZE, len)) {
-          ESP_LOGW(TAG, "Failed to read %d bytes", len);
-          this->on_error();
-          break;
-        }
-        ESP_LOGV(TAG, "Got Packet => %d bytes", len + HDR_SIZE);
-
-        if (!this->cmd_buffer.empty()) {
-          // There are queued commands. Only send when we are sure the bus is clear to avoid collisions.
-          if (!this->other_navilink_installed || std::memcmp(this->recv_buffer.raw_data, NAVILINK_PRESENT, 5) == 0) {
-            NAVIEN_CMD cmd = cmd_buffer.back();
-            cmd_buffer.pop_back();
-            uart->write_array(cmd.buffer, cmd.len);
-            // NavienLink::print_buffer(cmd.buffer, cmd.len);
-          }
-        } else {
-          if (!this->other_navilink_installed) {
-            // If there's no pending command, send a NAVILINK_PRESENT packet so the unit knows we're here.
-            // When the unit is in an automatic recirculation mode, this tell is that we're controlling 
-            // when it does and does not recirculate (and it triggers the "Recirculation settings must be 
-            // configured through the NaviLink app" message on the unit's front panel when you try to
-            // change the recirculation setting)
-            uart->write_array(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT));
-            // NavienLink::print_buffer(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT));
-          }
-        }
-
-        // Navien::print_buffer(this->recv_buffer.raw_data, len + HDR_SIZE);
-        this->parse_packet();
-        available = uart->available();
-        this->recv_state = INITIAL;
-        break;
-      }
-    }
+  uint32_t start = navien_micros();
+  this->drain_rx();
+  // Frames are only written once parsing is done, see NAVIEN_ECHO
+  this->flush_tx();
+
+  uint32_t busy = navien_micros() - start;
+  this->loop_stats.calls++;
+  this->loop_stats.busy_us += busy;
+  this->loop_stats.max_us = std::max(this->loop_stats.max_us, busy);
+}
+
+bool NavienLink::rx_due() {
+  int available = uart->available();
+  uint32_t now = navien_micros();
+  bool due = available >= this->rx_wanted;
+
+  if (!due && available != this->rx_seen_available) {
+    this->rx_seen_available = available;
+    this->rx_seen_us = now;
+    return false;
+  }
+  // The line went quiet short of what we are waiting for. Take what there is, an
+  // incomplete packet is dropped by drain_rx().
+  this->rx_idle = false;
+  if (!due && this->idle_timeout_us > 0 && (available > 0 || this->rx_buffer.head < this->rx_buffer.tail)) {
+    due = now - this->rx_seen_us > this->idle_timeout_us;
+    this->rx_idle = due;
+    this->rx_idle_available = available;
+  }
+
+  if (due) {
+    // drain_rx() empties the UART
+    this->rx_seen_available = 0;
+    this->rx_seen_us = now;
+  }
+  return due;
+}
+
+void NavienLink::drain_rx() {
+  // Drain the UART in bulk reads and parse every complete packet in place.
+  // Loop cost scales with the number of packets, not the number of bytes.
+  RX_BUFFER & rx = this->rx_buffer;
+  int drained = 0;
+  while (uint16_t n = this->fill_rx_buffer()) {
+    drained += n;
+    this->parse_rx_buffer();
+  }
+
+  // An incomplete packet followed by a quiet line will never complete - the heater
+  // doesn't pause in the middle of a packet. Drop it rather than letting unrelated
+  // bytes of the next packet complete it. Bytes that came in after rx_due() saw the
+  // line quiet give it another idle timeout.
+  if (this->rx_idle && rx.head < rx.tail && drained <= this->rx_idle_available) {
+    ESP_LOGD(TAG, "Dropping %d bytes of incomplete packet after %u us of idle line",
+             rx.tail - rx.head, (unsigned) (navien_micros() - this->last_rx_us));
+    this->stats.idle_timeouts++;
+    if (this->recorder != nullptr)
+      this->recorder->on_rejected(rx.data + rx.head, rx.tail - rx.head, REJECT_IDLE_TIMEOUT, this->last_rx_us);
+    this->skip(rx.tail - rx.head);
+    this->rx_wanted = this->rx_threshold;
   }
+  this->rx_idle = false;
 }
 
-void NavienLink::send_cmd(const uint8_t * buffer, uint8_t len, uint8_t tries){
+void NavienLink::send_cmd(const uint8_t * buffer, uint8_t len, uint8_t tries, NAVIEN_CMD_PRIORITY prio){
   // Send multiple times by default. In experiments I've noticed
   // that sending once does not always work and that
   // the NaviLink sends the commands multiple times
+  NAVIEN_CMD cmd(buffer, len);
+  cmd.queued_us = navien_micros();
   for (uint8_t i = 0; i < tries; i++) {
-    this->cmd_buffer.push_front(NAVIEN_CMD(buffer, len));
+    if (!this->cmd_queue.push(cmd, prio)) {
+      ESP_LOGW(TAG, "Command queue full, dropping command (%u dropped so far)",
+               (unsigned) this->cmd_queue.dropped());
+      break;
+    }
+  }
+}
+
+void NavienLink::post_cmd(NAVIEN_CMD_EFFECT effect, uint8_t expected){
+  if (this->cmd_queue.post(effect, expected, navien_micros())) {
+    ESP_LOGV(TAG, "Command with effect %d superseded before transmission (%u coalesced so far)",
+             effect, (unsigned) this->cmd_queue.coalesced());
+  }
+}
+
+bool NavienLink::build_cmd(NAVIEN_CMD & cmd){
+  switch(cmd.effect){
+  case CMD_EFFECT_POWER:
+    if (cmd.expected)
+      cmd.set(TURN_ON_CMD, sizeof(TURN_ON_CMD));
+    else
+      cmd.set(TURN_OFF_CMD, sizeof(TURN_OFF_CMD));
+    return true;
+  case CMD_EFFECT_DHW_SET_TEMP:
+    cmd.set(DHW_SET_TEMP_CMD_TEMPLATE, sizeof(DHW_SET_TEMP_CMD_TEMPLATE));
+    cmd.buffer[CONTROL_CMD_TEMP] = cmd.expected;
+    cmd.buffer[cmd.len - 1] = NavienLink::checksum(cmd.buffer, cmd.len - 1, CHECKSUM_SEED_62);
+    ESP_LOGD(TAG, "DHW set temp command, raw 0x%02X", cmd.expected);
+    return true;
+  case CMD_EFFECT_RECIRC_SCHEDULED:
+    if (cmd.expected)
+      cmd.set(SCHEDULED_RECIRC_ON_CMD, sizeof(SCHEDULED_RECIRC_ON_CMD));
+    else
+      cmd.set(SCHEDULED_RECIRC_OFF_CMD, sizeof(SCHEDULED_RECIRC_OFF_CMD));
+    return true;
   }
+  return false;
 }
   
 void NavienLink::send_turn_on_cmd(){
-  this->send_cmd(TURN_ON_CMD, sizeof(TURN_ON_CMD));
+  this->post_cmd(CMD_EFFECT_POWER, POWER_STATUS_ON_OFF_MASK);
 }
 
 void NavienLink::send_turn_off_cmd(){
-  this->send_cmd(TURN_OFF_CMD, sizeof(TURN_OFF_CMD));
+  this->post_cmd(CMD_EFFECT_POWER, 0);
 }
 
 void NavienLink::send_hot_button_cmd(){
-  this->send_cmd(HOT_BUTTON_PRESS_CMD, sizeof(HOT_BUTTON_PRESS_CMD));
-  this->send_cmd(HOT_BUTTON_RELSE_CMD, sizeof(HOT_BUTTON_RELSE_CMD), 1);
+  this->send_cmd(HOT_BUTTON_PRESS_CMD, sizeof(HOT_BUTTON_PRESS_CMD), 2, CMD_PRIO_HIGH);
+  this->send_cmd(HOT_BUTTON_RELSE_CMD, sizeof(HOT_BUTTON_RELSE_CMD), 1, CMD_PRIO_HIGH);
 }
   
 
 void NavienLink::send_dhw_set_temp_cmd(float temp){
-  uint8_t cmd[19];
-  memcpy(cmd, DHW_SET_TEMP_CMD_TEMPLATE, sizeof(DHW_SET_TEMP_CMD_TEMPLATE));
-  cmd[9] = temp * 2 + 0.5;
-  cmd[18] = NavienLink::checksum(cmd, sizeof(DHW_SET_TEMP_CMD_TEMPLATE) - 1, CHECKSUM_SEED_62);
+  this->send_dhw_set_temp_raw_cmd((uint8_t) (temp * 2 + 0.5));
+}
 
-  NavienLink::print_buffer(cmd, sizeof(DHW_SET_TEMP_CMD_TEMPLATE));
-  this->send_cmd(cmd, sizeof(DHW_SET_TEMP_CMD_TEMPLATE));
+void NavienLink::send_dhw_set_temp_raw_cmd(uint8_t raw){
+  // The packet is built once the command gets a transmit slot, see build_cmd()
+  this->post_cmd(CMD_EFFECT_DHW_SET_TEMP, raw);
 }
 
 void NavienLink::send_scheduled_recirculation_on_cmd(){
-  this->send_cmd(SCHEDULED_RECIRC_ON_CMD, sizeof(SCHEDULED_RECIRC_ON_CMD));
+  this->post_cmd(CMD_EFFECT_RECIRC_SCHEDULED, RECIRC_STATUS_FLAG_SCHEDULED_ON);
 }
 
 void NavienLink::send_scheduled_recirculation_off_cmd(){
-  this->send_cmd(SCHEDULED_RECIRC_OFF_CMD, sizeof(SCHEDULED_RECIRC_OFF_CMD));
+  this->post_cmd(CMD_EFFECT_RECIRC_SCHEDULED, 0);
 }
 
 /**
@@ -319,30 +865,8 @@ void NavienLink::print_buffer(const uint8_t *data, size_t length) {
  }
 
   
-uint8_t NavienLink::checksum(const uint8_t * buffer, uint8_t len, uint16_t seed){  
-  uint16_t result;
-
-  if (len < 2) {
-    result = 0x00;
-  }
-  else {
-    result = 0xff;
-
-    for (uint i = 0; i < len; i++){
-      result = result << 1;
-
-      if (result > 0xff){
-	result = (result & 0xff) ^ seed;
-      }
-
-      // this is important!!
-      // the checksum is calculated
-      // based on the lower byte, i.e.
-      // only the lower byte is XOR-ed
-      result = ((uint8_t)result) ^ (uint16_t)buffer[i];
-    }
-  }
-  return result;
+uint8_t NavienLink::checksum(const uint8_t * buffer, uint8_t len, uint16_t seed){
+  return NavienChecksum::compute(buffer, len, seed);
 }
 
 
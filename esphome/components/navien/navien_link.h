@@ -1,29 +1,19 @@
 #pragma once
 
+#include <algorithm>
 #include <cinttypes>
-#include <list>
-
-#include "esphome/core/helpers.h"
-
-
-#include "esphome/core/component.h"
-#include "esphome/components/sensor/sensor.h"
-#ifdef USE_SWITCH
-#include "esphome/components/switch/switch.h"
-#endif
-#include "esphome/components/uart/uart.h"
+#include <cstddef>
+#include <cstring>
 
+#include "navien_checksum.h"
+#include "navien_cmd_queue.h"
+#include "navien_recorder.h"
+#include "navien_tx_sched.h"
 #include "navien_proto.h"
 
 namespace esphome {
 namespace navien {
 
-  
-typedef enum{
-  INITIAL,
-  MARKER_FOUND,
-  HEADER_PARSED
-} READ_STATE;
 
 typedef union{
     struct{
@@ -35,15 +25,116 @@ typedef union{
     };
     uint8_t    raw_data[128];
 } RECV_BUFFER;
-  
-typedef struct _NAVIEN_CMD{
-  uint8_t   buffer[64];
+
+/**
+ * Link statistics, useful to judge the quality of the RS485 line
+ */
+typedef struct{
+  uint32_t packets;          // packets that passed the checksum
+  uint32_t checksum_errors;  // packets rejected because of the checksum
+  uint32_t false_markers;    // 0xF7 bytes rejected as a marker because of an impossible header
+  uint32_t noise_bytes;      // bytes dropped while looking for a marker
+  uint32_t idle_timeouts;    // incomplete packets dropped because the line went quiet
+  uint32_t cmd_confirmed;    // commands whose effect showed up in a status packet
+  uint32_t cmd_failed;       // commands given up on
+  uint32_t cmd_retransmits;  // transmissions beyond the first one
+  uint32_t cmd_fused;        // commands merged into another command's frame
+  uint32_t echo_ok;          // transmitted frames read back intact by the transceiver
+  uint32_t echo_corrupt;     // transmitted frames read back corrupted or not at all
+  uint32_t echo_latency_us;  // last frame, from writing it to its echo's last byte
+  uint32_t tx_stalls;        // frames not written because the UART had no room for them
+  uint32_t tx_line_busy;     // frames not written because the next packet was already coming in
+  uint32_t unchanged_hits;   // status packets identical to the previous one of their unit and kind, not dispatched
+  uint32_t unchanged_misses; // status packets that changed, dispatched to the visitors
+} NAVIEN_LINK_STATS;
+
+/**
+ * How long receive() holds the CPU, accumulated until take_loop_stats() is called
+ */
+typedef struct{
+  uint32_t skipped;       // receive() calls that returned at once, not enough data to matter
+  uint32_t calls;         // receive() calls that drained the UART
+  uint32_t busy_us;       // total time spent in them
+  uint32_t max_us;        // the longest one
+  uint32_t write_us;      // total time spent in NavienUartI::write_array()
+  uint32_t write_max_us;  // the longest write
+} NAVIEN_LOOP_STATS;
+
+/**
+ * Estimated arrival times of the first (marker) and the last (checksum) byte of a packet,
+ * in microseconds of the platform clock.
+ */
+typedef struct{
+  uint32_t first_byte_us;
+  uint32_t last_byte_us;
+} NAVIEN_FRAME_TIME;
+
+/**
+ * Outcome of a command with an expected effect, reported through NavienLinkVisitorI::on_cmd_result
+ */
+typedef struct{
+  NAVIEN_CMD_EFFECT effect;
+  bool      confirmed;   // false if the command was given up on
+  uint8_t   attempts;    // number of transmissions
+  uint32_t  latency_us;  // first transmission to the status packet that confirmed it
+  uint32_t  echo_us;     // first transmission to its echo, 0 if the transceiver doesn't echo
+} NAVIEN_CMD_RESULT;
+
+/**
+ * A transmitted command waiting for its effect to show up in the status packets
+ */
+typedef struct{
+  NAVIEN_CMD cmd;
+  bool      active;
+  bool      written;           // the command made it to the UART at least once
+  uint8_t   attempts;
+  uint8_t   packets_since_tx;  // water packets of the main unit seen since the last transmission
+  uint32_t  tx_packet;         // stats.packets when last transmitted
+  uint32_t  first_tx_us;       // when queued until written
+  uint32_t  echo_us;           // see NAVIEN_CMD_RESULT
+} NAVIEN_DELIVERY;
+
+/**
+ * The frame being transmitted. send_queued() stages it while packets are parsed, flush_tx()
+ * writes it once receive() is done with the rx buffer.
+ *
+ * Most RS485 transceivers read back what we transmit, the echo is matched against the
+ * frame byte by byte so it isn't taken for another controller's frame, and a corrupted
+ * echo is known to be a collision before the frame is even over.
+ */
+typedef struct{
+  uint8_t   buffer[sizeof(NAVIEN_CMD::buffer)];
   uint8_t   len;
-  _NAVIEN_CMD(const uint8_t * b, uint8_t l) {
-    len = std::min(l, static_cast<uint8_t>(sizeof(buffer)));
-    memcpy(buffer, b, len);
-  }
-} NAVIEN_CMD;
+  bool      staged;     // waiting for flush_tx()
+  bool      written;    // handed to the UART
+  bool      pending;    // written, echo not matched yet
+  bool      resend;     // the echo came back corrupted, send the frame again at the next opportunity
+  bool      keepalive;  // NAVILINK_PRESENT, not worth resending
+  uint8_t   effects;    // bit mask of the tracked effects the frame carries
+  uint32_t  tx_us;
+} NAVIEN_ECHO;
+
+/**
+ * Digest of the last status packet of one unit and kind (water/gas), see set_skip_unchanged()
+ */
+typedef struct{
+  uint32_t hash;       // FNV-1a of the header and payload
+  bool     valid;
+} NAVIEN_FRAME_DIGEST;
+
+/**
+ * Receive buffer the UART is drained into with bulk reads. Packets are parsed in place
+ * between head and tail; the unread remainder (at most one partial packet) is moved
+ * back to the front before the next fill.
+ */
+typedef struct{
+  uint8_t  data[256];
+  uint16_t head;
+  uint16_t tail;
+  uint16_t fill_start;  // where the bytes of the most recent fill start
+  uint32_t fill_us;     // when the most recent fill happened
+  uint32_t fills;       // number of fills so far
+} RX_BUFFER;
 
 
  /**
@@ -57,6 +148,12 @@ public:
   virtual uint8_t read_byte(uint8_t * byte) = 0;
   virtual bool read_array(uint8_t * data, uint8_t len) = 0;
   virtual void write_array(const uint8_t * data, uint8_t len) = 0; 
+
+  /**
+   * Number of bytes write_array() can take right now without blocking until the line
+   * drains, or a negative value if it never blocks
+   */
+  virtual int available_for_write() { return -1; }
 };
 
 /**
@@ -68,19 +165,33 @@ public:
   /**
    * Called then the direction is from Navien to reporting device
    * and type field is PACKET_DST_WATER
+   * @param hdr - the packet header. hdr.src identifies the cascade unit,
+   *              hdr.sys_type the device family (0x05 NPE, 0x06 NCB-H, ...)
    * @param water - the data payload of the water packet
-   * @param src - the source address from the packet header
    */  
-  virtual void on_water(const WATER_DATA & water, uint8_t src) = 0;
+  virtual void on_water(const HEADER & hdr, const WATER_DATA & water) = 0;
 
   /**
    * Called then the direction is from Navien to reporting device
    * and type field is PACKET_DST_GAS
+   * @param hdr - the packet header
    * @param gas - the data payload of the gas packet
-   * @param src - the source address from the packet header
    */  
-  virtual void on_gas(const GAS_DATA & gas, uint8_t src)   = 0;
+  virtual void on_gas(const HEADER & hdr, const GAS_DATA & gas)   = 0;
   virtual void on_error()     = 0;
+
+  /**
+   * Called when a command with an expected effect is either confirmed by a status
+   * packet of the main unit or given up on.
+   */
+  virtual void on_cmd_result(const NAVIEN_CMD_RESULT &) {}
+
+  /**
+   * Called with every packet that passed the checksum, status and control packets alike,
+   * from the marker to the checksum byte, before it is decoded. Only visitors of all
+   * sources get it, e.g. tools that print the traffic.
+   */
+  virtual void on_packet(const uint8_t *, uint16_t) {}
 };
 
 
@@ -93,14 +204,45 @@ public:
   static NavienLink* get_instance(NavienUartI* uart = nullptr);
 public:
   static const uint8_t NAVIEN_CASCADE_MAX = 16;
+  static const uint16_t RX_BUFFER_SIZE = sizeof(RX_BUFFER::data);
+
+  // Time on the wire of one byte at 19200 baud, 8N1 (10 bits)
+  static const uint32_t BYTE_TIME_US = 521;
+
+  // Default for set_idle_timeout_us()
+  static const uint32_t DEFAULT_IDLE_TIMEOUT_US = 20000;
+
+  // Default for set_rx_threshold(), enough to see the length of the next packet
+  static const uint8_t DEFAULT_RX_THRESHOLD = HDR_SIZE;
+
+  // Max number of visitors subscribed to packets from all sources
+  static const uint8_t ALL_SOURCES_VISITORS_MAX = 4;
+
+  // A command is retransmitted after this many water packets without its effect
+  static const uint8_t DELIVERY_RETRY_PACKETS = 2;
+  // and given up on after this many transmissions or this much time
+  static const uint8_t DELIVERY_MAX_ATTEMPTS = 3;
+  static const uint32_t DELIVERY_TIMEOUT_US = 5000000;
+
+  // match_echo() results
+  static const uint8_t ECHO_MISMATCH = 0;
+  static const uint8_t ECHO_MATCHED = 1;
+  static const uint8_t ECHO_INCOMPLETE = 2;
+
   NavienLink(NavienUartI* u) : uart(u) {
     memset(visitors_, 0, sizeof(visitors_));
+    memset(all_sources_visitors_, 0, sizeof(all_sources_visitors_));
+    memset(&rx_buffer, 0, sizeof(rx_buffer));
+    memset(&stats, 0, sizeof(stats));
+    memset(&recv_time, 0, sizeof(recv_time));
   }
 
   /**
-   * Register a visitor to receive callbacks when packets are received.
+   * Register a visitor to receive callbacks for packets of one cascade unit.
+   * Packets are routed by source address, so the visitor only sees packets
+   * with hdr.src == PACKET_SRC_STATUS + src.
    * @param visitor - pointer to the visitor instance
-   * @param src - index in the visitor array (0-15), defaults to 0
+   * @param src - cascade unit index (0-15), defaults to 0
    */
   void add_visitor(NavienLinkVisitorI *visitor, uint8_t src = 0) {
     if (visitor != nullptr && src < NAVIEN_CASCADE_MAX) {
@@ -108,6 +250,21 @@ public:
     }
   }
 
+  /**
+   * Register a visitor to receive callbacks for packets of all cascade units,
+   * e.g. for aggregators and diagnostics.
+   * @return false if there are no free slots left
+   */
+  bool add_all_sources_visitor(NavienLinkVisitorI *visitor) {
+    for (uint8_t i = 0; visitor != nullptr && i < ALL_SOURCES_VISITORS_MAX; ++i) {
+      if (all_sources_visitors_[i] == nullptr) {
+        all_sources_visitors_[i] = visitor;
+        return true;
+      }
+    }
+    return false;
+  }
+
   /**
    * Reads whaterver data came through UART and attempts to interpret it as Navien protocol data.
    * In case of success it calls methods of NavienLinkVisitorI with gas or water data (or an errror).
@@ -116,6 +273,15 @@ public:
    */
   void receive(); // Implementation should call all registered visitors
 
+  /**
+   * Returns how long receive() held the CPU since the previous call and starts over.
+   */
+  NAVIEN_LOOP_STATS take_loop_stats() {
+    NAVIEN_LOOP_STATS s = this->loop_stats;
+    this->loop_stats = {};
+    return s;
+  }
+
   /**
    * Returns true if connected, otherwise false.
    *
@@ -126,6 +292,88 @@ public:
    * Returns true if we're sharing the RS485 bus with another NaviLink-like device, otherwise false.
    */
   bool is_other_navilink_installed(){return this->other_navilink_installed;}
+
+  /**
+   * Returns receive statistics accumulated since boot.
+   */
+  const NAVIEN_LINK_STATS & get_stats() const {return this->stats;}
+
+  /**
+   * Returns arrival times of the packet being dispatched. Only meaningful
+   * when called from within NavienLinkVisitorI callbacks.
+   */
+  const NAVIEN_FRAME_TIME & get_frame_time() const {return this->recv_time;}
+
+  /**
+   * How long the line must stay quiet before an incomplete packet is dropped.
+   * 0 disables the timeout.
+   */
+  void set_idle_timeout_us(uint32_t timeout){this->idle_timeout_us = timeout;}
+
+  /**
+   * Don't dispatch a status packet that is identical to the previous one of the same unit
+   * and kind. The heater repeats the same water and gas packets several times a second,
+   * visitors only hear about changes then. Command delivery still sees every packet and
+   * get_fresh_us() tells when the unit was last heard from. On by default.
+   */
+  void set_skip_unchanged(bool skip){
+    this->skip_unchanged = skip;
+    this->forget_digests();
+  }
+
+  /**
+   * Only listen to the line, never transmit: no NAVILINK_PRESENT heartbeat and queued
+   * commands stay queued. For tools decoding captures of another controller's traffic,
+   * whose frames would otherwise be taken for the echo of our own heartbeat.
+   */
+  void set_listen_only(bool listen){this->listen_only = listen;}
+
+  /**
+   * When the last status packet of the given cascade unit (0-15) arrived, changed or not
+   */
+  uint32_t get_fresh_us(uint8_t src) const {
+    return src < NAVIEN_CASCADE_MAX ? __atomic_load_n(&this->fresh_us[src], __ATOMIC_RELAXED) : 0;
+  }
+
+  /**
+   * Minimum number of bytes the UART must hold before receive() drains it when no packet
+   * is in progress. Once a packet header is in, receive() waits for the rest of the packet
+   * instead. 1 drains on every byte. Capped at HDR_SIZE: more could hold a short frame back
+   * until the idle timeout, past the transmit slot after it.
+   */
+  void set_rx_threshold(uint8_t bytes){
+    this->rx_threshold = std::min<uint8_t>(bytes ? bytes : 1, HDR_SIZE);
+    this->rx_wanted = this->rx_threshold;
+  }
+
+  /**
+   * Record the traffic, see navien_recorder.h. nullptr (default) stops recording.
+   */
+  void set_recorder(NavienFrameRecorder * recorder){this->recorder = recorder;}
+
+  /**
+   * Number of commands waiting to be transmitted in the given priority lane
+   */
+  uint8_t get_cmd_queue_depth(NAVIEN_CMD_PRIORITY prio) const {return this->cmd_queue.depth(prio);}
+
+  /**
+   * Number of commands dropped since boot because their lane was full
+   */
+  uint32_t get_cmd_queue_dropped() const {return this->cmd_queue.dropped();}
+
+  /**
+   * Number of power, setpoint and recirculation commands superseded by a newer one
+   * of the same kind before they were transmitted
+   */
+  uint32_t get_cmd_queue_coalesced() const {return this->cmd_queue.coalesced();}
+
+  /**
+   * Transmit statistics: frames sent, collisions, skipped transmit opportunities and
+   * time commands spend waiting for a transmit slot
+   */
+  const NAVIEN_TX_STATS & get_tx_stats() const {return this->tx_sched.get_stats();}
+  float get_collision_rate() const {return this->tx_sched.collision_rate();}
+  uint32_t get_avg_cmd_wait_us() const {return this->tx_sched.avg_cmd_wait_us();}
   
   /**
    * Send commands
@@ -136,6 +384,8 @@ public:
   void send_scheduled_recirculation_on_cmd();
   void send_scheduled_recirculation_off_cmd();
   void send_dhw_set_temp_cmd(float temp);
+  // Set temperature in the 0.5 C units of the wire, see NavienDecoder::temp_to_raw()
+  void send_dhw_set_temp_raw_cmd(uint8_t raw);
 
   
 public:
@@ -156,18 +406,98 @@ protected:
    * @param seed   - the seed value. There are two known values, either CHECKSUM_SEED_4B or CHECKSUM_SEED_62
    */
   static uint8_t checksum(const uint8_t * buffer, uint8_t len, uint16_t seed);
+
+  /**
+   * Select the checksum seed for a packet based on its header
+   */
+  static uint16_t checksum_seed(const HEADER & hdr);
   
 protected:
-  //  void    clear_buffer();
-  bool    seek_to_marker();
+  /**
+   * Drain whatever the UART has into rx_buffer using bulk reads.
+   * @return number of bytes read
+   */
+  uint16_t fill_rx_buffer();
+
+  /**
+   * Parse all complete packets in rx_buffer and drop the line noise between them.
+   */
+  void     parse_rx_buffer();
+
+  /**
+   * Estimated arrival time of the byte at the given rx_buffer index
+   */
+  uint32_t arrival_time(uint16_t index) const;
+
+  /**
+   * Consume count bytes at the head of rx_buffer, the next byte starts a new packet
+   */
+  void     skip(uint16_t count);
+
+  /**
+   * Drop the marker at the head of rx_buffer and look for the next one, keeping
+   * all bytes after it. Called when the packet at the head turns out to be bogus.
+   */
+  void     resync();
+
+  /**
+   * Called after every received packet. Sends the next queued command or
+   * the NAVILINK_PRESENT heartbeat if the bus is ours and tx_sched predicts
+   * enough idle time for it.
+   */
+  void     send_queued();
+
+  /**
+   * True if the UART holds the rest of the packet in progress (or rx_threshold bytes
+   * between packets), or nothing new has arrived for the idle timeout. Cheap enough to
+   * call on every loop.
+   */
+  bool     rx_due();
+
+  /**
+   * Drop the incomplete packet of a quiet line, then drain the UART and parse what came in
+   */
+  void     drain_rx();
+
+  /**
+   * Stage a frame for flush_tx() and remember it for echo matching
+   * @param effects - bit mask of the tracked effects the frame carries
+   * @param keepalive - true for NAVILINK_PRESENT
+   */
+  void     stage_tx(const uint8_t * buffer, uint8_t len, uint8_t effects, bool keepalive);
+
+  /**
+   * Write the staged frame if the UART can take all of it without blocking. Otherwise
+   * the transmit slot is given up and the frame goes out at the next opportunity.
+   */
+  void     flush_tx();
+
+  /**
+   * Match the bytes at the head of rx_buffer against the echo of our last frame.
+   * @return ECHO_MATCHED if they are the echo (the caller skips it),
+   *         ECHO_INCOMPLETE if they match so far but the echo isn't complete yet,
+   *         ECHO_MISMATCH if they are something else - the echo was corrupted, or the
+   *         transceiver doesn't echo. The bytes are then parsed as usual.
+   */
+  uint8_t  match_echo(const uint8_t * start, uint16_t count);
+
+  /**
+   * Line errors so far, used by tx_sched to detect collisions
+   */
+  uint32_t line_errors() const {
+    return this->stats.checksum_errors + this->stats.false_markers + this->stats.noise_bytes;
+  }
 
 
   /**
    * Data extraction routines.
-   * Copy the raw data from recv_buffer to internal representation
+   * Copy the raw data from recv_frame to internal representation
    * in this->state where it is stored and reported upon "update" calls.
    */
 
+  // Checks the checksum of the packet in recv_frame, returns true if the packet is valid
+  bool verify_packet();
+
   // Common entry point that is always called upon receipt of a valid packet
   // calls parse_water/gas depending on the paket type
   void parse_packet();
@@ -179,6 +509,19 @@ protected:
   // Called when we receive a status packet from Navien device 
   void parse_status_packet();
 
+  // Returns the visitor that owns the source address of the packet, or nullptr
+  NavienLinkVisitorI * route(const HEADER & hdr) const;
+
+  /**
+   * Compare the status packet in recv_frame with the previous one of its unit and kind
+   * and remember it. A changed gas packet also forgets the water packet of the unit.
+   * @return true if it is identical
+   */
+  bool unchanged(const HEADER & hdr);
+
+  // Make the next status packet of every unit count as changed
+  void forget_digests();
+
 protected:
   /**
    * Send command to Navien unit.
@@ -186,32 +529,148 @@ protected:
    * @param buffer - command to be sent.
    * @param len - the length of buffer
    * @param tries - number of times to send the command
+   * @param prio - transmit priority lane
+   */
+  void send_cmd(const uint8_t * buffer, uint8_t len, uint8_t tries = 2,
+                NAVIEN_CMD_PRIORITY prio = CMD_PRIO_NORMAL);
+
+  /**
+   * Post a state setting command. Supersedes a not yet transmitted command of the same
+   * kind, the packet itself is built by build_cmd() when the command gets a transmit slot.
+   * Once transmitted it is retransmitted until the status packets show its effect,
+   * see NAVIEN_DELIVERY.
+   *
+   * @param effect - the WATER_DATA field the command changes
+   * @param expected - the value of that field once the command is applied
+   */
+  void post_cmd(NAVIEN_CMD_EFFECT effect, uint8_t expected);
+
+  /**
+   * Build the packet of a command taken from a latest-wins slot of cmd_queue
+   * @return false if the effect is unknown
+   */
+  static bool build_cmd(NAVIEN_CMD & cmd);
+
+  /**
+   * True if both commands are 0x4F control frames that don't set the same field to
+   * different values, i.e. they can be sent as one frame
    */
-  void send_cmd(const uint8_t * buffer, uint8_t len, uint8_t tries = 2);
+  static bool can_fuse_cmd(const NAVIEN_CMD & a, const NAVIEN_CMD & b);
+
+  /**
+   * Merge the fields of other into cmd and update the checksum. Call can_fuse_cmd() first.
+   */
+  static void fuse_cmd(NAVIEN_CMD & cmd, const NAVIEN_CMD & other);
+
+  /**
+   * Merge the pending state setting commands that don't conflict with cmd into it
+   * and start tracking their delivery
+   * @return bit mask of the fused effects
+   */
+  uint8_t fuse_pending(NAVIEN_CMD & cmd);
+
+  // Count a transmission of an already tracked command
+  void retransmitted(NAVIEN_DELIVERY & d);
+
+  // Start tracking a command that was just transmitted for the first time
+  void track_delivery(const NAVIEN_CMD & cmd);
+
+  // A tracked command that is due for retransmission, or nullptr
+  NAVIEN_DELIVERY * due_delivery();
+
+  // Confirm or give up on tracked commands based on a water packet of the main unit
+  void check_deliveries(const WATER_DATA & water);
+
+  // Report the outcome of a tracked command and stop tracking it
+  void finish_delivery(NAVIEN_DELIVERY & d, bool confirmed);
   void on_error();
   
 protected:
   // Uart Send/Receive facility
   NavienUartI*       uart;
 
-  // Callback to be called when various packet types
-  // are received
-  // Visitor array for callbacks
+  // Callbacks to be called when various packet types are received,
+  // indexed by source address - PACKET_SRC_STATUS
   NavienLinkVisitorI *visitors_[NAVIEN_CASCADE_MAX];
 
-  // Keeps track of the state machine and iterates through
-  // initialized -> marker found -> header parsed -> data parsed -> initialized
-  READ_STATE   recv_state = INITIAL;
+  // Visitors that want packets from every source
+  NavienLinkVisitorI *all_sources_visitors_[ALL_SOURCES_VISITORS_MAX];
 
   // Data received off the wire
-  RECV_BUFFER  recv_buffer;
+  RX_BUFFER    rx_buffer;
+
+  // The packet currently being parsed, points into rx_buffer
+  const RECV_BUFFER * recv_frame = nullptr;
+
+  // Checksum of the packet at the head of rx_buffer, updated as bytes arrive
+  NavienChecksum recv_checksum;
+
+  // Number of bytes of that packet already folded into recv_checksum
+  uint16_t     recv_checksum_len = 0;
+
+  // True once the packet at the head of rx_buffer has been timestamped
+  bool         recv_started = false;
+
+  // Arrival times of the packet at the head of rx_buffer
+  NAVIEN_FRAME_TIME recv_time;
+
+  // Fill that brought the first byte of that packet, and the last byte of the previous
+  // valid one. Arrival times within one fill are estimated, see arrival_time().
+  uint32_t     recv_fill = 0;
+  uint32_t     prev_packet_fill = UINT32_MAX;
+
+  // When the last byte was received, for idle line detection
+  uint32_t     last_rx_us = 0;
+  uint32_t     idle_timeout_us = DEFAULT_IDLE_TIMEOUT_US;
+
+  // Bytes the UART must hold for rx_due(): rx_threshold between packets, the rest of
+  // the packet at the head of rx_buffer otherwise. Set by parse_rx_buffer().
+  uint8_t      rx_threshold = DEFAULT_RX_THRESHOLD;
+  uint16_t     rx_wanted = DEFAULT_RX_THRESHOLD;
+
+  // UART byte count seen by the last rx_due() and since when, for idle line detection
+  // while bytes are left in the UART
+  int          rx_seen_available = 0;
+  uint32_t     rx_seen_us = 0;
+  // rx_due() found the line quiet for the idle timeout with rx_idle_available bytes in
+  // the UART, drain_rx() drops an incomplete packet unless more came in since
+  bool         rx_idle = false;
+  int          rx_idle_available = 0;
+
+  NAVIEN_LINK_STATS stats;
 
   // Flag indicating if we've seen control packets that we didn't send, which means an actual NaviLink is also present
   bool other_navilink_installed = false;
 
-  // Buffer for queued commands.
-  // TODO: add thread safety - cmd_buffer is used in different thread contexts
-  std::list<NAVIEN_CMD> cmd_buffer;
+  // See set_listen_only()
+  bool listen_only = false;
+
+  // Queued commands. Filled by send_*_cmd() from any context, drained by receive()
+  NavienCmdQueue cmd_queue;
+
+  // Transmitted commands waiting for confirmation, one per effect - a newer command
+  // with the same effect supersedes the older one. Only used from receive().
+  NAVIEN_DELIVERY deliveries[CMD_EFFECT_MAX] = {};
+
+  // Decides when the bus is free for us to transmit
+  NavienTxScheduler tx_sched;
+
+  // Our frame, from staging it until the transceiver reads it back
+  NAVIEN_ECHO echo = {};
+
+  NAVIEN_LOOP_STATS loop_stats = {};
+
+  // Last status packet of every unit, water and gas
+  bool                skip_unchanged = true;
+  NAVIEN_FRAME_DIGEST digests[NAVIEN_CASCADE_MAX][2] = {};
+  uint32_t            fresh_us[NAVIEN_CASCADE_MAX] = {};
+
+  // Where the traffic is recorded, or nullptr
+  NavienFrameRecorder * recorder = nullptr;
+
+  // Set once the transceiver echoed a frame. Until then a frame that doesn't come back
+  // is not held against the line, the hardware may simply not echo.
+  bool echo_seen = false;
 };
 
   
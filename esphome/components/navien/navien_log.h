@@ -0,0 +1,37 @@
+/**
+ * Logging shim for the protocol core (NavienLink and friends).
+ *
+ * Inside ESPHome this simply pulls in the ESPHome logger. When the protocol core
+ * is built on a workstation (NAVIEN_HOST defined, see the top level CMakeLists.txt)
+ * the ESP_LOGx macros are mapped onto stderr so that the very same sources compile
+ * without any of the ESPHome headers.
+ */
+
+#pragma once
+
+#ifdef NAVIEN_HOST
+
+#include <cstdio>
+
+// 0 - none, 1 - error, 2 - warning, 3 - info, 4 - debug, 5 - verbose
+#ifndef NAVIEN_HOST_LOG_LEVEL
+#define NAVIEN_HOST_LOG_LEVEL 2
+#endif
+
+#define NAVIEN_HOST_LOG(level, letter, tag, format, ...)                        \
+  do {                                                                          \
+    if (NAVIEN_HOST_LOG_LEVEL >= (level))                                       \
+      fprintf(stderr, "[" letter "][%s] " format "\n", tag, ##__VA_ARGS__);     \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...) NAVIEN_HOST_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) NAVIEN_HOST_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) NAVIEN_HOST_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) NAVIEN_HOST_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) NAVIEN_HOST_LOG(5, "V", tag, format, ##__VA_ARGS__)
+
+#else
+
+#include "esphome/core/log.h"
+
+#endif
@@ -0,0 +1,91 @@
+#include "navien_metrics.h"
+#include "navien_link.h"
+
+namespace esphome {
+namespace navien {
+
+  static const uint8_t FROM_PACKETS = METRIC_FROM_WATER | METRIC_FROM_GAS;
+
+  // Temperatures both packets carry, the ones of the packet being published
+  static const uint8_t & water_or_gas(const NAVIEN_METRIC_INPUT & in, const uint8_t & water, const uint8_t & gas){
+    return in.source == METRIC_FROM_GAS ? gas : water;
+  }
+
+  typedef NAVIEN_METRIC_INPUT IN;
+  typedef NAVIEN_METRIC_VALUE OUT;
+
+// The decoder of a metric if it is built, see NAVIEN_METRIC_MASK
+#define BUILT(id, ...) (NavienMetrics::built(id) ? static_cast<NAVIEN_METRIC_DECODER>(__VA_ARGS__) : nullptr)
+
+  // Indexed by NAVIEN_METRIC_ID
+  const NAVIEN_METRIC_DEF NavienMetrics::DEFS[METRIC_COUNT] = {
+    {METRIC_DHW_SET_TEMP, METRIC_SENSOR, FROM_PACKETS, METRIC_UNIT_TEMP, BUILT(METRIC_DHW_SET_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(water_or_gas(in, in.state->water.dhw_set_temp, in.state->gas.dhw_set_temp), in.units); })},
+    {METRIC_OUTLET_TEMP, METRIC_SENSOR, FROM_PACKETS, METRIC_UNIT_TEMP, BUILT(METRIC_OUTLET_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(water_or_gas(in, in.state->water.outlet_temp, in.state->gas.outlet_temp), in.units); })},
+    {METRIC_INLET_TEMP, METRIC_SENSOR, FROM_PACKETS, METRIC_UNIT_TEMP, BUILT(METRIC_INLET_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(water_or_gas(in, in.state->water.inlet_temp, in.state->gas.inlet_temp), in.units); })},
+    {METRIC_WATER_FLOW, METRIC_SENSOR, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_WATER_FLOW, [](const IN & in, OUT & out){
+      out.value = NavienLink::flow2lpm(in.state->water.flow); })},
+    {METRIC_WATER_UTILIZATION, METRIC_SENSOR, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_WATER_UTILIZATION, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::half(in.state->water.utilization); })},
+    {METRIC_HEATING_MODE, METRIC_TEXT, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_HEATING_MODE, [](const IN & in, OUT & out){
+      out.key = in.state->heating_mode;
+      out.text = NavienDecoder::heat_mode_to_str(in.state->heating_mode); })},
+    {METRIC_BOILER_ACTIVE, METRIC_BINARY, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_BOILER_ACTIVE, [](const IN & in, OUT & out){
+      out.value = in.state->water.boiler_active; })},
+    {METRIC_RECIRC_RUNNING, METRIC_BINARY, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_RECIRC_RUNNING, [](const IN & in, OUT & out){
+      out.value = in.state->water.recirc_running; })},
+    {METRIC_RECIRC_MODE, METRIC_TEXT, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_RECIRC_MODE, [](const IN & in, OUT & out){
+      out.key = in.state->recirculation;
+      out.text = NavienDecoder::recirc_mode_to_str(in.state->recirculation); })},
+    {METRIC_OPERATING_STATE, METRIC_TEXT, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_OPERATING_STATE, [](const IN & in, OUT & out){
+      out.key = in.state->operating_state;
+      out.text = NavienDecoder::op_state_to_str(in.state->operating_state, out.buf, sizeof(out.buf)); })},
+    {METRIC_ERROR_CODE, METRIC_SENSOR, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_ERROR_CODE, [](const IN & in, OUT & out){
+      out.value = in.state->water.error_code; })},
+    {METRIC_ERROR_LEVEL, METRIC_SENSOR, METRIC_FROM_WATER, METRIC_UNIT_NONE, BUILT(METRIC_ERROR_LEVEL, [](const IN & in, OUT & out){
+      out.value = in.state->water.error_level; })},
+    {METRIC_GAS_TOTAL, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_GAS_TOTAL, [](const IN & in, OUT & out){
+      out.value = in.state->gas.accumulated_gas_usage; })},
+    {METRIC_GAS_CURRENT, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_GAS_CURRENT, [](const IN & in, OUT & out){
+      out.value = in.state->gas.current_gas_usage; })},
+    {METRIC_DEVICE_TYPE, METRIC_TEXT, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_DEVICE_TYPE, [](const IN & in, OUT & out){
+      out.key = in.state->device_type;
+      out.text = NavienDecoder::device_type_to_str(in.state->device_type); })},
+    {METRIC_HEAT_CAPACITY, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_HEAT_CAPACITY, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::half(in.state->gas.heat_capacity); })},
+    {METRIC_SH_SET_TEMP, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_TEMP, BUILT(METRIC_SH_SET_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(in.state->gas.sh_set_temp, in.units); })},
+    {METRIC_SH_OUTLET_TEMP, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_TEMP, BUILT(METRIC_SH_OUTLET_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(in.state->gas.sh_outlet_temp, in.units); })},
+    {METRIC_SH_RETURN_TEMP, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_TEMP, BUILT(METRIC_SH_RETURN_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::temp(in.state->gas.sh_return_temp, in.units); })},
+    {METRIC_OUTDOOR_TEMP, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_TEMP, BUILT(METRIC_OUTDOOR_TEMP, [](const IN & in, OUT & out){
+      out.value = NavienDecoder::outdoor_temp(in.state->gas.outdoor_temp, in.units); })},
+    {METRIC_TOTAL_DHW_USAGE, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_TOTAL_DHW_USAGE, [](const IN & in, OUT & out){
+      out.value = in.state->gas.total_dhw_usage; })},
+    {METRIC_TOTAL_OPERATING_TIME, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_TOTAL_OPERATING_TIME, [](const IN & in, OUT & out){
+      out.value = in.state->gas.total_operating_time; })},
+    {METRIC_CUMULATIVE_DHW_USAGE_HOURS, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_CUMULATIVE_DHW_USAGE_HOURS, [](const IN & in, OUT & out){
+      out.value = in.state->gas.cumulative_dwh_usage_hours; })},
+    {METRIC_CUMULATIVE_SH_USAGE_HOURS, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_CUMULATIVE_SH_USAGE_HOURS, [](const IN & in, OUT & out){
+      out.value = in.state->gas.cumulative_sh_usage_hours; })},
+    {METRIC_CUMULATIVE_DOMESTIC_USAGE_CNT, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_CUMULATIVE_DOMESTIC_USAGE_CNT, [](const IN & in, OUT & out){
+      out.value = in.state->cumulative_domestic_usage_cnt; })},
+    {METRIC_DAYS_SINCE_INSTALL, METRIC_SENSOR, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_DAYS_SINCE_INSTALL, [](const IN & in, OUT & out){
+      out.value = in.state->days_since_install; })},
+    {METRIC_CONTROLLER_VERSION, METRIC_TEXT, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_CONTROLLER_VERSION, [](const IN & in, OUT & out){
+      out.key = NavienPublishFilter::hash(in.state->controller_version);
+      out.text = in.state->controller_version; })},
+    {METRIC_PANEL_VERSION, METRIC_TEXT, METRIC_FROM_GAS, METRIC_UNIT_NONE, BUILT(METRIC_PANEL_VERSION, [](const IN & in, OUT & out){
+      out.key = NavienPublishFilter::hash(in.state->panel_version);
+      out.text = in.state->panel_version; })},
+    {METRIC_CONN_STATUS, METRIC_BINARY, METRIC_FROM_UPDATE, METRIC_UNIT_NONE, BUILT(METRIC_CONN_STATUS, [](const IN & in, OUT & out){
+      out.value = in.connected; })},
+    {METRIC_OTHER_NAVILINK_INSTALLED, METRIC_BINARY, METRIC_FROM_UPDATE, METRIC_UNIT_NONE, BUILT(METRIC_OTHER_NAVILINK_INSTALLED, [](const IN & in, OUT & out){
+      out.value = in.other_navilink_installed; })},
+  };
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,211 @@
+/**
+ * What Navien publishes: one row per metric in NavienMetrics::DEFS, one registry entry per
+ * configured entity.
+ *
+ * A metric definition says which entity kind shows it, which packets update it and how its
+ * value is taken from NAVIEN_STATE. The definitions are constant. Navien holds a
+ * NavienMetricRegistry with an entry (entity, publish filter) for each metric that is
+ * configured, nothing for the rest, and publishing or resetting walks those entries only.
+ * A new value decoded from the packets takes a row in the table, a NAVIEN_METRIC_ID and a
+ * key in sensor.py or text_sensor.py.
+ *
+ * sensor.py also sets NAVIEN_METRIC_MASK to the metrics of the configuration. The others
+ * aren't built: their rows have no decoder and NavienDecoder leaves their fields of
+ * NAVIEN_STATE alone (see navien_decode.cpp).
+ *
+ * No ESPHome dependencies, the entities are opaque here and Navien publishes to them.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+
+#include "navien_decode.h"
+#include "navien_publish.h"
+
+#ifndef NAVIEN_HOST
+// NAVIEN_METRIC_MASK of the configuration
+#include "esphome/core/defines.h"
+#endif
+
+namespace esphome {
+namespace navien {
+
+  typedef enum{
+    METRIC_DHW_SET_TEMP,
+    METRIC_OUTLET_TEMP,
+    METRIC_INLET_TEMP,
+    METRIC_WATER_FLOW,
+    METRIC_WATER_UTILIZATION,
+    METRIC_HEATING_MODE,
+    METRIC_BOILER_ACTIVE,
+    METRIC_RECIRC_RUNNING,
+    METRIC_RECIRC_MODE,
+    METRIC_OPERATING_STATE,
+    METRIC_ERROR_CODE,
+    METRIC_ERROR_LEVEL,
+    METRIC_GAS_TOTAL,
+    METRIC_GAS_CURRENT,
+    METRIC_DEVICE_TYPE,
+    METRIC_HEAT_CAPACITY,
+    METRIC_SH_SET_TEMP,
+    METRIC_SH_OUTLET_TEMP,
+    METRIC_SH_RETURN_TEMP,
+    METRIC_OUTDOOR_TEMP,
+    METRIC_TOTAL_DHW_USAGE,
+    METRIC_TOTAL_OPERATING_TIME,
+    METRIC_CUMULATIVE_DHW_USAGE_HOURS,
+    METRIC_CUMULATIVE_SH_USAGE_HOURS,
+    METRIC_CUMULATIVE_DOMESTIC_USAGE_CNT,
+    METRIC_DAYS_SINCE_INSTALL,
+    METRIC_CONTROLLER_VERSION,
+    METRIC_PANEL_VERSION,
+    METRIC_CONN_STATUS,
+    METRIC_OTHER_NAVILINK_INSTALLED,
+    METRIC_COUNT
+  } NAVIEN_METRIC_ID;
+
+  static_assert(METRIC_COUNT <= 64, "NAVIEN_METRIC_MASK has a bit per metric");
+
+// Bit (1ULL << NAVIEN_METRIC_ID) of every metric built, all of them unless sensor.py says
+#ifndef NAVIEN_METRIC_MASK
+#define NAVIEN_METRIC_MASK (~0ULL)
+#endif
+
+  // Entity kind that shows a metric
+  typedef enum{
+    METRIC_SENSOR,
+    METRIC_BINARY,
+    METRIC_TEXT
+  } NAVIEN_METRIC_KIND;
+
+  // When a metric is published, a mask of
+  typedef enum{
+    METRIC_FROM_WATER  = 0x01,  // water packets
+    METRIC_FROM_GAS    = 0x02,  // gas packets
+    METRIC_FROM_UPDATE = 0x04,  // the update interval, not decoded from packets
+  } NAVIEN_METRIC_SOURCE;
+
+  // Metrics published in a unit Navien chooses
+  typedef enum{
+    METRIC_UNIT_NONE,
+    METRIC_UNIT_TEMP,  // temperature, in NAVIEN_METRIC_INPUT::units
+  } NAVIEN_METRIC_UNIT;
+
+  /**
+   * What the value of a metric is taken from
+   */
+  typedef struct{
+    const NAVIEN_STATE * state;
+    uint8_t source;                  // NAVIEN_METRIC_SOURCE being published
+    bool    connected;               // METRIC_FROM_UPDATE only
+    bool    other_navilink_installed;
+    DEVICE_UNITS units;              // of the temperatures
+  } NAVIEN_METRIC_INPUT;
+
+  typedef struct{
+    float        value;      // METRIC_SENSOR, METRIC_BINARY as 0/1
+    const char * text;       // METRIC_TEXT
+    uint32_t     key;        // METRIC_TEXT, identifies the text, e.g. the enum value it is the name of
+    char         buf[NavienDecoder::OP_STATE_STR_MAX];  // where text is formatted if needed
+  } NAVIEN_METRIC_VALUE;
+
+  typedef void (*NAVIEN_METRIC_DECODER)(const NAVIEN_METRIC_INPUT & in, NAVIEN_METRIC_VALUE & out);
+
+  typedef struct{
+    uint8_t id;       // NAVIEN_METRIC_ID, the index in NavienMetrics::DEFS
+    uint8_t kind;     // NAVIEN_METRIC_KIND
+    uint8_t sources;  // NAVIEN_METRIC_SOURCE mask
+    uint8_t unit;     // NAVIEN_METRIC_UNIT
+    NAVIEN_METRIC_DECODER decode;  // nullptr if the metric isn't built
+  } NAVIEN_METRIC_DEF;
+
+  class NavienMetrics{
+  public:
+    static const NAVIEN_METRIC_DEF & def(NAVIEN_METRIC_ID id){ return DEFS[id]; }
+
+    // Whether the metric is in NAVIEN_METRIC_MASK
+    static constexpr bool built(NAVIEN_METRIC_ID id){ return (uint64_t) (NAVIEN_METRIC_MASK) >> id & 1; }
+
+    static const NAVIEN_METRIC_DEF DEFS[METRIC_COUNT];
+  };
+
+  /**
+   * A configured metric
+   */
+  typedef struct{
+    void *              entity;  // sensor::Sensor, binary_sensor::BinarySensor or text_sensor::TextSensor by kind
+    NavienPublishFilter filter;
+    uint8_t             id;      // NAVIEN_METRIC_ID
+  } NAVIEN_METRIC;
+
+  /**
+   * Configured metrics of a unit
+   * @param N - capacity, the number of entities configured (NAVIEN_MAX_METRICS on the device)
+   */
+  template<uint8_t N>
+  class NavienMetricRegistry{
+  public:
+    /**
+     * Adds a metric, or points it to another entity if it is already in
+     * @return nullptr if the registry is full or the metric isn't built
+     */
+    NAVIEN_METRIC * add(NAVIEN_METRIC_ID id, void * entity){
+      if (NavienMetrics::def(id).decode == nullptr)
+        return nullptr;
+      NAVIEN_METRIC * m = this->find(id);
+      if (m == nullptr){
+        if (this->count >= N)
+          return nullptr;
+        m = &this->metrics[this->count++];
+        m->id = id;
+      }
+      m->entity = entity;
+      return m;
+    }
+
+    NAVIEN_METRIC * find(NAVIEN_METRIC_ID id){
+      for (NAVIEN_METRIC & m : *this)
+        if (m.id == id)
+          return &m;
+      return nullptr;
+    }
+
+    /**
+     * Decodes the metrics updated by in.source and calls emit(metric, def, value) for those
+     * whose value is due to be published, see NavienPublishFilter
+     */
+    template<typename F>
+    void publish(const NAVIEN_METRIC_INPUT & in, uint32_t now_ms, uint32_t heartbeat_ms, F emit){
+      NAVIEN_METRIC_VALUE value;
+      for (NAVIEN_METRIC & m : *this){
+        const NAVIEN_METRIC_DEF & def = NavienMetrics::def(static_cast<NAVIEN_METRIC_ID>(m.id));
+        if (!(def.sources & in.source))
+          continue;
+        def.decode(in, value);
+        bool due = def.kind == METRIC_TEXT
+          ? m.filter.due_hash(value.key, now_ms, heartbeat_ms)
+          : m.filter.due(value.value, now_ms, heartbeat_ms);
+        if (due)
+          emit(m, def, value);
+      }
+    }
+
+    // The next value of every metric gets published
+    void reset(){
+      for (NAVIEN_METRIC & m : *this)
+        m.filter.reset();
+    }
+
+    NAVIEN_METRIC * begin(){ return this->metrics; }
+    NAVIEN_METRIC * end(){ return this->metrics + this->count; }
+    uint8_t size() const { return this->count; }
+
+  protected:
+    NAVIEN_METRIC metrics[N] = {};
+    uint8_t       count = 0;
+  };
+
+}  // namespace navien
+}  // namespace esphome
@@ -7,14 +7,6 @@
 #pragma once
 
 #include <cinttypes>
-#include <list>
-
-#include "esphome/core/component.h"
-#include "esphome/components/sensor/sensor.h"
-#ifdef USE_SWITCH
-#include "esphome/components/switch/switch.h"
-#endif
-#include "esphome/components/uart/uart.h"
 
 namespace esphome {
 namespace navien {
@@ -27,6 +19,8 @@ typedef struct {
 
   /**
    * System type - identifies the type of Navien system
+   * 0x05 - NPE and similar units, PACKET_SYS_TYPE_NPE
+   * 0x06 - NCB-H combi boilers, PACKET_SYS_TYPE_NCB_H
    */
   uint8_t sys_type;
 
@@ -73,6 +67,9 @@ const uint8_t PACKET_DST_GAS   = 0x0F;
 const uint8_t PACKET_DIR_STATUS  = 0x90;
 const uint8_t PACKET_DIR_CONTROL = 0x10;
 
+const uint8_t PACKET_SYS_TYPE_NPE   = 0x05;
+const uint8_t PACKET_SYS_TYPE_NCB_H = 0x06;
+
 const uint16_t CHECKSUM_SEED_4B = 0x4b;
 const uint16_t CHECKSUM_SEED_62 = 0x62;
 
@@ -151,6 +148,18 @@ const uint8_t SCHEDULED_RECIRC_OFF_CMD[] =  {PACKET_MARKER, 0x05, 0x0F, 0x50, 0x
 const uint8_t DHW_SET_TEMP_CMD_TEMPLATE[] =  {PACKET_MARKER, 0x05, 0x0F, 0x50, 0x10, 0x0c, 0x4f, 0x00,   0x00,   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
                                             //F7              05    0F    50    10    0C    4F    00      00       5E    00    00    00    00    00    00    00    00  84
 
+/**
+ * All of the commands above are the same 0x4F control frame with a different field set.
+ * A zero field means "no change", so commands that set different fields can be merged
+ * into one frame (see NavienLink::fuse_cmd). The hot button release sets no field at all
+ * and is never merged. Offsets are from the start of the packet.
+ */
+const uint8_t CONTROL_CMD_TYPE   = 0x4f;
+const uint8_t CONTROL_CMD_LEN    = sizeof(DHW_SET_TEMP_CMD_TEMPLATE);
+const uint8_t CONTROL_CMD_POWER  = 8;   // 0x0a on, 0x0b off
+const uint8_t CONTROL_CMD_TEMP   = 9;   // DHW set temperature, 0.5 degree C units
+const uint8_t CONTROL_CMD_RECIRC = 11;  // 0x01 hot button, 0x08/0x10 scheduled recirculation on/off
+
 const uint8_t NAVILINK_PRESENT[]     =  {PACKET_MARKER, 0x05, 0x0F, 0x50, 0x10, 0x03, 0x4a, 0x00, 0x01, 0x55};
 
 typedef struct {
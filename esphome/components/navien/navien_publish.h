@@ -0,0 +1,91 @@
+/**
+ * Change detection for what Navien publishes to Home Assistant.
+ *
+ * update_water_sensors()/update_gas_sensors() run every update interval (or on every packet
+ * in real time mode) and most values - set temperatures, counters, versions, days since
+ * install - don't change between them. Every entity gets a NavienPublishFilter that lets a
+ * value through only if it moved by more than the entity's deadband since it was last
+ * published, or nothing was published for the heartbeat interval, so Home Assistant still
+ * sees the entity is alive.
+ *
+ * No ESPHome dependencies, the caller passes the time.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cmath>
+#include <cstddef>
+
+namespace esphome {
+namespace navien {
+
+class NavienPublishFilter{
+public:
+  /**
+   * Numeric values.
+   * @param heartbeat_ms - republish an unchanged value after this long, 0 - never
+   * @return true if the value is to be published, it is remembered as published then
+   */
+  bool due(float value, uint32_t now_ms, uint32_t heartbeat_ms){
+    bool changed = !this->valid
+      || std::isnan(value) != std::isnan(this->last)
+      || (!std::isnan(value) && std::fabs(value - this->last) > this->deadband);
+    if (!changed && !this->silent_for(now_ms, heartbeat_ms))
+      return false;
+    this->last = value;
+    this->published(now_ms);
+    return true;
+  }
+
+  /**
+   * Anything else (text, several values published together), compared by hash()
+   */
+  bool due_hash(uint32_t hash, uint32_t now_ms, uint32_t heartbeat_ms){
+    if (this->valid && hash == this->last_hash && !this->silent_for(now_ms, heartbeat_ms))
+      return false;
+    this->last_hash = hash;
+    this->published(now_ms);
+    return true;
+  }
+
+  // The next value gets published whatever it is, e.g. after NANs were published on error
+  void reset(){ this->valid = false; }
+
+  // FNV-1a
+  static uint32_t hash(const void * data, size_t len){
+    const uint8_t * p = static_cast<const uint8_t *>(data);
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+      h = (h ^ p[i]) * 16777619u;
+    return h;
+  }
+
+  static uint32_t hash(const char * str){
+    uint32_t h = 2166136261u;
+    while (*str)
+      h = (h ^ (uint8_t) *str++) * 16777619u;
+    return h;
+  }
+
+  // Minimum change that gets published, 0 - any change
+  float deadband = 0;
+
+protected:
+  bool silent_for(uint32_t now_ms, uint32_t heartbeat_ms) const {
+    return heartbeat_ms != 0 && now_ms - this->last_ms >= heartbeat_ms;
+  }
+
+  void published(uint32_t now_ms){
+    this->last_ms = now_ms;
+    this->valid = true;
+  }
+
+  float    last = 0;
+  uint32_t last_hash = 0;
+  uint32_t last_ms = 0;
+  bool     valid = false;
+};
+
+}  // namespace navien
+}  // namespace esphome
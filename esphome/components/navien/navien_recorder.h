@@ -0,0 +1,467 @@
+/**
+ * Recording of the RS485 traffic, to see what a heater in the field did without taking a
+ * logic analyzer there.
+ *
+ * NavienLink hands NavienFrameRecorder every packet that passed the checksum, the bytes it
+ * rejected (bad checksum, false marker, incomplete packet on a quiet line) and the frames
+ * it transmitted. They go into a fixed ring of bytes, the oldest records make room for the
+ * new ones. The heater repeats its status packets with a few bytes changed, so a packet is
+ * stored as its changes against the previous packet of the same source and destination:
+ * a repeated packet takes 3 bytes, a few hours of traffic fit in a few hundred kB.
+ *
+ * A record is  len | dt | type | payload
+ *   len     - number of bytes after len
+ *   dt      - milliseconds since the previous record, LEB128
+ *   type    - NAVIEN_REC_TYPE << 4 | slot (REC_FULL, REC_DELTA) or NAVIEN_REC_REJECT (REC_REJECTED)
+ *   payload - REC_SYNC:     uint32 LE, milliseconds since the recording started
+ *             REC_FULL:     the packet
+ *             REC_DELTA:    runs of skip << 4 | count followed by count bytes: skip bytes as
+ *                           in the previous packet of the slot, count bytes that changed.
+ *                           The bytes after the last run are unchanged.
+ *             REC_REJECTED: the bytes as received, at most REJECTED_MAX
+ *             REC_TX:       the frame as written to the UART
+ *
+ * A reader starts at the oldest record, the packets its deltas refer to may have been
+ * overwritten. Every slot is stored in full once in KEYFRAME_FRAMES packets, and REC_SYNC
+ * gives the time every SYNC_MS, so all but the first packets of a slot decode.
+ *
+ * The writer (NavienLink, in the protocol task when it runs) never waits. read() may run in
+ * another task: positions are absolute byte counts and whatever the writer overwrote before
+ * or while it was copied is skipped, the copy then starts at the oldest record.
+ *
+ * NavienRecordingReader turns the records back into frames, on the host (navien_recording)
+ * or anywhere else. Neither allocates, the ring belongs to the caller.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+
+#include "navien_proto.h"
+
+namespace esphome {
+namespace navien {
+
+  typedef enum{
+    REC_SYNC,
+    REC_FULL,
+    REC_DELTA,
+    REC_REJECTED,
+    REC_TX
+  } NAVIEN_REC_TYPE;
+
+  // Why the bytes of a REC_REJECTED record were dropped
+  typedef enum{
+    REJECT_CHECKSUM,
+    REJECT_FALSE_MARKER,
+    REJECT_IDLE_TIMEOUT
+  } NAVIEN_REC_REJECT;
+
+  /**
+   * Last packet of a (src, dst) pair, what the next one is stored against
+   */
+  typedef struct{
+    uint8_t frame[64];
+    uint8_t len;         // 0 - free
+    uint8_t since_full;  // packets stored as deltas since the last REC_FULL
+  } NAVIEN_REC_SLOT;
+
+  typedef struct{
+    uint32_t records;
+    uint32_t frames;        // REC_FULL and REC_DELTA
+    uint32_t deltas;
+    uint32_t frame_bytes;   // size of the packets recorded,
+    uint32_t stored_bytes;  // against the size of all the records
+    uint32_t evicted;       // records overwritten
+  } NAVIEN_REC_STATS;
+
+  class NavienFrameRecorder{
+  public:
+    static const uint8_t  SLOTS = 15;
+    static const uint8_t  NO_SLOT = 0x0F;  // REC_FULL of a packet too long for a slot
+    static const uint8_t  FRAME_MAX = sizeof(NAVIEN_REC_SLOT::frame);
+    static const uint8_t  KEYFRAME_FRAMES = 32;
+    static const uint32_t SYNC_MS = 10000;
+    static const uint8_t  REJECTED_MAX = 128;
+    // len, dt, type and the longest payload
+    static const uint16_t RECORD_MAX = 2 + 5 + sizeof(NAVIEN_PACKET);
+
+    /**
+     * Start recording into buffer, dropping what was there
+     */
+    void begin(uint8_t * buffer, uint32_t size){
+      this->ring = buffer;
+      this->size = size;
+      this->head = this->tail = 0;
+      this->started = false;
+      this->stats = {};
+      memset(this->slots, 0, sizeof(this->slots));
+    }
+
+    bool is_enabled() const { return this->ring != nullptr; }
+
+    // A packet that passed the checksum, frame points to its marker
+    void on_frame(const uint8_t * frame, uint16_t len, uint32_t now_us){
+      if (this->ring == nullptr || len > sizeof(NAVIEN_PACKET))
+        return;
+      uint8_t rec[RECORD_MAX];
+      uint16_t n = this->stamp(rec, now_us);
+      this->stats.frames++;
+      this->stats.frame_bytes += len;
+
+      uint8_t s = this->slot(frame, len);
+      NAVIEN_REC_SLOT * ref = s != NO_SLOT ? &this->slots[s] : nullptr;
+      if (ref != nullptr && ref->len == len && ref->since_full < KEYFRAME_FRAMES){
+        uint16_t d = delta(ref->frame, frame, len, rec + n + 1, len);
+        if (d < len){
+          rec[n] = REC_DELTA << 4 | s;
+          n += 1 + d;
+          ref->since_full++;
+          memcpy(ref->frame, frame, len);
+          this->stats.deltas++;
+          this->append(rec, n);
+          return;
+        }
+      }
+      rec[n++] = REC_FULL << 4 | s;
+      memcpy(rec + n, frame, len);
+      n += len;
+      if (ref != nullptr){
+        memcpy(ref->frame, frame, len);
+        ref->len = len;
+        ref->since_full = 0;
+      }
+      this->append(rec, n);
+    }
+
+    void on_rejected(const uint8_t * bytes, uint16_t len, NAVIEN_REC_REJECT reason, uint32_t now_us){
+      this->raw(REC_REJECTED << 4 | reason, bytes, len < REJECTED_MAX ? len : REJECTED_MAX, now_us);
+    }
+
+    void on_tx(const uint8_t * frame, uint16_t len, uint32_t now_us){
+      this->raw(REC_TX << 4, frame, len, now_us);
+    }
+
+    /**
+     * Reader side. Copies up to len bytes of the records at pos, or at the oldest record if
+     * the ones at pos were overwritten.
+     * @param from - where the copy starts, pos unless records were lost
+     * @return number of bytes copied, 0 once pos reaches end()
+     */
+    uint16_t read(uint32_t pos, uint8_t * out, uint16_t len, uint32_t & from) const {
+      for (;;){
+        uint32_t oldest = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+        uint32_t end = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+        if ((int32_t) (pos - oldest) < 0)
+          pos = oldest;
+        if ((int32_t) (end - pos) < 0){
+          from = end;
+          return 0;
+        }
+        uint32_t n = end - pos < len ? end - pos : len;
+        this->copy_out(pos, out, n);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // The writer moves head before it overwrites anything
+        if ((int32_t) (pos - __atomic_load_n(&this->head, __ATOMIC_RELAXED)) >= 0){
+          from = pos;
+          return n;
+        }
+      }
+    }
+
+    // Positions of the oldest record and of the end of the newest one
+    uint32_t oldest() const { return __atomic_load_n(&this->head, __ATOMIC_ACQUIRE); }
+    uint32_t end() const { return __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE); }
+    uint32_t capacity() const { return this->size; }
+
+    const NAVIEN_REC_STATS & get_stats() const { return this->stats; }
+
+    /**
+     * Changes of frame against ref as REC_DELTA runs
+     * @return their size, or max if they don't fit in it
+     */
+    static uint16_t delta(const uint8_t * ref, const uint8_t * frame, uint16_t len, uint8_t * out, uint16_t max){
+      uint16_t n = 0;
+      uint16_t last = 0;
+      uint16_t i = 0;
+      for (;;){
+        while (i < len && frame[i] == ref[i])
+          i++;
+        if (i == len)
+          return n;
+        uint16_t skip = i - last;
+        uint16_t start = i;
+        while (i < len && frame[i] != ref[i] && i - start < 15)
+          i++;
+        uint16_t count = i - start;
+        if (n + skip / 15 + 1 + count > max)
+          return max;
+        for (; skip > 15; skip -= 15)
+          out[n++] = 0xF0;
+        out[n++] = skip << 4 | count;
+        memcpy(out + n, frame + start, count);
+        n += count;
+        last = i;
+      }
+    }
+
+  protected:
+    // Slot of the packet's (src, dst), taking the next one round robin if it has none
+    uint8_t slot(const uint8_t * frame, uint16_t len){
+      if (len > FRAME_MAX || len < HDR_SIZE)
+        return NO_SLOT;
+      const HEADER * hdr = reinterpret_cast<const HEADER *>(frame);
+      for (uint8_t i = 0; i < SLOTS; i++){
+        const NAVIEN_REC_SLOT & s = this->slots[i];
+        const HEADER * ref = reinterpret_cast<const HEADER *>(s.frame);
+        if (s.len != 0 && ref->src == hdr->src && ref->dst == hdr->dst && ref->direction == hdr->direction)
+          return i;
+      }
+      uint8_t i = this->next_slot;
+      this->next_slot = (i + 1) % SLOTS;
+      this->slots[i].len = 0;
+      return i;
+    }
+
+    void raw(uint8_t type, const uint8_t * bytes, uint16_t len, uint32_t now_us){
+      if (this->ring == nullptr || len > sizeof(NAVIEN_PACKET))
+        return;
+      uint8_t rec[RECORD_MAX];
+      uint16_t n = this->stamp(rec, now_us);
+      rec[n++] = type;
+      memcpy(rec + n, bytes, len);
+      this->append(rec, n + len);
+    }
+
+    /**
+     * Advance the clock to now_us, write a REC_SYNC if it is due, and start a record in rec
+     * with its time
+     * @return where the type of the record goes
+     */
+    uint16_t stamp(uint8_t * rec, uint32_t now_us){
+      if (!this->started){
+        this->started = true;
+        this->last_us = now_us;
+        this->clock_ms = 0;
+        this->sync_ms = 0;
+        this->write_sync(0);
+      }
+      // Rejected bytes are stamped with when they started, which can be before the last record
+      uint32_t dt = (int32_t) (now_us - this->last_us) > 0 ? (now_us - this->last_us) / 1000 : 0;
+      this->last_us += dt * 1000;
+      this->clock_ms += dt;
+      if (this->clock_ms - this->sync_ms >= SYNC_MS){
+        this->sync_ms = this->clock_ms;
+        this->write_sync(dt);
+        dt = 0;
+      }
+      uint16_t n = 1;
+      for (; dt >= 0x80; dt >>= 7)
+        rec[n++] = (uint8_t) (dt | 0x80);
+      rec[n++] = (uint8_t) dt;
+      return n;
+    }
+
+    void write_sync(uint32_t dt){
+      uint8_t rec[12];
+      uint16_t n = 1;
+      for (; dt >= 0x80; dt >>= 7)
+        rec[n++] = (uint8_t) (dt | 0x80);
+      rec[n++] = (uint8_t) dt;
+      rec[n++] = REC_SYNC << 4;
+      for (uint8_t i = 0; i < 4; i++)
+        rec[n++] = (uint8_t) (this->clock_ms >> (8 * i));
+      this->append(rec, n);
+    }
+
+    // Store a record, rec[0] is set to its length here
+    void append(uint8_t * rec, uint16_t n){
+      if (n > this->size)
+        return;
+      rec[0] = (uint8_t) (n - 1);
+      uint32_t oldest = this->head;
+      if (this->size - (this->tail - oldest) < n){
+        while (this->size - (this->tail - oldest) < n){
+          oldest += 1 + this->ring[oldest % this->size];
+          this->stats.evicted++;
+        }
+        // Readers check head after copying, it must move before the bytes do
+        __atomic_store_n(&this->head, oldest, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+      }
+      uint32_t at = this->tail % this->size;
+      uint32_t first = this->size - at < n ? this->size - at : n;
+      memcpy(this->ring + at, rec, first);
+      memcpy(this->ring, rec + first, n - first);
+      __atomic_store_n(&this->tail, this->tail + n, __ATOMIC_RELEASE);
+      this->stats.records++;
+      this->stats.stored_bytes += n;
+    }
+
+    void copy_out(uint32_t pos, uint8_t * out, uint32_t n) const {
+      uint32_t at = pos % this->size;
+      uint32_t first = this->size - at < n ? this->size - at : n;
+      memcpy(out, this->ring + at, first);
+      memcpy(out + first, this->ring, n - first);
+    }
+
+    uint8_t *  ring = nullptr;
+    uint32_t   size = 0;
+    // Absolute positions of the oldest record and of the end of the newest one
+    uint32_t   head = 0;
+    uint32_t   tail = 0;
+
+    bool       started = false;
+    uint32_t   last_us = 0;
+    uint32_t   clock_ms = 0;
+    uint32_t   sync_ms = 0;
+
+    NAVIEN_REC_SLOT slots[SLOTS] = {};
+    uint8_t    next_slot = 0;
+    NAVIEN_REC_STATS stats = {};
+  };
+
+  /**
+   * A record turned back into the frame it was made of
+   */
+  typedef struct{
+    NAVIEN_REC_TYPE type;
+    uint8_t         reason;      // NAVIEN_REC_REJECT of REC_REJECTED
+    bool            time_valid;  // false until the first REC_SYNC
+    uint32_t        time_ms;     // since the recording started
+    const uint8_t * bytes;       // the packet, REC_SYNC has none
+    uint16_t        len;
+  } NAVIEN_REC_FRAME;
+
+  class NavienRecordingReader{
+  public:
+    /**
+     * The next bytes fed start a record, e.g. after records were lost. Forgets the slots
+     * and the time.
+     */
+    void reset(){
+      this->have = 0;
+      this->time_valid = false;
+      this->time_ms = 0;
+      for (NAVIEN_REC_SLOT & s : this->slots)
+        s.len = 0;
+    }
+
+    /**
+     * Decode the records in data, they may be split anywhere. Calls emit(const NAVIEN_REC_FRAME &)
+     * for every record, but deltas whose slot wasn't seen in full yet, see undecodable().
+     */
+    template<typename F>
+    void feed(const uint8_t * data, size_t len, F emit){
+      for (size_t i = 0; i < len; i++){
+        this->rec[this->have++] = data[i];
+        if (this->have > this->rec[0])
+          this->record(emit);
+      }
+    }
+
+    uint32_t undecodable() const { return this->skipped; }
+    uint32_t corrupt() const { return this->bad; }
+
+  protected:
+    template<typename F>
+    void record(F emit){
+      uint16_t n = this->have;
+      this->have = 0;
+      uint16_t i = 1;
+      uint32_t dt = 0;
+      for (uint8_t shift = 0; i < n && shift < 32; shift += 7){
+        uint8_t b = this->rec[i++];
+        dt |= (uint32_t) (b & 0x7F) << shift;
+        if (!(b & 0x80))
+          break;
+      }
+      if (i >= n){
+        this->bad++;
+        return;
+      }
+      this->time_ms += dt;
+      uint8_t type = this->rec[i] >> 4;
+      uint8_t low = this->rec[i] & 0x0F;
+      const uint8_t * payload = this->rec + i + 1;
+      uint16_t len = n - i - 1;
+
+      NAVIEN_REC_FRAME f = {};
+      f.type = static_cast<NAVIEN_REC_TYPE>(type);
+      f.bytes = payload;
+      f.len = len;
+      switch(type){
+      case REC_SYNC:
+        if (len != 4){
+          this->bad++;
+          return;
+        }
+        this->time_ms = payload[0] | payload[1] << 8 | payload[2] << 16 | (uint32_t) payload[3] << 24;
+        this->time_valid = true;
+        f.bytes = nullptr;
+        f.len = 0;
+        break;
+      case REC_FULL:
+        if (low < NavienFrameRecorder::SLOTS && len <= NavienFrameRecorder::FRAME_MAX){
+          memcpy(this->slots[low].frame, payload, len);
+          this->slots[low].len = len;
+        }
+        break;
+      case REC_DELTA:{
+        NAVIEN_REC_SLOT & s = this->slots[low % NavienFrameRecorder::SLOTS];
+        if (low >= NavienFrameRecorder::SLOTS || s.len == 0){
+          this->skipped++;
+          return;
+        }
+        if (!apply(s, payload, len)){
+          s.len = 0;
+          this->bad++;
+          return;
+        }
+        f.bytes = s.frame;
+        f.len = s.len;
+        break;
+      }
+      case REC_REJECTED:
+        f.reason = low;
+        break;
+      case REC_TX:
+        break;
+      default:
+        this->bad++;
+        return;
+      }
+      f.time_valid = this->time_valid;
+      f.time_ms = this->time_ms;
+      emit(f);
+    }
+
+    static bool apply(NAVIEN_REC_SLOT & s, const uint8_t * runs, uint16_t len){
+      uint16_t pos = 0;
+      for (uint16_t i = 0; i < len;){
+        uint8_t skip = runs[i] >> 4;
+        uint8_t count = runs[i] & 0x0F;
+        i++;
+        pos += skip;
+        if (pos + count > s.len || i + count > len)
+          return false;
+        memcpy(s.frame + pos, runs + i, count);
+        pos += count;
+        i += count;
+      }
+      return true;
+    }
+
+    uint8_t  rec[256] = {};
+    uint16_t have = 0;
+    bool     time_valid = false;
+    uint32_t time_ms = 0;
+    NAVIEN_REC_SLOT slots[NavienFrameRecorder::SLOTS] = {};
+    uint32_t skipped = 0;
+    uint32_t bad = 0;
+  };
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,159 @@
+/**
+ * Hand over between the protocol task and the ESPHome main loop.
+ *
+ * On dual core ESP32 boards NavienLink and the decoding of the status packets can run in a
+ * task of their own, pinned to the core the main loop doesn't use, so the protocol timing
+ * doesn't depend on how busy the API or web server are. The main loop then never touches
+ * what the task decodes into. It gets:
+ *  - the decoded state through NavienSeqlock, a double buffered sequence lock - the task
+ *    never waits, the main loop always reads a consistent copy,
+ *  - what happened (water/gas packet, error, command result) through NavienEventRing,
+ *    a single producer, single consumer ring.
+ *
+ * Both are built on the compiler __atomic builtins and allocate nothing, like the command
+ * queue (navien_cmd_queue.h) that carries commands in the other direction.
+ */
+
+#pragma once
+
+#include <cinttypes>
+#include <cstring>
+
+#include "navien_link.h"
+
+namespace esphome {
+namespace navien {
+
+/**
+ * Single writer, any number of readers snapshot of a trivially copyable T.
+ *
+ * The writer alternates between two copies. seq is odd while a copy is being written and
+ * seq / 2 selects the last complete copy. A reader copies that one and only retries if the
+ * writer went on to overwrite that same copy in the meantime, i.e. wrote twice while one
+ * read was in progress.
+ */
+template<typename T>
+class NavienSeqlock{
+public:
+  NavienSeqlock() : seq(0) {
+    memset(this->copies, 0, sizeof(this->copies));
+  }
+
+  // Writer side, never blocks
+  void write(const T & value){
+    uint32_t s = __atomic_load_n(&this->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&this->seq, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&this->copies[((s >> 1) + 1) & 1], &value, sizeof(T));
+    __atomic_store_n(&this->seq, s + 2, __ATOMIC_RELEASE);
+  }
+
+  /**
+   * Reader side
+   * @return number of retries, 0 unless the writer lapped the reader
+   */
+  uint32_t read(T & out) const {
+    uint32_t retries = 0;
+    for (;;){
+      uint32_t s1 = __atomic_load_n(&this->seq, __ATOMIC_ACQUIRE);
+      memcpy(&out, &this->copies[(s1 >> 1) & 1], sizeof(T));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      uint32_t s2 = __atomic_load_n(&this->seq, __ATOMIC_RELAXED);
+      // The copy we read is written again once seq reaches (s1 | 1) + 2
+      if (s2 - s1 < ((s1 | 1) + 2) - s1)
+        return retries;
+      retries++;
+    }
+  }
+
+  // Number of completed writes
+  uint32_t version() const { return __atomic_load_n(&this->seq, __ATOMIC_ACQUIRE) >> 1; }
+
+protected:
+  T        copies[2];
+  uint32_t seq;
+};
+
+/**
+ * What the protocol task reports to the main loop
+ */
+typedef enum{
+  FRAME_EVENT_WATER,       // a water packet was decoded into the snapshot
+  FRAME_EVENT_GAS,         // a gas packet was decoded into the snapshot
+  FRAME_EVENT_ERROR,       // NavienLinkVisitorI::on_error()
+  FRAME_EVENT_CMD_RESULT,  // NavienLinkVisitorI::on_cmd_result(), see result
+} NAVIEN_FRAME_EVENT_TYPE;
+
+typedef struct{
+  uint8_t  type;           // NAVIEN_FRAME_EVENT_TYPE
+  uint8_t  src;            // hdr.src of the packet
+  uint32_t version;        // NavienSeqlock::version() once the packet was decoded
+  uint32_t last_byte_us;   // arrival of the last byte of the packet
+  NAVIEN_CMD_RESULT result;
+} NAVIEN_FRAME_EVENT;
+
+/**
+ * Counters of the link for the periodic log. The protocol task hands them over through
+ * a NavienSeqlock, the main loop doesn't read NavienLink while the task runs it.
+ */
+typedef struct{
+  NAVIEN_LINK_STATS stats;
+  NAVIEN_TX_STATS   tx;
+  float    collision_rate;
+  uint32_t avg_cmd_wait_us;
+} NAVIEN_LINK_COUNTERS;
+
+inline NAVIEN_LINK_COUNTERS navien_link_counters(const NavienLink & link){
+  NAVIEN_LINK_COUNTERS c;
+  c.stats = link.get_stats();
+  c.tx = link.get_tx_stats();
+  c.collision_rate = link.get_collision_rate();
+  c.avg_cmd_wait_us = link.get_avg_cmd_wait_us();
+  return c;
+}
+
+/**
+ * Bounded single producer, single consumer ring
+ * @param N - capacity, must be a power of 2
+ */
+template<typename T, uint8_t N>
+class NavienEventRing{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "NavienEventRing capacity must be a power of 2");
+
+public:
+  /**
+   * Producer side
+   * @return false and counts a drop if the ring is full
+   */
+  bool push(const T & item){
+    uint32_t tail = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) >= N){
+      __atomic_fetch_add(&this->dropped_cnt, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    this->items[tail & (N - 1)] = item;
+    __atomic_store_n(&this->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Consumer side
+  bool pop(T & item){
+    uint32_t head = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE))
+      return false;
+    item = this->items[head & (N - 1)];
+    __atomic_store_n(&this->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  uint32_t dropped() const { return __atomic_load_n(&this->dropped_cnt, __ATOMIC_RELAXED); }
+
+protected:
+  T        items[N];
+  uint32_t head = 0;
+  uint32_t tail = 0;
+  uint32_t dropped_cnt = 0;
+};
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,287 @@
+/**
+ * Transmit scheduler of NavienLink.
+ *
+ * The heater owns the RS485 bus and sends its status packets on a fixed cadence, a controller
+ * answers in the idle time between them. The scheduler learns, for every kind of packet
+ * (source unit, water/gas, control), how long the line stays quiet after it and only lets a
+ * frame go out when the rest of that window is long enough for the whole frame at 19200 baud.
+ *
+ * A collision is assumed when our frame is read back corrupted by an echoing transceiver or,
+ * before the next valid packet, the line produced checksum errors, false markers or noise,
+ * or another controller's frame started while ours was still on the wire. After a collision
+ * transmissions back off for a random number of transmit opportunities, the range doubling
+ * with every consecutive collision. A corrupted echo is retried once at the very next
+ * opportunity before backing off.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "navien_proto.h"
+
+namespace esphome {
+namespace navien {
+
+/**
+ * Transmit statistics
+ */
+typedef struct{
+  uint32_t frames;        // frames transmitted
+  uint32_t collisions;    // transmitted frames that collided
+  uint32_t deferred;      // transmit opportunities skipped because the idle window was too short
+  uint32_t backoffs;      // transmit opportunities skipped while backing off
+  uint32_t forced;        // frames sent after too many deferrals in a row
+  uint32_t cmd_sent;      // commands transmitted for the first time, i.e. not keepalives
+  uint64_t cmd_wait_us;   // sum of their time between being queued and transmitted
+} NAVIEN_TX_STATS;
+
+/**
+ * Learned idle time after one kind of packet
+ */
+typedef struct{
+  uint32_t gap_us;
+  uint16_t samples;
+  bool     short_seen;  // the last sample was shorter than gap_us, see learn()
+  uint32_t short_us;
+} NAVIEN_TX_SLOT;
+
+class NavienTxScheduler{
+public:
+  // Status packets of 16 cascade units x water/gas, control packets, anything else
+  static const uint8_t UNITS = 16;
+  static const uint8_t SLOT_KEYS = UNITS * 2 + 2;
+  static const uint8_t SLOT_KEY_CONTROL = UNITS * 2;
+  static const uint8_t SLOT_KEY_OTHER = UNITS * 2 + 1;
+
+  // Time on the wire of one byte at 19200 baud, 8N1
+  static const uint32_t BYTE_TIME_US = 521;
+
+  // Margin kept between the end of our frame and the predicted next packet
+  static const uint32_t GUARD_US = 2 * BYTE_TIME_US;
+
+  // Transmit anyway after this many deferrals in a row, so a badly learned window can't starve us
+  static const uint8_t MAX_DEFERRALS = 16;
+
+  // Cap of the backoff exponent, up to 2^4 = 16 skipped opportunities
+  static const uint8_t MAX_BACKOFF_EXP = 4;
+
+  NavienTxScheduler(){ this->reset(); }
+
+  void reset(){
+    for (uint8_t i = 0; i < SLOT_KEYS; i++){
+      this->slots[i].gap_us = 0;
+      this->slots[i].samples = 0;
+      this->slots[i].short_seen = false;
+      this->slots[i].short_us = 0;
+    }
+    this->stats = {};
+    this->have_prev = false;
+    this->prev_key = SLOT_KEY_OTHER;
+    this->prev_end_us = 0;
+    this->tx_pending = false;
+    this->tx_errors = 0;
+    this->tx_end_us = 0;
+    this->deferrals = 0;
+    this->backoff = 0;
+    this->backoff_exp = 0;
+  }
+
+  static uint8_t slot_key(const HEADER & hdr){
+    if (hdr.direction == PACKET_DIR_CONTROL)
+      return SLOT_KEY_CONTROL;
+    uint8_t unit = hdr.src - PACKET_SRC_STATUS;
+    if (unit >= UNITS)
+      return SLOT_KEY_OTHER;
+    return unit * 2 + (hdr.dst == PACKET_DST_GAS ? 1 : 0);
+  }
+
+  /**
+   * Called for every valid packet, before the transmit decision that follows it.
+   * @param hdr      - header of the packet
+   * @param first_us - arrival of its first byte
+   * @param last_us  - arrival of its last byte
+   * @param errors   - running count of line errors (checksum errors + false markers + noise bytes)
+   * @param timed    - false if the idle time before the packet can't be told, i.e. it came in
+   *                   the same UART read as the previous packet. Both arrival times are then
+   *                   estimated as if the bytes came back to back, which they didn't.
+   */
+  void on_packet(const HEADER & hdr, uint32_t first_us, uint32_t last_us, uint32_t errors, bool timed = true){
+    bool foreign = hdr.direction == PACKET_DIR_CONTROL;
+
+    if (this->tx_pending){
+      // NavienLink filters out the echo of our frame, so a control packet is another controller
+      if (errors != this->tx_errors || (foreign && (int32_t) (first_us - this->tx_end_us) < 0)){
+        this->rng ^= first_us | 1;
+        this->collided();
+      }else{
+        this->backoff_exp = 0;
+      }
+      this->tx_pending = false;
+    }
+    // Our own frames never get here, so this is the heater's (or another
+    // controller's) timing whether we transmitted in the window or not
+    if (this->have_prev && timed)
+      this->learn(this->prev_key, first_us - this->prev_end_us);
+
+    this->have_prev = true;
+    this->prev_key = slot_key(hdr);
+    this->prev_end_us = last_us;
+  }
+
+  /**
+   * Decide whether a frame of len bytes can go out now, right after the last packet
+   * passed to on_packet(). Counts the skipped opportunities.
+   */
+  bool clear_to_send(uint32_t now_us, uint8_t len){
+    if (this->backoff > 0){
+      this->backoff--;
+      this->stats.backoffs++;
+      return false;
+    }
+
+    const NAVIEN_TX_SLOT & slot = this->slots[this->prev_key];
+    if (slot.samples == 0)
+      return true;  // nothing learned yet
+
+    uint32_t elapsed = now_us - this->prev_end_us;
+    uint32_t needed = len * BYTE_TIME_US + GUARD_US;
+    if (elapsed + needed <= slot.gap_us){
+      this->deferrals = 0;
+      return true;
+    }
+    if (++this->deferrals >= MAX_DEFERRALS){
+      this->deferrals = 0;
+      this->stats.forced++;
+      return true;
+    }
+    this->stats.deferred++;
+    return false;
+  }
+
+  /**
+   * Called right after a frame was written to the UART
+   * @param errors - running count of line errors, see on_packet()
+   */
+  void on_transmit(uint32_t now_us, uint8_t len, uint32_t errors){
+    this->stats.frames++;
+    this->tx_pending = true;
+    this->tx_errors = errors;
+    this->tx_end_us = now_us + len * BYTE_TIME_US;
+  }
+
+  /**
+   * Called when the transceiver read back our last frame
+   * @param intact - false if the echo was corrupted, i.e. something else drove the line
+   */
+  void on_echo(bool intact){
+    this->tx_pending = false;
+    if (intact){
+      this->backoff_exp = 0;
+      return;
+    }
+    this->stats.collisions++;
+    if (this->backoff_exp < MAX_BACKOFF_EXP)
+      this->backoff_exp++;
+    // A one off glitch is retried right away, a repeated collision backs off
+    if (this->backoff_exp > 1)
+      this->start_backoff();
+  }
+
+  /**
+   * Called for every command that goes out for the first time, fused into another
+   * command's frame or not
+   * @param queued_us - when the command was queued
+   */
+  void on_cmd_sent(uint32_t now_us, uint32_t queued_us){
+    this->stats.cmd_sent++;
+    this->stats.cmd_wait_us += now_us - queued_us;
+  }
+
+  /**
+   * Another controller showed up on the bus, stay off it for a random while
+   */
+  void on_foreign_controller(){ this->start_backoff(); }
+
+  const NAVIEN_TX_STATS & get_stats() const { return this->stats; }
+
+  // Share of transmitted frames that collided, 0..1
+  float collision_rate() const {
+    return this->stats.frames ? (float) this->stats.collisions / this->stats.frames : 0.f;
+  }
+
+  // Average time between queueing a command and transmitting it
+  uint32_t avg_cmd_wait_us() const {
+    return this->stats.cmd_sent ? (uint32_t) (this->stats.cmd_wait_us / this->stats.cmd_sent) : 0;
+  }
+
+  // Learned idle time after packets of the given key, 0 if unknown
+  uint32_t gap_us(uint8_t key) const { return key < SLOT_KEYS ? this->slots[key].gap_us : 0; }
+
+protected:
+  void learn(uint8_t key, uint32_t gap){
+    NAVIEN_TX_SLOT & slot = this->slots[key];
+    // Shrink fast, grow slowly - a too short window only costs a deferral, a too long
+    // one costs a collision. A single short sample may be a late loop misjudging the
+    // arrival of a packet, the window shrinks on the second one in a row, to the longer
+    // of the two.
+    if (slot.samples == 0){
+      slot.gap_us = gap;
+    }else if (gap < slot.gap_us){
+      if (slot.short_seen){
+        slot.gap_us = std::max(gap, slot.short_us);
+        slot.short_seen = false;
+      }else{
+        slot.short_seen = true;
+        slot.short_us = gap;
+      }
+    }else{
+      slot.gap_us += (gap - slot.gap_us) / 8;
+      slot.short_seen = false;
+    }
+    if (slot.samples < UINT16_MAX)
+      slot.samples++;
+  }
+
+  void collided(){
+    this->stats.collisions++;
+    if (this->backoff_exp < MAX_BACKOFF_EXP)
+      this->backoff_exp++;
+    this->start_backoff();
+  }
+
+  void start_backoff(){
+    uint8_t exp = this->backoff_exp ? this->backoff_exp : 1;
+    this->backoff = 1 + this->random() % (1u << exp);
+  }
+
+  // xorshift32, good enough to desynchronize two controllers
+  uint32_t random(){
+    uint32_t x = this->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    this->rng = x ? x : 0x2545F491;
+    return x;
+  }
+
+  NAVIEN_TX_SLOT  slots[SLOT_KEYS];
+  NAVIEN_TX_STATS stats;
+
+  bool     have_prev;
+  uint8_t  prev_key;
+  uint32_t prev_end_us;
+
+  bool     tx_pending;
+  uint32_t tx_errors;
+  uint32_t tx_end_us;
+
+  uint8_t  deferrals;
+  uint8_t  backoff;
+  uint8_t  backoff_exp;
+  uint32_t rng = 0x2545F491;
+};
+
+}  // namespace navien
+}  // namespace esphome
@@ -2,7 +2,7 @@ import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import sensor, binary_sensor, text_sensor, uart
 from esphome.components import output
-from esphome.core import ID  
+from esphome.core import CORE, ID
 
 NAVIEN_NAMESPACE = "navien"
 NAVIEN_CONFIG_ID = "navien"
@@ -20,7 +20,9 @@ from esphome.const import (
     CONF_LONGITUDE,
     CONF_SENSOR,
     CONF_NAME,
+    CONF_PLATFORM,
     CONF_TARGET_TEMPERATURE,
+    CONF_UNIT_OF_MEASUREMENT,
     
     DEVICE_CLASS_CONNECTIVITY,
     DEVICE_CLASS_RUNNING,
@@ -32,6 +34,7 @@ from esphome.const import (
     UNIT_CUBIC_METER,
     UNIT_DEGREES,
     UNIT_CELSIUS,
+    UNIT_FAHRENHEIT,
     UNIT_PERCENT,
     UNIT_HOUR
 )
@@ -67,6 +70,74 @@ CONF_SRC                        = "src"
 CONF_OTHER_NAVILINK_INSTALLED   = "other_navilink_installed"
 CONF_ERROR_CODE                 = "error_code"
 CONF_ERROR_LEVEL                = "error_level"
+CONF_IDLE_TIMEOUT               = "idle_timeout"
+CONF_RX_THRESHOLD               = "rx_threshold"
+CONF_PROTOCOL_TASK              = "protocol_task"
+CONF_TEMPERATURE_UNIT           = "temperature_unit"
+CONF_RECORDER                   = "recorder"
+CONF_SIZE                       = "size"
+
+
+CONF_DEADBAND                   = "deadband"
+CONF_HEARTBEAT                  = "heartbeat"
+CONF_ADAPTIVE_INTERVAL          = "adaptive_interval"
+CONF_FAST                       = "fast"
+CONF_SLOW                       = "slow"
+CONF_HOLD                       = "hold"
+
+NavienMetricId = navien_ns.enum("NAVIEN_METRIC_ID")
+
+NavienTempUnit = navien_ns.enum("NAVIEN_TEMP_UNIT")
+TEMPERATURE_UNITS = {
+    "celsius": NavienTempUnit.TEMP_UNIT_CELSIUS,
+    "fahrenheit": NavienTempUnit.TEMP_UNIT_FAHRENHEIT,
+    # What the heater displays
+    "auto": NavienTempUnit.TEMP_UNIT_AUTO,
+}
+
+# Entities and the metrics they show, see navien_metrics.h
+SENSOR_METRICS = {
+    CONF_DHW_SET_TEMPERATURE: NavienMetricId.METRIC_DHW_SET_TEMP,
+    CONF_TARGET_TEMPERATURE: NavienMetricId.METRIC_DHW_SET_TEMP,
+    CONF_INLET_TEMPERATURE: NavienMetricId.METRIC_INLET_TEMP,
+    CONF_OUTLET_TEMPERATURE: NavienMetricId.METRIC_OUTLET_TEMP,
+    CONF_WATER_FLOW: NavienMetricId.METRIC_WATER_FLOW,
+    CONF_WATER_UTILIZATION: NavienMetricId.METRIC_WATER_UTILIZATION,
+    CONF_GAS_TOTAL: NavienMetricId.METRIC_GAS_TOTAL,
+    CONF_GAS_CURRENT: NavienMetricId.METRIC_GAS_CURRENT,
+    CONF_SH_SET_TEMPERATURE: NavienMetricId.METRIC_SH_SET_TEMP,
+    CONF_SH_OUTLET_TEMPERATURE: NavienMetricId.METRIC_SH_OUTLET_TEMP,
+    CONF_SH_RETURN_TEMPERATURE: NavienMetricId.METRIC_SH_RETURN_TEMP,
+    CONF_OUTDOOR_TEMPERATURE: NavienMetricId.METRIC_OUTDOOR_TEMP,
+    CONF_HEAT_CAPACITY: NavienMetricId.METRIC_HEAT_CAPACITY,
+    CONF_TOTAL_DHW_USAGE: NavienMetricId.METRIC_TOTAL_DHW_USAGE,
+    CONF_TOTAL_OPERATING_TIME: NavienMetricId.METRIC_TOTAL_OPERATING_TIME,
+    CONF_CUMULATIVE_DWH_USAGE_HOURS: NavienMetricId.METRIC_CUMULATIVE_DHW_USAGE_HOURS,
+    CONF_CUMULATIVE_SH_USAGE_HOURS: NavienMetricId.METRIC_CUMULATIVE_SH_USAGE_HOURS,
+    CONF_DAYS_SINCE_INSTALL: NavienMetricId.METRIC_DAYS_SINCE_INSTALL,
+    CONF_ERROR_CODE: NavienMetricId.METRIC_ERROR_CODE,
+    CONF_ERROR_LEVEL: NavienMetricId.METRIC_ERROR_LEVEL,
+}
+
+BINARY_SENSOR_METRICS = {
+    CONF_RECIRC_RUNNING: NavienMetricId.METRIC_RECIRC_RUNNING,
+    CONF_BOILER_ACTIVE: NavienMetricId.METRIC_BOILER_ACTIVE,
+    CONF_CONN_STATUS: NavienMetricId.METRIC_CONN_STATUS,
+    CONF_OTHER_NAVILINK_INSTALLED: NavienMetricId.METRIC_OTHER_NAVILINK_INSTALLED,
+}
+
+TEXT_SENSOR_METRICS = {
+    CONF_RECIRC_MODE: NavienMetricId.METRIC_RECIRC_MODE,
+}
+
+
+def navien_sensor_schema(**kwargs):
+    # Smaller changes than the deadband are not published
+    return sensor.sensor_schema(**kwargs).extend(
+        {
+            cv.Optional(CONF_DEADBAND): cv.positive_float,
+        }
+    )
 
 
 CONFIG_SCHEMA = cv.All(
@@ -76,35 +147,35 @@ CONFIG_SCHEMA = cv.All(
             
             cv.Optional(CONF_NAME, default= 'Navien' ): cv.string_strict,
 
-            cv.Optional(CONF_DHW_SET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_DHW_SET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:coolant-temperature",
             ),
 
             # Left for backwards compatibility in config. Alias for DHW_SET_TEMPERATURE.
-            cv.Optional(CONF_TARGET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_TARGET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:coolant-temperature",
             ),
 
-            cv.Optional(CONF_INLET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_INLET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:water-thermometer",
             ),
-            cv.Optional(CONF_OUTLET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_OUTLET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:water-thermometer-outline",
             ),
-            cv.Optional(CONF_WATER_FLOW): sensor.sensor_schema(
+            cv.Optional(CONF_WATER_FLOW): navien_sensor_schema(
                 unit_of_measurement=UNIT_LPM,
                 accuracy_decimals=2,
                 icon="mdi:gauge",
             ),
-            cv.Optional(CONF_WATER_UTILIZATION): sensor.sensor_schema(
+            cv.Optional(CONF_WATER_UTILIZATION): navien_sensor_schema(
                 unit_of_measurement=UNIT_PERCENT,
                 accuracy_decimals=2,
                 icon="mdi:water-percent",
@@ -113,62 +184,62 @@ CONFIG_SCHEMA = cv.All(
                 device_class=DEVICE_CLASS_RUNNING,
                 icon="mdi:water-sync",
             ),
-            cv.Optional(CONF_GAS_TOTAL): sensor.sensor_schema(
+            cv.Optional(CONF_GAS_TOTAL): navien_sensor_schema(
                 unit_of_measurement=UNIT_CUBIC_METER,
                 accuracy_decimals=2,
                 state_class=STATE_CLASS_TOTAL_INCREASING,
             ),
-            cv.Optional(CONF_GAS_CURRENT): sensor.sensor_schema(
+            cv.Optional(CONF_GAS_CURRENT): navien_sensor_schema(
                 unit_of_measurement=UNIT_BTU,
                 accuracy_decimals=2,
                 icon="mdi:gas-burner",
             ),
-            cv.Optional(CONF_SH_SET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_SH_SET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:coolant-temperature",
             ),
-            cv.Optional(CONF_SH_OUTLET_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_SH_OUTLET_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:thermometer-lines",
             ),
-            cv.Optional(CONF_SH_RETURN_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_SH_RETURN_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:thermometer-lines",
             ),
-            cv.Optional(CONF_OUTDOOR_TEMPERATURE): sensor.sensor_schema(
+            cv.Optional(CONF_OUTDOOR_TEMPERATURE): navien_sensor_schema(
                 unit_of_measurement=UNIT_CELSIUS,
                 accuracy_decimals=2,
                 icon="mdi:sun-thermometer",
             ),
-            cv.Optional(CONF_HEAT_CAPACITY): sensor.sensor_schema(
+            cv.Optional(CONF_HEAT_CAPACITY): navien_sensor_schema(
                 unit_of_measurement=UNIT_PERCENT,
                 accuracy_decimals=2,
                 icon="mdi:heat-wave",
             ),
-            cv.Optional(CONF_TOTAL_DHW_USAGE): sensor.sensor_schema(
+            cv.Optional(CONF_TOTAL_DHW_USAGE): navien_sensor_schema(
                 unit_of_measurement=UNIT_EMPTY,
                 accuracy_decimals=0,
                 icon="mdi:water-boiler",
             ),
-            cv.Optional(CONF_TOTAL_OPERATING_TIME): sensor.sensor_schema(
+            cv.Optional(CONF_TOTAL_OPERATING_TIME): navien_sensor_schema(
                 unit_of_measurement=UNIT_HOUR,
                 accuracy_decimals=0,
                 icon="mdi:clock-outline",
             ),
-            cv.Optional(CONF_CUMULATIVE_DWH_USAGE_HOURS): sensor.sensor_schema(
+            cv.Optional(CONF_CUMULATIVE_DWH_USAGE_HOURS): navien_sensor_schema(
                 unit_of_measurement=UNIT_HOUR,
                 accuracy_decimals=0,
                 icon="mdi:clock-outline",
             ),
-            cv.Optional(CONF_CUMULATIVE_SH_USAGE_HOURS): sensor.sensor_schema(
+            cv.Optional(CONF_CUMULATIVE_SH_USAGE_HOURS): navien_sensor_schema(
                 unit_of_measurement=UNIT_HOUR,
                 accuracy_decimals=0,
                 icon="mdi:clock-outline",
             ),
-            cv.Optional(CONF_DAYS_SINCE_INSTALL): sensor.sensor_schema(
+            cv.Optional(CONF_DAYS_SINCE_INSTALL): navien_sensor_schema(
                 unit_of_measurement=UNIT_EMPTY,
                 accuracy_decimals=0,
                 icon="mdi:calendar-clock",
@@ -183,22 +254,46 @@ CONFIG_SCHEMA = cv.All(
                 device_class = DEVICE_CLASS_CONNECTIVITY,
                 entity_category=ENTITY_CATEGORY_DIAGNOSTIC
             ),
-            cv.Optional(CONF_ERROR_CODE): sensor.sensor_schema(
+            cv.Optional(CONF_ERROR_CODE): navien_sensor_schema(
                 accuracy_decimals=0,
                 entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
                 icon="mdi:alert-circle",
             ),
-            cv.Optional(CONF_ERROR_LEVEL): sensor.sensor_schema(
+            cv.Optional(CONF_ERROR_LEVEL): navien_sensor_schema(
                 accuracy_decimals=0,
                 entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
                 icon="mdi:alert-circle",
             ),
             cv.Optional(CONF_REAL_TIME): cv.boolean,
+            cv.Optional(CONF_IDLE_TIMEOUT): cv.positive_time_period_milliseconds,
+            # Up to the header size, a larger threshold would hold short frames back
+            cv.Optional(CONF_RX_THRESHOLD): cv.int_range(min=1, max=6),
+            cv.Optional(CONF_PROTOCOL_TASK): cv.All(cv.boolean, cv.only_on_esp32),
+            # Unit of the temperature sensors, converted from the wire values, no filters needed
+            cv.Optional(CONF_TEMPERATURE_UNIT, default="celsius"): cv.enum(TEMPERATURE_UNITS, lower=True),
+            # Republish unchanged values this often, 0s - never
+            cv.Optional(CONF_HEARTBEAT, default="5min"): cv.positive_time_period_milliseconds,
+            # Update fast while water flows or the burner runs, slow when idle for hold
+            cv.Optional(CONF_ADAPTIVE_INTERVAL): cv.Schema(
+                {
+                    cv.Optional(CONF_FAST, default="1s"): cv.positive_not_null_time_period,
+                    cv.Optional(CONF_SLOW, default="60s"): cv.positive_not_null_time_period,
+                    cv.Optional(CONF_HOLD, default="30s"): cv.positive_time_period_milliseconds,
+                }
+            ),
+            # Keep the last RS485 traffic in RAM for dump_recording(), see navien_recorder.h
+            cv.Optional(CONF_RECORDER): cv.Schema(
+                {
+                    cv.Optional(CONF_SIZE, default=32768): cv.int_range(min=1024, max=1048576),
+                }
+            ),
             cv.Optional(CONF_SRC): cv.int_range(min=0, max=15)
         }
     )
     .extend(cv.polling_component_schema("5s"))
-    .extend(uart.UART_DEVICE_SCHEMA)
+    .extend(uart.UART_DEVICE_SCHEMA),
+    # Publishing on every packet leaves nothing to adapt
+    cv.has_at_most_one_key(CONF_REAL_TIME, CONF_ADAPTIVE_INTERVAL),
 )
 
 
@@ -218,111 +313,88 @@ async def to_code(config):
     cg.add(var.set_src(src))
     await cg.register_component(var, config)
 
-    dhw_set_temp_config_key = None
-    if CONF_DHW_SET_TEMPERATURE in config:
-        dhw_set_temp_config_key = CONF_DHW_SET_TEMPERATURE
-
     # Backwards compat alias
-    if CONF_TARGET_TEMPERATURE in config:
-        if dhw_set_temp_config_key:
-            raise cv.Invalid(f"{CONF_TARGET_TEMPERATURE} is deprecated. Use only {CONF_DHW_SET_TEMPERATURE}.")
-        dhw_set_temp_config_key = CONF_TARGET_TEMPERATURE
-
-    if dhw_set_temp_config_key:
-        sens = await sensor.new_sensor(config[dhw_set_temp_config_key])
-        cg.add(var.set_dhw_set_temp_sensor(sens))
-
-    if CONF_INLET_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_INLET_TEMPERATURE])
-        cg.add(var.set_inlet_temp_sensor(sens))
-
-    if CONF_OUTLET_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_OUTLET_TEMPERATURE])
-        cg.add(var.set_outlet_temp_sensor(sens))
-
-    if CONF_WATER_FLOW in config:
-        sens = await sensor.new_sensor(config[CONF_WATER_FLOW])
-        cg.add(var.set_water_flow_sensor(sens))
-
-    if CONF_WATER_UTILIZATION in config:
-        sens = await sensor.new_sensor(config[CONF_WATER_UTILIZATION])
-        cg.add(var.set_water_utilization_sensor(sens))
-
-    if CONF_RECIRC_RUNNING in config:
-        sens = await binary_sensor.new_binary_sensor(config[CONF_RECIRC_RUNNING])
-        cg.add(var.set_recirc_running_sensor(sens))
-        
-    if CONF_GAS_TOTAL in config:
-        sens = await sensor.new_sensor(config[CONF_GAS_TOTAL])
-        cg.add(var.set_gas_total_sensor(sens))
-
-    if CONF_GAS_CURRENT in config:
-        sens = await sensor.new_sensor(config[CONF_GAS_CURRENT])
-        cg.add(var.set_gas_current_sensor(sens))
-        
+    if CONF_DHW_SET_TEMPERATURE in config and CONF_TARGET_TEMPERATURE in config:
+        raise cv.Invalid(f"{CONF_TARGET_TEMPERATURE} is deprecated. Use only {CONF_DHW_SET_TEMPERATURE}.")
+
+    _add_metric_defines()
+
+    temp_unit = config[CONF_TEMPERATURE_UNIT]
+    cg.add(var.set_temperature_unit(temp_unit))
+
+    for key, metric in SENSOR_METRICS.items():
+        if key in config:
+            conf = config[key]
+            # Temperatures keep the default unit unless it is fixed to Fahrenheit,
+            # with auto Navien sets it once the heater tells its units
+            if temp_unit == "fahrenheit" and conf.get(CONF_UNIT_OF_MEASUREMENT) == UNIT_CELSIUS:
+                conf = {**conf, CONF_UNIT_OF_MEASUREMENT: UNIT_FAHRENHEIT}
+            sens = await sensor.new_sensor(conf)
+            cg.add(var.add_metric(metric, sens))
+            # After add_metric, the deadband is kept with the metric
+            if CONF_DEADBAND in conf:
+                cg.add(var.set_deadband(metric, conf[CONF_DEADBAND]))
+
+    for key, metric in BINARY_SENSOR_METRICS.items():
+        if key in config:
+            sens = await binary_sensor.new_binary_sensor(config[key])
+            cg.add(var.add_metric(metric, sens))
+
+    for key, metric in TEXT_SENSOR_METRICS.items():
+        if key in config:
+            sens = await text_sensor.new_text_sensor(config[key])
+            cg.add(var.add_metric(metric, sens))
+
     if CONF_REAL_TIME in config:
         cg.add(var.set_real_time(config[CONF_REAL_TIME]))
 
-    if CONF_CONN_STATUS in config:
-        sens = await binary_sensor.new_binary_sensor(config[CONF_CONN_STATUS])
-        cg.add(var.set_conn_status_sensor(sens))
-        
-    if CONF_RECIRC_MODE in config:
-        sens = await text_sensor.new_text_sensor(config[CONF_RECIRC_MODE])
-        cg.add(var.set_recirc_mode_sensor(sens))
-    
-    if CONF_BOILER_ACTIVE in config:
-        sens = await binary_sensor.new_binary_sensor(config[CONF_BOILER_ACTIVE])
-        cg.add(var.set_boiler_active_sensor(sens))          
-
-    if CONF_SH_SET_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_SH_SET_TEMPERATURE])
-        cg.add(var.set_sh_set_temp_sensor(sens))
-
-    if CONF_SH_OUTLET_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_SH_OUTLET_TEMPERATURE])
-        cg.add(var.set_sh_outlet_temp_sensor(sens))
-
-    if CONF_SH_RETURN_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_SH_RETURN_TEMPERATURE])
-        cg.add(var.set_sh_return_temp_sensor(sens))
-
-    if CONF_OUTDOOR_TEMPERATURE in config:
-        sens = await sensor.new_sensor(config[CONF_OUTDOOR_TEMPERATURE])
-        cg.add(var.set_outdoor_temp_sensor(sens))
-        
-    if CONF_HEAT_CAPACITY in config:
-        sens = await sensor.new_sensor(config[CONF_HEAT_CAPACITY])
-        cg.add(var.set_heat_capacity_sensor(sens))
-
-    if CONF_TOTAL_DHW_USAGE in config:
-        sens = await sensor.new_sensor(config[CONF_TOTAL_DHW_USAGE])
-        cg.add(var.set_total_dhw_usage_sensor(sens))
-
-    if CONF_TOTAL_OPERATING_TIME in config:
-        sens = await sensor.new_sensor(config[CONF_TOTAL_OPERATING_TIME])
-        cg.add(var.set_total_operating_time_sensor(sens))
-
-    if CONF_CUMULATIVE_DWH_USAGE_HOURS in config:
-        sens = await sensor.new_sensor(config[CONF_CUMULATIVE_DWH_USAGE_HOURS])
-        cg.add(var.set_cumulative_dwh_usage_hours_sensor(sens))
-
-    if CONF_CUMULATIVE_SH_USAGE_HOURS in config:
-        sens = await sensor.new_sensor(config[CONF_CUMULATIVE_SH_USAGE_HOURS])
-        cg.add(var.set_cumulative_sh_usage_hours_sensor(sens))
-
-    if CONF_DAYS_SINCE_INSTALL in config:
-        sens = await sensor.new_sensor(config[CONF_DAYS_SINCE_INSTALL])
-        cg.add(var.set_days_since_install_sensor(sens))
- 
-    if CONF_OTHER_NAVILINK_INSTALLED in config:
-        sens = await binary_sensor.new_binary_sensor(config[CONF_OTHER_NAVILINK_INSTALLED])
-        cg.add(var.set_other_navilink_installed_sensor(sens))
-
-    if CONF_ERROR_CODE in config:
-        sens = await sensor.new_sensor(config[CONF_ERROR_CODE])
-        cg.add(var.set_error_code_sensor(sens))
-
-    if CONF_ERROR_LEVEL in config:
-        sens = await sensor.new_sensor(config[CONF_ERROR_LEVEL])
-        cg.add(var.set_error_level_sensor(sens))
+    if CONF_ADAPTIVE_INTERVAL in config:
+        adaptive = config[CONF_ADAPTIVE_INTERVAL]
+        cg.add(var.set_adaptive_interval(adaptive[CONF_FAST].total_milliseconds,
+                                         adaptive[CONF_SLOW].total_milliseconds,
+                                         adaptive[CONF_HOLD].total_milliseconds))
+
+    if CONF_IDLE_TIMEOUT in config:
+        cg.add(var.set_idle_timeout(config[CONF_IDLE_TIMEOUT].total_milliseconds))
+
+    if CONF_RX_THRESHOLD in config:
+        cg.add(var.set_rx_threshold(config[CONF_RX_THRESHOLD]))
+
+    if CONF_PROTOCOL_TASK in config:
+        cg.add(var.set_protocol_task(config[CONF_PROTOCOL_TASK]))
+
+    # The link is shared, src 0 owns the recording of all of it
+    if CONF_RECORDER in config:
+        if src != 0:
+            raise cv.Invalid(f"{CONF_RECORDER} goes with the unit of {CONF_SRC} 0")
+        cg.add_define("NAVIEN_RECORDER_SIZE", config[CONF_RECORDER][CONF_SIZE])
+
+    cg.add(var.set_heartbeat(config[CONF_HEARTBEAT].total_milliseconds))
+
+
+def _metrics(config):
+    # Metrics of the entities of a Navien: its own and those of the navien text sensors
+    from esphome.components.navien.text_sensor import TEXT_SENSOR_METRICS as TEXT_PLATFORM_METRICS
+    metrics = [metric for table in (SENSOR_METRICS, BINARY_SENSOR_METRICS, TEXT_SENSOR_METRICS)
+               for key, metric in table.items() if key in config]
+    for conf in CORE.config.get("text_sensor", []):
+        if conf.get(CONF_PLATFORM) != NAVIEN_NAMESPACE or conf[NAVIEN_CONFIG_ID].id != config[CONF_ID].id:
+            continue
+        metrics += [metric for key, metric in TEXT_PLATFORM_METRICS.items() if conf.get(key, False)]
+    return metrics
+
+
+def _add_metric_defines():
+    # Shared by all Navien instances:
+    #  NAVIEN_MAX_METRICS - registry capacity, the most entities any of them has
+    #  NAVIEN_METRIC_MASK - metrics any of them publishes, the others aren't decoded or built
+    data = CORE.data.setdefault(NAVIEN_NAMESPACE, {})
+    if "max_metrics" in data:
+        return
+    configs = [conf for conf in CORE.config.get("sensor", []) if conf.get(CONF_PLATFORM) == NAVIEN_NAMESPACE]
+    per_navien = [_metrics(conf) for conf in configs]
+    data["max_metrics"] = max([len(metrics) for metrics in per_navien] + [1])
+    cg.add_define("NAVIEN_MAX_METRICS", data["max_metrics"])
+    built = sorted({str(metric) for metrics in per_navien for metric in metrics})
+    mask = " | ".join(f"1ULL << {metric}" for metric in built) or "0ULL"
+    cg.add_define("NAVIEN_METRIC_MASK", cg.RawExpression(f"({mask})"))
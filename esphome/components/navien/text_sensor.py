@@ -2,7 +2,7 @@ import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import text_sensor
 from esphome.const import CONF_ICON
-from esphome.components.navien.sensor import NAVIEN_CONFIG_ID, Navien
+from esphome.components.navien.sensor import NAVIEN_CONFIG_ID, Navien, NavienMetricId
 
 AUTO_LOAD = ["text_sensor", "sensor"]
 
@@ -12,6 +12,15 @@ CONF_OPERATING_STATE = "operating_state"
 CONF_PANEL_VERSION = "panel_version"
 CONF_CONTROLLER_VERSION = "controller_version"
 
+# Metric shown when the key is true, see navien_metrics.h
+TEXT_SENSOR_METRICS = {
+    CONF_HEATING_MODE: NavienMetricId.METRIC_HEATING_MODE,
+    CONF_DEVICE_TYPE: NavienMetricId.METRIC_DEVICE_TYPE,
+    CONF_OPERATING_STATE: NavienMetricId.METRIC_OPERATING_STATE,
+    CONF_PANEL_VERSION: NavienMetricId.METRIC_PANEL_VERSION,
+    CONF_CONTROLLER_VERSION: NavienMetricId.METRIC_CONTROLLER_VERSION,
+}
+
 _DEFAULT_ICONS = {
     CONF_HEATING_MODE: "mdi:autorenew",
     CONF_DEVICE_TYPE: "mdi:chip",
@@ -53,18 +62,7 @@ CONFIG_SCHEMA = cv.All(
 async def to_code(config):
     var = await text_sensor.new_text_sensor(config)
     paren = await cg.get_variable(config[NAVIEN_CONFIG_ID])
-    
-    if config.get(CONF_HEATING_MODE, False):
-        cg.add(paren.set_heating_mode_sensor(var))
-
-    if config.get(CONF_DEVICE_TYPE, False):
-        cg.add(paren.set_device_type_sensor(var))
 
-    if config.get(CONF_OPERATING_STATE, False):
-        cg.add(paren.set_operating_state_sensor(var))
-
-    if config.get(CONF_PANEL_VERSION, False):
-        cg.add(paren.set_panel_version_sensor(var))
-
-    if config.get(CONF_CONTROLLER_VERSION, False):
-        cg.add(paren.set_controller_version_sensor(var))
\ No newline at end of file
+    for key, metric in TEXT_SENSOR_METRICS.items():
+        if config.get(key, False):
+            cg.add(paren.add_metric(metric, var))
@@ -0,0 +1,48 @@
+/**
+ * adaptive.cpp
+ *
+ * Host test of the activity adaptive update interval (esphome/components/navien/navien_adaptive.h):
+ *  - the first state decides the interval,
+ *  - activity switches to the fast interval at once,
+ *  - the slow interval only comes back after hold_ms without activity, a short pause
+ *    between two draws doesn't switch.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+
+#include "navien_adaptive.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+int main(){
+  NavienAdaptiveInterval a;
+  a.configure(1000, 60000, 30000);
+  CHECK(!a.is_decided());
+
+  // Idle at boot
+  CHECK(a.on_activity(false, 0));
+  CHECK(a.interval() == 60000);
+  CHECK(!a.on_activity(false, 5000));
+
+  // A draw starts
+  CHECK(a.on_activity(true, 10000));
+  CHECK(a.interval() == 1000);
+  CHECK(!a.on_activity(true, 20000));
+
+  // 20 s pause, then the next draw - stays fast
+  CHECK(!a.on_activity(false, 30000));
+  CHECK(!a.on_activity(false, 49999));
+  CHECK(!a.on_activity(true, 50000));
+
+  // Idle for the hold time
+  CHECK(!a.on_activity(false, 60000));
+  CHECK(!a.on_activity(false, 79999));
+  CHECK(a.on_activity(false, 80000));
+  CHECK(a.interval() == 60000);
+  CHECK(a.get_switches() == 3);
+
+  return test_result();
+}
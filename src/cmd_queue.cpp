@@ -0,0 +1,139 @@
+/**
+ * cmd_queue.cpp
+ *
+ * Host test of the NavienLink command queue (esphome/components/navien/navien_cmd_queue.h):
+ *  - commands of the high priority lane are dequeued before the normal lane,
+ *  - commands keep their order within a lane,
+ *  - a full lane drops new commands and counts them,
+ *  - posted state setting commands are coalesced, the latest value wins,
+ *  - several producer threads enqueueing while one consumer drains lose nothing.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+#include "navien_cmd_queue.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+static void test_priority(){
+  NavienCmdQueue q;
+  uint8_t b[2];
+  for (uint8_t i = 0; i < 3; i++){
+    b[0] = CMD_PRIO_NORMAL; b[1] = i;
+    CHECK(q.push(b, sizeof(b), CMD_PRIO_NORMAL));
+  }
+  for (uint8_t i = 0; i < 2; i++){
+    b[0] = CMD_PRIO_HIGH; b[1] = i;
+    CHECK(q.push(b, sizeof(b), CMD_PRIO_HIGH));
+  }
+  CHECK(q.depth(CMD_PRIO_HIGH) == 2);
+  CHECK(q.depth(CMD_PRIO_NORMAL) == 3);
+
+  const uint8_t expected[][2] = {{CMD_PRIO_HIGH, 0}, {CMD_PRIO_HIGH, 1},
+                                 {CMD_PRIO_NORMAL, 0}, {CMD_PRIO_NORMAL, 1}, {CMD_PRIO_NORMAL, 2}};
+  NAVIEN_CMD cmd;
+  for (const auto & e : expected){
+    CHECK(q.pop(cmd));
+    CHECK(cmd.len == 2 && cmd.buffer[0] == e[0] && cmd.buffer[1] == e[1]);
+  }
+  CHECK(!q.pop(cmd));
+  CHECK(q.empty());
+}
+
+static void test_overflow(){
+  NavienCmdQueue q;
+  uint8_t b = 0;
+  for (int i = 0; i < NavienCmdQueue::LANE_CAPACITY + 3; i++)
+    q.push(&b, 1, CMD_PRIO_NORMAL);
+  CHECK(q.depth(CMD_PRIO_NORMAL) == NavienCmdQueue::LANE_CAPACITY);
+  CHECK(q.dropped(CMD_PRIO_NORMAL) == 3);
+  CHECK(q.dropped(CMD_PRIO_HIGH) == 0);
+  CHECK(q.dropped() == 3);
+
+  // Space frees up as the consumer drains
+  NAVIEN_CMD cmd;
+  CHECK(q.pop(cmd));
+  CHECK(q.push(&b, 1, CMD_PRIO_NORMAL));
+  CHECK(q.dropped() == 3);
+}
+
+static void test_coalescing(){
+  NavienCmdQueue q;
+  uint8_t b = 0;
+  CHECK(!q.post(CMD_EFFECT_DHW_SET_TEMP, 80));
+  CHECK(q.post(CMD_EFFECT_DHW_SET_TEMP, 81));
+  CHECK(q.post(CMD_EFFECT_DHW_SET_TEMP, 82));
+  CHECK(!q.post(CMD_EFFECT_POWER, 1));
+  CHECK(q.push(&b, 1, CMD_PRIO_NORMAL));
+  CHECK(q.coalesced() == 2);
+  CHECK(q.depth(CMD_PRIO_HIGH) == 1);
+  CHECK(q.depth(CMD_PRIO_NORMAL) == 2);
+
+  // Power is in the high lane, ring commands of a lane go before its posted ones
+  NAVIEN_CMD cmd;
+  CHECK(q.pop(cmd) && cmd.len == 0 && cmd.effect == CMD_EFFECT_POWER && cmd.expected == 1);
+  CHECK(q.pop(cmd) && cmd.len == 1 && cmd.effect == CMD_EFFECT_NONE);
+  CHECK(q.pop(cmd) && cmd.len == 0 && cmd.effect == CMD_EFFECT_DHW_SET_TEMP && cmd.expected == 82);
+  CHECK(!q.pop(cmd));
+  CHECK(q.empty());
+
+  // Once popped, a new post is not a coalesce
+  CHECK(!q.post(CMD_EFFECT_DHW_SET_TEMP, 83));
+  CHECK(q.coalesced() == 2);
+}
+
+static void test_threads(){
+  const int PRODUCERS = 3;
+  const int PER_PRODUCER = 20000;
+  NavienCmdQueue q;
+  uint32_t received[PRODUCERS] = {};
+  bool in_order = true;
+
+  std::thread producers[PRODUCERS];
+  for (int p = 0; p < PRODUCERS; p++){
+    producers[p] = std::thread([&q, p]{
+      for (int i = 0; i < PER_PRODUCER; i++){
+        uint8_t b[5] = {(uint8_t) p, (uint8_t) i, (uint8_t) (i >> 8), (uint8_t) (i >> 16), 0};
+        while (!q.push(b, sizeof(b), p == 0 ? CMD_PRIO_HIGH : CMD_PRIO_NORMAL))
+          std::this_thread::yield();
+      }
+    });
+  }
+
+  uint32_t total = 0;
+  NAVIEN_CMD cmd;
+  memset(cmd.buffer, 0, sizeof(cmd.buffer));
+  while (total < PRODUCERS * PER_PRODUCER){
+    if (!q.pop(cmd)){
+      std::this_thread::yield();
+      continue;
+    }
+    uint8_t p = cmd.buffer[0];
+    uint32_t i = cmd.buffer[1] | cmd.buffer[2] << 8 | cmd.buffer[3] << 16;
+    if (p >= PRODUCERS || i != received[p])
+      in_order = false;
+    else
+      received[p]++;
+    total++;
+  }
+  for (auto & t : producers)
+    t.join();
+
+  CHECK(in_order);
+  CHECK(q.empty());
+  // Producers retry instead of giving up, every refusal is still counted as a drop
+  printf("threads: %u commands, %u refused while full\n", (unsigned) total, (unsigned) q.dropped());
+}
+
+int main(){
+  test_priority();
+  test_overflow();
+  test_coalescing();
+  test_threads();
+  return test_result();
+}
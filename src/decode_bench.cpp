@@ -0,0 +1,173 @@
+/**
+ * decode_bench.cpp
+ *
+ * Host benchmark of the decoding of the status packets (esphome/components/navien/navien_decode.h).
+ *
+ * NAVIEN_STATE keeps temperatures, flow and percentages in the units of the wire and Navien
+ * converts them to float when it publishes, only for the sensors that are configured.
+ * This compares, in navien_cycles() per packet:
+ *   - eager: what the decoding used to do, every value converted to float on every packet,
+ *   - raw:   NavienDecoder as it is,
+ *   - raw + publish: NavienDecoder plus the conversion of a typical set of sensors
+ *     (outlet temperature and flow for water, outlet temperature for gas).
+ * And checks that the published values didn't change: every field converted at publish time
+ * equals the eagerly converted one.
+ *
+ * navien_decode_bench_min is the same built with NAVIEN_METRIC_MASK of a minimal
+ * configuration (outlet temperature and flow), NavienDecoder then skips the other fields
+ * and only the built metrics are checked.
+ *
+ * Usage:
+ *   navien_decode_bench [--iterations N]   (default 200000)
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "navien_decode.h"
+#include "navien_hal.h"
+#include "navien_link.h"
+#include "navien_metrics.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+/**
+ * The float fields of the state as the decoding used to fill them
+ */
+typedef struct{
+  float water_dhw_set_temp;
+  float water_outlet_temp;
+  float water_inlet_temp;
+  float water_flow_lpm;
+  float water_utilization;
+  float gas_dhw_set_temp;
+  float gas_outlet_temp;
+  float gas_inlet_temp;
+  float gas_sh_set_temp;
+  float gas_sh_outlet_temp;
+  float gas_sh_return_temp;
+  float gas_outdoor_temp;
+  float gas_heat_capacity;
+} EAGER_STATE;
+
+static void eager_water(const HEADER & hdr, const WATER_DATA & water, NAVIEN_STATE & state, EAGER_STATE & eager){
+  NavienDecoder::decode_water(hdr, water, state);
+  eager.water_dhw_set_temp = NavienLink::t2c(water.dhw_set_temp);
+  eager.water_outlet_temp = NavienLink::t2c(water.outlet_temp);
+  eager.water_inlet_temp = NavienLink::t2c(water.inlet_temp);
+  eager.water_flow_lpm = NavienLink::flow2lpm(water.water_flow);
+  eager.water_utilization = water.operating_capacity * 0.5f;
+}
+
+static void eager_gas(const GAS_DATA & gas, NAVIEN_STATE & state, EAGER_STATE & eager){
+  NavienDecoder::decode_gas(gas, state);
+  eager.gas_dhw_set_temp = NavienLink::t2c(gas.dhw_set_temp);
+  eager.gas_outlet_temp = NavienLink::t2c(gas.outlet_temp);
+  eager.gas_inlet_temp = NavienLink::t2c(gas.inlet_temp);
+  eager.gas_sh_set_temp = NavienLink::t2c(gas.sh_set_temp);
+  eager.gas_sh_outlet_temp = NavienLink::t2c(gas.sh_outlet_temp);
+  eager.gas_sh_return_temp = NavienLink::t2c(gas.sh_return_temp);
+  eager.gas_outdoor_temp = NavienLink::ot2c(gas.outdoor_temp);
+  eager.gas_heat_capacity = gas.heat_capacity * 0.5f;
+}
+
+static void check_equivalent(const HEADER & hdr, const WATER_DATA & water, const GAS_DATA & gas){
+  NAVIEN_STATE state = {};
+  EAGER_STATE eager = {};
+  eager_gas(gas, state, eager);
+  eager_water(hdr, water, state, eager);
+
+  // Whatever the configuration, Navien itself needs these
+  CHECK(NavienLink::t2c(state.water.dhw_set_temp) == eager.water_dhw_set_temp);
+  CHECK(NavienLink::t2c(state.water.outlet_temp) == eager.water_outlet_temp);
+  CHECK(NavienLink::flow2lpm(state.water.flow) == eager.water_flow_lpm);
+
+#define CHECK_BUILT(metric, cond) CHECK(!NavienMetrics::built(metric) || (cond))
+  CHECK_BUILT(METRIC_INLET_TEMP, NavienLink::t2c(state.water.inlet_temp) == eager.water_inlet_temp);
+  CHECK_BUILT(METRIC_WATER_UTILIZATION, NavienDecoder::half(state.water.utilization) == eager.water_utilization);
+  CHECK_BUILT(METRIC_DHW_SET_TEMP, NavienLink::t2c(state.gas.dhw_set_temp) == eager.gas_dhw_set_temp);
+  CHECK_BUILT(METRIC_OUTLET_TEMP, NavienLink::t2c(state.gas.outlet_temp) == eager.gas_outlet_temp);
+  CHECK_BUILT(METRIC_INLET_TEMP, NavienLink::t2c(state.gas.inlet_temp) == eager.gas_inlet_temp);
+  CHECK_BUILT(METRIC_SH_SET_TEMP, NavienLink::t2c(state.gas.sh_set_temp) == eager.gas_sh_set_temp);
+  CHECK_BUILT(METRIC_SH_OUTLET_TEMP, NavienLink::t2c(state.gas.sh_outlet_temp) == eager.gas_sh_outlet_temp);
+  CHECK_BUILT(METRIC_SH_RETURN_TEMP, NavienLink::t2c(state.gas.sh_return_temp) == eager.gas_sh_return_temp);
+  CHECK_BUILT(METRIC_OUTDOOR_TEMP, NavienLink::ot2c(state.gas.outdoor_temp) == eager.gas_outdoor_temp);
+  CHECK_BUILT(METRIC_HEAT_CAPACITY, NavienDecoder::half(state.gas.heat_capacity) == eager.gas_heat_capacity);
+  CHECK_BUILT(METRIC_GAS_TOTAL, state.gas.accumulated_gas_usage == (gas.cumulative_gas_hi << 8 | gas.cumulative_gas_lo));
+  CHECK_BUILT(METRIC_DAYS_SINCE_INSTALL, state.days_since_install == (gas.days_since_install_hi << 8 | gas.days_since_install_lo));
+  CHECK_BUILT(METRIC_CONTROLLER_VERSION, state.controller_version[1] == '.');
+
+  // Pruned fields are left alone
+  CHECK(NavienMetrics::built(METRIC_SH_SET_TEMP) || state.gas.sh_set_temp == 0);
+  CHECK(NavienMetrics::built(METRIC_GAS_TOTAL) || state.gas.accumulated_gas_usage == 0);
+
+  // The sample values themselves: 0x49 = 36.5 C outlet, no flow
+  CHECK(NavienLink::t2c(state.water.outlet_temp) == 36.5f);
+  CHECK(NavienLink::flow2lpm(state.water.flow) == 0.0f);
+}
+
+// Keeps the optimizer from dropping the conversions nobody reads
+static volatile float sink;
+
+int main(int argc, char ** argv){
+  uint32_t iterations = 200000;
+  for (int i = 1; i < argc; i++){
+    if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+      iterations = strtoul(argv[++i], nullptr, 0);
+  }
+  if (iterations == 0)
+    iterations = 1;
+
+  HEADER hdr;
+  WATER_DATA water;
+  GAS_DATA gas;
+  memcpy(&hdr, WATER_PACKET, HDR_SIZE);
+  memcpy(&water, &WATER_PACKET[HDR_SIZE], sizeof(water));
+  memcpy(&gas, &GAS_PACKET[HDR_SIZE], sizeof(gas));
+
+  check_equivalent(hdr, water, gas);
+
+  NAVIEN_STATE state = {};
+  EAGER_STATE eager = {};
+
+  uint32_t start = navien_cycles();
+  for (uint32_t i = 0; i < iterations; i++){
+    eager_water(hdr, water, state, eager);
+    eager_gas(gas, state, eager);
+    sink = eager.water_outlet_temp + eager.gas_heat_capacity;
+  }
+  uint32_t eager_cycles = navien_cycles() - start;
+
+  start = navien_cycles();
+  for (uint32_t i = 0; i < iterations; i++){
+    NavienDecoder::decode_water(hdr, water, state);
+    NavienDecoder::decode_gas(gas, state);
+    sink = state.water.outlet_temp + state.gas.heat_capacity;
+  }
+  uint32_t raw_cycles = navien_cycles() - start;
+
+  start = navien_cycles();
+  for (uint32_t i = 0; i < iterations; i++){
+    NavienDecoder::decode_water(hdr, water, state);
+    sink = NavienLink::t2c(state.water.outlet_temp);
+    sink = NavienLink::flow2lpm(state.water.flow);
+    NavienDecoder::decode_gas(gas, state);
+    sink = NavienLink::t2c(state.gas.outlet_temp);
+  }
+  uint32_t publish_cycles = navien_cycles() - start;
+
+  int built = 0;
+  for (int i = 0; i < METRIC_COUNT; i++)
+    built += NavienMetrics::built(static_cast<NAVIEN_METRIC_ID>(i));
+  printf("metrics built: %d of %d\n", built, (int) METRIC_COUNT);
+  // Two packets per iteration
+  printf("eager:         %u cycles/packet\n", (unsigned) (eager_cycles / iterations / 2));
+  printf("raw:           %u cycles/packet\n", (unsigned) (raw_cycles / iterations / 2));
+  printf("raw + publish: %u cycles/packet\n", (unsigned) (publish_cycles / iterations / 2));
+
+  return test_result();
+}
@@ -0,0 +1,501 @@
+/**
+ * delivery.cpp
+ *
+ * Host test of acknowledged command delivery in NavienLink. Plays water status packets of the
+ * main unit (src 0x50) through the link one at a time and checks what gets transmitted in the
+ * slot after each of them:
+ *  - setpoint changes posted before the next transmit slot are coalesced into one command,
+ *  - non conflicting commands pending for the same slot go out as one control frame,
+ *  - a tracked command is sent once and confirmed as soon as a status packet shows its effect,
+ *  - it is retransmitted after NavienLink::DELIVERY_RETRY_PACKETS packets without the effect,
+ *  - it is given up on after NavienLink::DELIVERY_MAX_ATTEMPTS transmissions,
+ *  - with an echoing transceiver our own frames are not parsed, and a corrupted echo makes
+ *    the frame go out again in the very next slot,
+ *  - a frame the UART has no room for, or that would go out over a packet already coming in,
+ *    is not written, it goes out in the next slot instead and its retries count from then,
+ *  - receive() only drains the UART once it holds the rest of the packet in progress, and
+ *    drops an incomplete packet on the first idle timeout,
+ *  - packets drained in one read don't teach the transmit scheduler a gap of one byte,
+ *  - a status packet identical to the previous one is not passed to the visitors, yet
+ *    still confirms commands.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "navien_hal.h"
+#include "navien_link.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+static uint32_t sim_us = 0;
+static uint32_t sim_micros(){ return sim_us; }
+
+static const uint8_t SYSTEM_POWER_OFFSET = HDR_SIZE + 3;
+static const uint8_t DHW_SET_TEMP_OFFSET = HDR_SIZE + 5;
+
+/**
+ * UART that hands out one packet per receive() and remembers the last transmission.
+ * With echo set it reads back what is written, like most RS485 transceivers do.
+ */
+class ScriptUart : public NavienUartI {
+public:
+  int available() override { return this->len - this->pos; }
+
+  uint8_t peek_byte(uint8_t * byte) override {
+    if (this->pos >= this->len)
+      return 0;
+    *byte = this->data[this->pos];
+    return 1;
+  }
+
+  uint8_t read_byte(uint8_t * byte) override {
+    if (!this->peek_byte(byte))
+      return 0;
+    this->pos++;
+    return 1;
+  }
+
+  bool read_array(uint8_t * out, uint8_t n) override {
+    if (this->len - this->pos < n)
+      return false;
+    memcpy(out, &this->data[this->pos], n);
+    this->pos += n;
+    return true;
+  }
+
+  void write_array(const uint8_t * out, uint8_t n) override {
+    memcpy(this->tx, out, n);
+    this->tx_len = n;
+    if (!this->echo)
+      return;
+    memcpy(&this->data[this->len], out, n);
+    if (this->corrupt_echoes > 0) {
+      this->data[this->len + n / 2] ^= 0x55;
+      this->corrupt_echoes--;
+    }
+    this->len += n;
+    sim_us += n * NavienLink::BYTE_TIME_US;
+  }
+
+  int available_for_write() override { return this->room; }
+
+  void feed(const uint8_t * packet, uint8_t n){
+    memcpy(this->data, packet, n);
+    this->len = n;
+    this->pos = 0;
+    this->tx_len = 0;
+  }
+
+  void append(const uint8_t * bytes, uint8_t n){
+    memcpy(&this->data[this->len], bytes, n);
+    this->len += n;
+  }
+
+  // True if the last transmission in this slot was the given command
+  bool sent(const uint8_t * cmd, uint8_t n) const {
+    return this->tx_len == n && memcmp(this->tx, cmd, n) == 0;
+  }
+
+  uint8_t data[256];
+  int     len = 0;
+  int     pos = 0;
+  uint8_t tx[64];
+  uint8_t tx_len = 0;
+  bool    echo = false;
+  int     corrupt_echoes = 0;
+  int     room = -1;
+};
+
+class ResultVisitor : public NavienLinkVisitorI {
+public:
+  void on_water(const HEADER &, const WATER_DATA &) override { this->water++; }
+  void on_gas(const HEADER &, const GAS_DATA &) override {}
+  void on_error() override {}
+  void on_cmd_result(const NAVIEN_CMD_RESULT & result) override {
+    this->last = result;
+    this->results++;
+  }
+
+  NAVIEN_CMD_RESULT last = {};
+  int results = 0;
+  int water = 0;
+};
+
+/**
+ * Water packet with the given power and set temperature
+ */
+static void build(uint8_t * packet, bool power_on, uint8_t dhw_set_temp){
+  memcpy(packet, WATER_PACKET, sizeof(WATER_PACKET));
+  packet[SYSTEM_POWER_OFFSET] = power_on ? 0x25 : 0x20;
+  packet[DHW_SET_TEMP_OFFSET] = dhw_set_temp;
+  seal_packet(packet, sizeof(WATER_PACKET));
+}
+
+/**
+ * Play one water packet with the given power and set temperature through the link
+ */
+static void play(NavienLink & link, ScriptUart & uart, bool power_on, uint8_t dhw_set_temp){
+  uint8_t packet[sizeof(WATER_PACKET)];
+  build(packet, power_on, dhw_set_temp);
+
+  sim_us += 100000;
+  uart.feed(packet, sizeof(packet));
+  link.receive();
+  // The echo of what was written comes back in the next loop
+  if (uart.echo)
+    link.receive();
+}
+
+static void test_confirmed_after_retransmit(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+
+  link.send_turn_on_cmd();
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+
+  // Not applied yet, keepalives until the retry is due
+  for (int i = 0; i < NavienLink::DELIVERY_RETRY_PACKETS; i++){
+    play(link, uart, false, 0x56);
+    CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+  }
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  CHECK(visitor.results == 0);
+
+  play(link, uart, true, 0x56);
+  CHECK(visitor.results == 1);
+  CHECK(visitor.last.effect == CMD_EFFECT_POWER);
+  CHECK(visitor.last.confirmed);
+  CHECK(visitor.last.attempts == 2);
+  CHECK(visitor.last.latency_us > 0);
+  CHECK(link.get_stats().cmd_confirmed == 1);
+  CHECK(link.get_stats().cmd_retransmits == 1);
+
+  // Nothing left to retransmit
+  for (int i = 0; i < 5; i++){
+    play(link, uart, true, 0x56);
+    CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+  }
+}
+
+static void test_confirmed_first_time(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  // Slider drag: only the last setpoint goes out
+  link.send_dhw_set_temp_cmd(40);
+  link.send_dhw_set_temp_cmd(42.5);
+  link.send_dhw_set_temp_cmd(45);
+  CHECK(link.get_cmd_queue_coalesced() == 2);
+  play(link, uart, true, 0x56);
+  CHECK(uart.tx_len > 0 && uart.tx[9] == 90);
+  CHECK(link.get_cmd_queue_depth(CMD_PRIO_NORMAL) == 0);
+  play(link, uart, true, 90);
+  CHECK(visitor.results == 1 && visitor.last.confirmed && visitor.last.attempts == 1);
+  CHECK(link.get_stats().cmd_retransmits == 0);
+}
+
+static void test_fusion(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  // "Turn on and set 45C" - one frame, one checksum
+  link.send_turn_on_cmd();
+  link.send_dhw_set_temp_cmd(45);
+  play(link, uart, false, 0x56);
+  CHECK(uart.tx_len == CONTROL_CMD_LEN);
+  CHECK(uart.tx[CONTROL_CMD_POWER] == TURN_ON_CMD[CONTROL_CMD_POWER]);
+  CHECK(uart.tx[CONTROL_CMD_TEMP] == 90);
+  CHECK(uart.tx[CONTROL_CMD_LEN - 1] == NavienChecksum::compute(uart.tx, CONTROL_CMD_LEN - 1, CHECKSUM_SEED_62));
+  CHECK(link.get_stats().cmd_fused == 1);
+  CHECK(link.get_cmd_queue_depth(CMD_PRIO_HIGH) == 0 && link.get_cmd_queue_depth(CMD_PRIO_NORMAL) == 0);
+
+  // Both effects are tracked and confirmed by the same status packet
+  play(link, uart, true, 90);
+  CHECK(visitor.results == 2 && link.get_stats().cmd_confirmed == 2);
+
+  // Hot button and scheduled recirculation both use byte 11 and the release sets
+  // nothing - separate frames
+  link.send_hot_button_cmd();
+  link.send_scheduled_recirculation_off_cmd();
+  const uint8_t * expected[] = {HOT_BUTTON_PRESS_CMD, HOT_BUTTON_PRESS_CMD, HOT_BUTTON_RELSE_CMD, SCHEDULED_RECIRC_OFF_CMD};
+  for (const uint8_t * cmd : expected){
+    play(link, uart, true, 90);
+    CHECK(uart.sent(cmd, CONTROL_CMD_LEN));
+  }
+  CHECK(link.get_stats().cmd_fused == 1);
+}
+
+static void test_given_up(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  // The packet keeps reporting RECIRC_STATUS_FLAG_SCHEDULED_ON
+  link.send_scheduled_recirculation_off_cmd();
+  int transmissions = 0;
+  for (int i = 0; i < 20; i++){
+    play(link, uart, true, 0x56);
+    if (uart.sent(SCHEDULED_RECIRC_OFF_CMD, sizeof(SCHEDULED_RECIRC_OFF_CMD)))
+      transmissions++;
+  }
+  CHECK(transmissions == NavienLink::DELIVERY_MAX_ATTEMPTS);
+  CHECK(visitor.results == 1);
+  CHECK(!visitor.last.confirmed);
+  CHECK(visitor.last.effect == CMD_EFFECT_RECIRC_SCHEDULED);
+  CHECK(link.get_stats().cmd_failed == 1);
+}
+
+static void test_echo(){
+  ScriptUart uart;
+  uart.echo = true;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  // Our own keepalive is not another NaviLink
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+  CHECK(!link.is_other_navilink_installed());
+  CHECK(link.get_stats().echo_ok == 1);
+  CHECK(link.get_stats().packets == 1);
+
+  // Collision in the middle of the frame - resent in the next slot, no waiting for the retry
+  link.send_turn_on_cmd();
+  uart.corrupt_echoes = 1;
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  CHECK(link.get_stats().echo_corrupt == 1);
+  CHECK(link.get_tx_stats().collisions == 1);
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  CHECK(link.get_stats().cmd_retransmits == 1);
+  CHECK(link.get_stats().echo_ok == 2);
+
+  play(link, uart, true, 0x56);
+  CHECK(visitor.results == 1 && visitor.last.confirmed && visitor.last.attempts == 2);
+  CHECK(visitor.last.echo_us == sizeof(TURN_ON_CMD) * NavienLink::BYTE_TIME_US);
+  CHECK(link.get_stats().echo_ok == 3);
+  CHECK(link.get_tx_stats().collisions == 1);
+  CHECK(!link.is_other_navilink_installed());
+}
+
+static void test_tx_stall(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  link.send_turn_on_cmd();
+  uart.room = 4;
+  play(link, uart, false, 0x56);
+  CHECK(uart.tx_len == 0);
+  CHECK(link.get_stats().tx_stalls == 1);
+
+  uart.room = 64;
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  CHECK(link.get_stats().cmd_retransmits == 0);
+  CHECK(link.get_tx_stats().frames == 1);
+  play(link, uart, true, 0x56);
+  CHECK(visitor.results == 1 && visitor.last.confirmed && visitor.last.attempts == 1);
+
+  NAVIEN_LOOP_STATS loop = link.take_loop_stats();
+  CHECK(loop.calls == 3);
+  CHECK(link.take_loop_stats().calls == 0);
+}
+
+static void test_first_slot_lost(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  link.send_turn_on_cmd();
+  uart.room = 4;
+  play(link, uart, false, 0x56);
+  CHECK(uart.tx_len == 0);
+  uart.room = -1;
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+
+  // The retry is due DELIVERY_RETRY_PACKETS packets after the frame went out
+  for (int i = 0; i < NavienLink::DELIVERY_RETRY_PACKETS; i++){
+    play(link, uart, false, 0x56);
+    CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+  }
+  play(link, uart, false, 0x56);
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  play(link, uart, true, 0x56);
+  CHECK(visitor.results == 1 && visitor.last.confirmed && visitor.last.attempts == 2);
+
+  // The next packet starts in the same read as the one giving the slot
+  link.send_turn_on_cmd();
+  uint8_t packet[sizeof(WATER_PACKET)];
+  build(packet, true, 0x56);
+  sim_us += 100000;
+  uart.feed(packet, sizeof(packet));
+  uart.append(packet, 3);
+  link.receive();
+  CHECK(uart.tx_len == 0);
+  CHECK(link.get_stats().tx_line_busy == 1);
+  sim_us += (sizeof(packet) - 3) * NavienLink::BYTE_TIME_US;
+  uart.feed(packet + 3, sizeof(packet) - 3);
+  link.receive();
+  CHECK(uart.sent(TURN_ON_CMD, sizeof(TURN_ON_CMD)));
+  CHECK(link.get_tx_stats().frames == 6);
+}
+
+static void test_rx_threshold(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  uint8_t packet[sizeof(WATER_PACKET)];
+  build(packet, true, 0x56);
+
+  // Not even a header yet
+  uart.feed(packet, 4);
+  link.receive();
+  // Header in, now the length is known
+  uart.append(packet + 4, 6);
+  link.receive();
+  // Not the whole packet yet
+  uart.append(packet + 10, 20);
+  link.receive();
+  CHECK(link.get_stats().packets == 0);
+  uart.append(packet + 30, sizeof(packet) - 30);
+  link.receive();
+  CHECK(link.get_stats().packets == 1);
+
+  NAVIEN_LOOP_STATS loop = link.take_loop_stats();
+  CHECK(loop.skipped == 2);
+  CHECK(loop.calls == 2);
+
+  // Leftover bytes of a packet that never completes are taken once the line goes quiet
+  uart.feed(packet, 8);
+  link.receive();
+  sim_us += NavienLink::DEFAULT_IDLE_TIMEOUT_US + 1;
+  link.receive();
+  CHECK(link.get_stats().idle_timeouts == 1);
+
+  // Also when they are still in the UART, short of the rest of the packet: dropped on
+  // the first idle timeout, not read on it and dropped on the next one
+  uart.feed(packet, 8);
+  link.receive();
+  uart.append(packet + 8, 5);
+  link.receive();
+  sim_us += NavienLink::DEFAULT_IDLE_TIMEOUT_US + 1;
+  link.receive();
+  CHECK(link.get_stats().idle_timeouts == 2);
+
+  // Short of the threshold, before the header is even in
+  uart.feed(packet, 3);
+  link.receive();
+  sim_us += NavienLink::DEFAULT_IDLE_TIMEOUT_US + 1;
+  link.receive();
+  CHECK(link.get_stats().idle_timeouts == 3);
+
+  // Then the next packet is taken as soon as it is in
+  uart.feed(packet, sizeof(packet));
+  link.receive();
+  CHECK(link.get_stats().packets == 2);
+
+  // The threshold is capped at a header, a lone short frame is not held back
+  link.set_rx_threshold(64);
+  uart.feed(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT));
+  link.receive();
+  CHECK(uart.available() == 0);
+}
+
+static void test_one_fill(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+
+  for (int i = 0; i < 4; i++)
+    play(link, uart, false, 0x56);
+
+  // A busy loop finds three packets in the UART
+  uint8_t packet[sizeof(WATER_PACKET)];
+  build(packet, false, 0x56);
+  sim_us += 300000;
+  uart.feed(packet, sizeof(packet));
+  uart.append(packet, sizeof(packet));
+  uart.append(packet, sizeof(packet));
+  link.receive();
+  CHECK(link.get_stats().packets == 7);
+
+  // The window after a water packet is still known to take a frame
+  for (int i = 0; i < 3; i++){
+    play(link, uart, false, 0x56);
+    CHECK(uart.sent(NAVILINK_PRESENT, sizeof(NAVILINK_PRESENT)));
+  }
+  CHECK(link.get_tx_stats().deferred == 0);
+}
+
+static void test_unchanged(){
+  ScriptUart uart;
+  NavienLink link(&uart);
+  ResultVisitor visitor;
+  link.add_visitor(&visitor);
+
+  for (int i = 0; i < 3; i++)
+    play(link, uart, false, 0x56);
+  CHECK(visitor.water == 1);
+  CHECK(link.get_stats().unchanged_hits == 2 && link.get_stats().unchanged_misses == 1);
+  uint32_t fresh_us = link.get_fresh_us(0);
+  CHECK(fresh_us != 0);
+
+  // The heater applies the command, the changed packet is dispatched and confirms it
+  link.send_turn_on_cmd();
+  play(link, uart, false, 0x56);
+  play(link, uart, true, 0x56);
+  CHECK(visitor.water == 2);
+  CHECK(visitor.results == 1 && visitor.last.confirmed);
+  CHECK(link.get_fresh_us(0) != fresh_us);
+
+  // After an error the visitors get the next packet even if it didn't change
+  uint8_t corrupted[sizeof(TURN_ON_CMD)];
+  memcpy(corrupted, TURN_ON_CMD, sizeof(corrupted));
+  corrupted[sizeof(corrupted) - 1] ^= 0xFF;
+  sim_us += 100000;
+  uart.feed(corrupted, sizeof(corrupted));
+  link.receive();
+  CHECK(link.get_stats().checksum_errors == 1);
+  play(link, uart, true, 0x56);
+  CHECK(visitor.water == 3);
+
+  link.set_skip_unchanged(false);
+  play(link, uart, true, 0x56);
+  play(link, uart, true, 0x56);
+  CHECK(visitor.water == 5);
+  CHECK(link.get_stats().unchanged_hits == 3);
+}
+
+int main(){
+  navien_host_micros = sim_micros;
+  test_confirmed_after_retransmit();
+  test_confirmed_first_time();
+  test_fusion();
+  test_given_up();
+  test_echo();
+  test_tx_stall();
+  test_first_slot_lost();
+  test_rx_threshold();
+  test_one_fill();
+  test_unchanged();
+  return test_result();
+}
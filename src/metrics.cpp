@@ -0,0 +1,161 @@
+/**
+ * metrics.cpp
+ *
+ * Host test of the metric table and registry (esphome/components/navien/navien_metrics.h):
+ *  - every NAVIEN_METRIC_ID has its row in NavienMetrics::DEFS, at its own index,
+ *  - the registry holds the metrics added, once each, up to its capacity,
+ *  - publishing decodes only the metrics of the packet being published, takes the
+ *    temperatures both packets carry from that packet, and lets through changes only,
+ *  - reset() publishes everything again,
+ *  - temperatures are published in the units asked for, and set temperatures of any
+ *    units go back to the nearest wire value.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "navien_link.h"
+#include "navien_metrics.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+static const uint32_t HEARTBEAT_MS = 60000;
+
+static void test_defs(){
+  for (int i = 0; i < METRIC_COUNT; i++){
+    const NAVIEN_METRIC_DEF & def = NavienMetrics::def(static_cast<NAVIEN_METRIC_ID>(i));
+    CHECK(def.id == i);
+    CHECK(def.decode != nullptr);
+    CHECK(def.sources != 0);
+    CHECK(def.kind <= METRIC_TEXT);
+  }
+}
+
+static void test_registry(){
+  NavienMetricRegistry<2> r;
+  int a, b, c;
+  CHECK(r.size() == 0);
+  CHECK(r.find(METRIC_OUTLET_TEMP) == nullptr);
+  CHECK(r.add(METRIC_OUTLET_TEMP, &a) != nullptr);
+  // Added again, points to the new entity
+  CHECK(r.add(METRIC_OUTLET_TEMP, &b) != nullptr);
+  CHECK(r.size() == 1);
+  CHECK(r.find(METRIC_OUTLET_TEMP)->entity == &b);
+  CHECK(r.add(METRIC_WATER_FLOW, &c) != nullptr);
+  CHECK(r.add(METRIC_GAS_TOTAL, &a) == nullptr);
+  CHECK(r.size() == 2);
+  CHECK(r.find(METRIC_GAS_TOTAL) == nullptr);
+}
+
+typedef struct{
+  int      count;
+  uint8_t  last_id;
+  float    last_value;
+  char     last_text[32];
+} PUBLISHED;
+
+static void publish(NavienMetricRegistry<4> & r, const NAVIEN_STATE & state, uint8_t source, uint32_t now_ms, PUBLISHED & p){
+  NAVIEN_METRIC_INPUT in = {};
+  in.state = &state;
+  in.source = source;
+  p.count = 0;
+  r.publish(in, now_ms, HEARTBEAT_MS, [&p](NAVIEN_METRIC & m, const NAVIEN_METRIC_DEF & def, const NAVIEN_METRIC_VALUE & value){
+    p.count++;
+    p.last_id = m.id;
+    p.last_value = value.value;
+    if (def.kind == METRIC_TEXT)
+      snprintf(p.last_text, sizeof(p.last_text), "%s", value.text);
+  });
+}
+
+static void test_publish(){
+  NavienMetricRegistry<4> r;
+  r.add(METRIC_OUTLET_TEMP, nullptr);
+  r.add(METRIC_WATER_FLOW, nullptr);
+  r.add(METRIC_OPERATING_STATE, nullptr);
+
+  NAVIEN_STATE state = {};
+  state.water.outlet_temp = 0x49;   // 36.5 C
+  state.gas.outlet_temp = 0x4A;     // 37 C
+  state.water.flow = 25;            // 2.5 l/min
+  state.operating_state = ACTIVE_COMBUSTION;
+
+  PUBLISHED p = {};
+  publish(r, state, METRIC_FROM_WATER, 0, p);
+  CHECK(p.count == 3);
+  CHECK(!strcmp(p.last_text, "Active Combustion"));
+  CHECK(r.find(METRIC_OUTLET_TEMP)->filter.due(36.5f, 0, 0) == false);
+
+  // Nothing changed
+  publish(r, state, METRIC_FROM_WATER, 1000, p);
+  CHECK(p.count == 0);
+
+  // Gas packets update the outlet temperature only, from their own field
+  publish(r, state, METRIC_FROM_GAS, 2000, p);
+  CHECK(p.count == 1);
+  CHECK(p.last_id == METRIC_OUTLET_TEMP);
+  CHECK(p.last_value == 37.0f);
+
+  // Unknown operating state, formatted into the value
+  state.operating_state = static_cast<OPERATING_STATE>(0x99);
+  publish(r, state, METRIC_FROM_WATER, 3000, p);
+  CHECK(p.count == 2);  // outlet back to the water value and the state
+  CHECK(!strcmp(p.last_text, "Unknown (153)"));
+
+  // Packets don't publish update metrics
+  NavienMetricRegistry<4> u;
+  u.add(METRIC_CONN_STATUS, nullptr);
+  publish(u, state, METRIC_FROM_WATER | METRIC_FROM_GAS, 0, p);
+  CHECK(p.count == 0);
+
+  r.reset();
+  publish(r, state, METRIC_FROM_WATER, 4000, p);
+  CHECK(p.count == 3);
+}
+
+static void test_units(){
+  NavienMetricRegistry<4> r;
+  r.add(METRIC_OUTLET_TEMP, nullptr);
+  r.add(METRIC_WATER_FLOW, nullptr);
+  CHECK(NavienMetrics::def(METRIC_OUTLET_TEMP).unit == METRIC_UNIT_TEMP);
+  CHECK(NavienMetrics::def(METRIC_WATER_FLOW).unit == METRIC_UNIT_NONE);
+
+  NAVIEN_STATE state = {};
+  state.water.outlet_temp = 0x49;   // 36.5 C
+  state.water.flow = 25;
+
+  NAVIEN_METRIC_INPUT in = {};
+  in.state = &state;
+  in.source = METRIC_FROM_WATER;
+  in.units = FARENHEIT;
+  float outlet = 0, flow = 0;
+  r.publish(in, 0, HEARTBEAT_MS, [&](NAVIEN_METRIC & m, const NAVIEN_METRIC_DEF &, const NAVIEN_METRIC_VALUE & value){
+    (m.id == METRIC_OUTLET_TEMP ? outlet : flow) = value.value;
+  });
+  // What the filter lambdas of the example configurations made of it
+  CHECK(fabsf(outlet - (36.5f * 9 / 5 + 32)) < 0.001f);
+  CHECK(flow == 2.5f);
+
+  CHECK(NavienDecoder::outdoor_temp(0x85, FARENHEIT) == 23.f);  // -5 C
+  CHECK(isnan(NavienDecoder::outdoor_temp(0x9E, CELSIUS)));
+
+  CHECK(NavienDecoder::temp_to_raw(45, CELSIUS) == 0x5A);
+  CHECK(NavienDecoder::temp_to_raw(42.7f, CELSIUS) == 85);
+  CHECK(NavienDecoder::temp_to_raw(-3, CELSIUS) == 0);
+  CHECK(NavienDecoder::temp_to_raw(NAN, FARENHEIT) == 0);
+  // Every whole Fahrenheit degree set comes back as itself
+  for (int f = 90; f <= 140; f++)
+    CHECK(lroundf(NavienDecoder::temp(NavienDecoder::temp_to_raw(f, FARENHEIT), FARENHEIT)) == f);
+}
+
+int main(){
+  test_defs();
+  test_registry();
+  test_publish();
+  test_units();
+  return test_result();
+}
@@ -0,0 +1,206 @@
+/**
+ * navien_recording.cpp
+ *
+ * Host side decoder of the traffic recorded on the device by NavienFrameRecorder
+ * (esphome/components/navien/navien_recorder.h). Writes the packets as a .hex capture
+ * that navien_replay plays back, with the time, the kind of every packet and what was
+ * rejected or transmitted as comments.
+ *
+ * Reads either
+ *   - the records as raw bytes, e.g. written by navien_replay --record, or
+ *   - the log of the device while it dumps the recording (Navien::dump_recording()), any
+ *     text with lines "NAVREC <position> <hex bytes>", e.g. saved from `esphome logs`.
+ *     A jump in the positions means the device overwrote records before they were
+ *     logged, decoding starts over at the next line.
+ *
+ * Usage:
+ *   navien_recording [-o FILE] [--expect-frames N] <recording>
+ *
+ *   -o FILE            write the capture to FILE instead of stdout
+ *   --expect-frames N  exit with non-zero status unless exactly N packets are decoded
+ *                      (used by ctest)
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "navien_link.h"
+#include "navien_recorder.h"
+
+using namespace esphome::navien;
+
+static const char * REJECT_STR[] = {"checksum", "false marker", "idle timeout"};
+
+typedef struct{
+  FILE *   out;
+  size_t   frames;
+  size_t   rejected;
+  size_t   tx;
+  bool     last_valid;
+  uint32_t last_ms;
+  uint16_t last_len;
+} OUTPUT;
+
+static void print_bytes(FILE * out, const char * prefix, const uint8_t * bytes, uint16_t len){
+  for (uint16_t i = 0; i < len; i++)
+    fprintf(out, "%s%02X%s", i % 16 ? "" : prefix, bytes[i], i % 16 == 15 || i + 1 == len ? "\n" : " ");
+}
+
+static void print_time(FILE * out, const NAVIEN_REC_FRAME & f){
+  if (f.time_valid)
+    fprintf(out, "# %u.%03u s", (unsigned) (f.time_ms / 1000), (unsigned) (f.time_ms % 1000));
+  else
+    fprintf(out, "# ? s");
+}
+
+static void emit(OUTPUT & o, const NAVIEN_REC_FRAME & f){
+  switch(f.type){
+  case REC_SYNC:
+    return;
+  case REC_REJECTED:
+    o.rejected++;
+    print_time(o.out, f);
+    fprintf(o.out, " rejected, %s\n", f.reason < 3 ? REJECT_STR[f.reason] : "unknown");
+    print_bytes(o.out, "#   ", f.bytes, f.len);
+    return;
+  case REC_TX:
+    o.tx++;
+    print_time(o.out, f);
+    fprintf(o.out, " transmitted\n");
+    print_bytes(o.out, "#   ", f.bytes, f.len);
+    return;
+  default:
+    break;
+  }
+
+  o.frames++;
+  // The line was idle from the end of the previous packet to this one
+  if (o.last_valid && f.time_valid){
+    int64_t gap = (int64_t) (f.time_ms - o.last_ms) * 1000 - (int64_t) o.last_len * NavienLink::BYTE_TIME_US;
+    if (gap > 0)
+      fprintf(o.out, "+%lld\n", (long long) gap);
+  }
+  o.last_valid = f.time_valid;
+  o.last_ms = f.time_ms;
+  o.last_len = f.len;
+
+  const HEADER * hdr = reinterpret_cast<const HEADER *>(f.bytes);
+  print_time(o.out, f);
+  if (f.len < HDR_SIZE)
+    fprintf(o.out, "\n");
+  else if (hdr->direction == PACKET_DIR_STATUS)
+    fprintf(o.out, " SRC 0x%02X %s\n", hdr->src, hdr->dst == PACKET_DST_WATER ? "water" : hdr->dst == PACKET_DST_GAS ? "gas" : "status");
+  else
+    fprintf(o.out, " SRC 0x%02X control\n", hdr->src);
+  print_bytes(o.out, "", f.bytes, f.len);
+}
+
+static int hex_digit(char c){
+  if (c >= '0' && c <= '9') return c - '0';
+  c = tolower(c);
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+static void usage(const char * prog){
+  fprintf(stderr, "Usage: %s [-o FILE] [--expect-frames N] <recording>\n", prog);
+}
+
+int main(int argc, char * argv[]){
+  const char * path = nullptr;
+  const char * out_path = nullptr;
+  long expect_frames = -1;
+
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+      out_path = argv[++i];
+    }else if (strcmp(argv[i], "--expect-frames") == 0 && i + 1 < argc){
+      expect_frames = strtol(argv[++i], nullptr, 0);
+    }else if (argv[i][0] != '-' && path == nullptr){
+      path = argv[i];
+    }else{
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == nullptr){
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE * f = fopen(path, "rb");
+  if (f == nullptr){
+    fprintf(stderr, "Failed to read %s\n", path);
+    return 2;
+  }
+  std::vector<uint8_t> content;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    content.insert(content.end(), chunk, chunk + n);
+  fclose(f);
+
+  OUTPUT o = {};
+  o.out = out_path != nullptr ? fopen(out_path, "w") : stdout;
+  if (o.out == nullptr){
+    fprintf(stderr, "Failed to write %s\n", out_path);
+    return 2;
+  }
+  fprintf(o.out, "# Decoded by navien_recording from %s\n", path);
+
+  NavienRecordingReader reader;
+  auto sink = [&o](const NAVIEN_REC_FRAME & frame){ emit(o, frame); };
+  size_t gaps = 0;
+
+  static const char MARK[] = "NAVREC ";
+  content.push_back(0);
+  const char * text = reinterpret_cast<const char *>(content.data());
+  if (strstr(text, MARK) == nullptr){
+    reader.feed(content.data(), content.size() - 1, sink);
+  }else{
+    bool started = false;
+    uint32_t expected = 0;
+    for (const char * line = strstr(text, MARK); line != nullptr; line = strstr(line, MARK)){
+      line += sizeof(MARK) - 1;
+      char * end;
+      uint32_t pos = strtoul(line, &end, 16);
+      if (end == line)
+        continue;
+      if (started && pos != expected){
+        fprintf(o.out, "# %u bytes of records lost\n", (unsigned) (pos - expected));
+        reader.reset();
+        o.last_valid = false;
+        gaps++;
+      }
+      started = true;
+      uint8_t bytes[128];
+      uint16_t count = 0;
+      for (const char * p = end; count < sizeof(bytes); p += 2){
+        while (*p == ' ')
+          p++;
+        int hi = hex_digit(p[0]);
+        int lo = hi < 0 ? -1 : hex_digit(p[1]);
+        if (lo < 0)
+          break;
+        bytes[count++] = hi << 4 | lo;
+      }
+      reader.feed(bytes, count, sink);
+      expected = pos + count;
+      line = end;
+    }
+  }
+  if (o.out != stdout)
+    fclose(o.out);
+
+  fprintf(stderr, "%zu packets, %zu rejected, %zu transmitted, %u undecodable deltas, %u corrupt records, %zu gaps\n",
+          o.frames, o.rejected, o.tx, (unsigned) reader.undecodable(), (unsigned) reader.corrupt(), gaps);
+
+  if (expect_frames >= 0 && o.frames != (size_t) expect_frames){
+    fprintf(stderr, "Expected %ld packets, decoded %zu\n", expect_frames, o.frames);
+    return 1;
+  }
+  return reader.corrupt() ? 1 : 0;
+}
@@ -0,0 +1,415 @@
+/**
+ * navien_replay.cpp
+ *
+ * Host side replay driver for NavienLink. Feeds a recorded RS485 byte stream
+ * through NavienLink::receive() via a file backed NavienUartI and reports
+ * what was decoded along with the cost of decoding it:
+ *   - frames/sec the parser sustains
+ *   - CPU time per frame
+ *   - heap allocations made by the link, the decoding and the change detection of the
+ *     published values while replaying
+ *   - valid frame yield when the capture is corrupted with injected noise
+ *   - per source status cadence and jitter
+ *   - how much room the traffic takes in NavienFrameRecorder (navien_recorder.h)
+ *
+ * The link runs on a simulated clock that advances by the wire time of every
+ * released byte (19200 baud) and by the idle gaps marked in .hex captures.
+ *
+ * Usage:
+ *   navien_replay [-v] [--chunk N] [--loops N] [--noise N] [--skip-unchanged] [--expect-frames N]
+ *                 [--expect-min-yield PCT] [--expect-no-allocs] [--record FILE] <capture>
+ *
+ *   -v                 print every decoded frame
+ *   --chunk N          bytes released to the link per receive() call (default 32)
+ *   --loops N          replay the capture N times, useful for benchmarking (default 1)
+ *   --noise N          corrupt one random byte in every N bytes of the capture and
+ *                      report how many of the clean frames are still decoded
+ *   --skip-unchanged   let the link drop status frames identical to the previous one of
+ *                      their unit and kind, as on the device (off by default, so every
+ *                      frame is decoded and timed)
+ *   --expect-frames N  exit with non-zero status unless exactly N status frames
+ *                      are decoded per loop (used by ctest)
+ *   --expect-min-yield PCT
+ *                      with --noise, exit with non-zero status if fewer than PCT percent
+ *                      of the clean frames are decoded (used by ctest)
+ *   --expect-no-allocs exit with non-zero status if anything is allocated after the
+ *                      first loop, which warms up (used by ctest)
+ *   --record FILE      record the traffic as the device does and write the records to
+ *                      FILE, for navien_recording to decode
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include "navien_decode.h"
+#include "navien_hal.h"
+#include "navien_link.h"
+#include "navien_metrics.h"
+#include "navien_recorder.h"
+#include "navien_uart_file.h"
+
+using namespace esphome::navien;
+
+/**
+ * Global allocation counters. Every operator new in the process goes through here,
+ * so the numbers below are exactly what NavienLink and the decoding allocate during
+ * the replay.
+ */
+static size_t alloc_count = 0;
+static size_t alloc_bytes = 0;
+
+void * operator new(size_t size){
+  alloc_count++;
+  alloc_bytes += size;
+  void * p = malloc(size ? size : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void * p) noexcept { free(p); }
+void operator delete(void * p, size_t) noexcept { free(p); }
+
+/**
+ * Simulated clock the link reads through navien_micros()
+ */
+static uint32_t sim_us = 0;
+static uint32_t sim_micros(){ return sim_us; }
+
+/**
+ * Interval statistics of water packets from one source
+ */
+typedef struct{
+  size_t   count;
+  uint32_t last_us;
+  double   sum;
+  double   sum_sq;
+} CADENCE;
+
+/**
+ * What Navien does with a status packet of a unit: decode it, then decide which of
+ * the values changed and take the text of the changed ones
+ */
+typedef struct{
+  NAVIEN_STATE            state;
+  NavienMetricRegistry<8> metrics;
+} UNIT;
+
+// What the units publish, a typical configuration
+static const NAVIEN_METRIC_ID UNIT_METRICS[] = {
+  METRIC_OUTLET_TEMP, METRIC_WATER_FLOW, METRIC_OPERATING_STATE, METRIC_HEATING_MODE,
+  METRIC_RECIRC_MODE, METRIC_GAS_TOTAL, METRIC_DEVICE_TYPE, METRIC_CONTROLLER_VERSION
+};
+
+class ReplayVisitor : public NavienLinkVisitorI {
+public:
+  void on_water(const HEADER & hdr, const WATER_DATA & water) override {
+    uint8_t src = hdr.src;
+    this->water_cnt++;
+    this->track(src);
+    if (UNIT * u = this->unit(src)){
+      NavienDecoder::decode_water(hdr, water, u->state);
+      this->publish(*u, METRIC_FROM_WATER);
+    }
+    if (this->verbose)
+      printf("%10u..%10u WATER SRC:0x%02X set:0x%02X out:0x%02X in:0x%02X flow:0x%02X power:0x%02X\n",
+             (unsigned) this->time().first_byte_us, (unsigned) this->time().last_byte_us,
+             src, water.dhw_set_temp, water.outlet_temp, water.inlet_temp, water.water_flow, water.system_power);
+  }
+
+  void on_gas(const HEADER & hdr, const GAS_DATA & gas) override {
+    uint8_t src = hdr.src;
+    this->gas_cnt++;
+    if (UNIT * u = this->unit(src)){
+      NavienDecoder::decode_gas(gas, u->state);
+      this->publish(*u, METRIC_FROM_GAS);
+    }
+    if (this->verbose)
+      printf("%10u..%10u GAS   SRC:0x%02X set:0x%02X out:0x%02X in:0x%02X gas:0x%02X%02X type:0x%02X\n",
+             (unsigned) this->time().first_byte_us, (unsigned) this->time().last_byte_us,
+             src, gas.dhw_set_temp, gas.outlet_temp, gas.inlet_temp, gas.current_gas_hi, gas.current_gas_lo, gas.device_type);
+  }
+
+  void print_cadence() const {
+    for (int i = 0; i < 16; i++){
+      const CADENCE & c = this->cadence[i];
+      if (c.count < 2)
+        continue;
+      size_t n = c.count - 1;
+      double mean = c.sum / n;
+      double jitter = sqrt(std::max(0.0, c.sum_sq / n - mean * mean));
+      printf("cadence SRC:0x%02X: %.1f ms, jitter %.1f ms (%zu intervals)\n",
+             PACKET_SRC_STATUS + i, mean / 1e3, jitter / 1e3, n);
+    }
+  }
+
+protected:
+  const NAVIEN_FRAME_TIME & time() const { return this->link->get_frame_time(); }
+
+  UNIT * unit(uint8_t src){
+    if (src < PACKET_SRC_STATUS || src >= PACKET_SRC_STATUS + 16)
+      return nullptr;
+    return &this->units[src - PACKET_SRC_STATUS];
+  }
+
+  void publish(UNIT & u, uint8_t source){
+    if (u.metrics.size() == 0){
+      for (NAVIEN_METRIC_ID id : UNIT_METRICS)
+        u.metrics.add(id, nullptr);
+    }
+    NAVIEN_METRIC_INPUT in = {};
+    in.state = &u.state;
+    in.source = source;
+    u.metrics.publish(in, this->time().last_byte_us / 1000, HEARTBEAT_MS,
+      [this](NAVIEN_METRIC &, const NAVIEN_METRIC_DEF & def, const NAVIEN_METRIC_VALUE & value){
+        this->published++;
+        if (def.kind == METRIC_TEXT)
+          this->text_bytes += strlen(value.text);
+      });
+  }
+
+  static const uint32_t HEARTBEAT_MS = 60000;
+
+  void track(uint8_t src){
+    if (src < PACKET_SRC_STATUS || src >= PACKET_SRC_STATUS + 16)
+      return;
+    CADENCE & c = this->cadence[src - PACKET_SRC_STATUS];
+    uint32_t now = this->time().first_byte_us;
+    if (c.count){
+      double interval = now - c.last_us;
+      c.sum += interval;
+      c.sum_sq += interval * interval;
+    }
+    c.last_us = now;
+    c.count++;
+  }
+
+  void on_error() override {
+    this->error_cnt++;
+    if (this->verbose)
+      printf("ERROR\n");
+  }
+
+public:
+  NavienLink * link = nullptr;
+  CADENCE cadence[16] = {};
+  UNIT   units[16] = {};
+  size_t published = 0;
+  size_t text_bytes = 0;
+  bool   verbose = false;
+  size_t water_cnt = 0;
+  size_t gas_cnt = 0;
+  size_t error_cnt = 0;
+};
+
+/**
+ * Runs the whole capture through the link once
+ * @return number of receive() calls made
+ */
+static size_t replay(NavienUartFile & uart, NavienLink & link, size_t chunk){
+  size_t calls = 0;
+  uart.rewind();
+  while (!uart.eof()){
+    uint32_t gap = uart.take_gap();
+    if (gap){
+      // Let the link see the quiet line
+      sim_us += gap;
+      link.receive();
+      calls++;
+    }
+    sim_us += uart.release(chunk) * NavienLink::BYTE_TIME_US;
+    int pending = uart.available();
+    link.receive();
+    calls++;
+    // receive() leaves an incomplete frame in the UART until more bytes arrive.
+    // Once the whole capture is released there is nothing more to wait for.
+    if (uart.all_released() && uart.available() == pending)
+      break;
+  }
+  return calls;
+}
+
+static void usage(const char * prog){
+  fprintf(stderr, "Usage: %s [-v] [--chunk N] [--loops N] [--noise N] [--skip-unchanged] [--expect-frames N]"
+                  " [--expect-min-yield PCT] [--expect-no-allocs] [--record FILE] <capture>\n", prog);
+}
+
+int main(int argc, char * argv[]){
+  const char * path = nullptr;
+  bool   verbose = false;
+  size_t chunk = 32;
+  size_t loops = 1;
+  size_t noise = 0;
+  long   expect_frames = -1;
+  double expect_min_yield = -1;
+  bool   skip_unchanged = false;
+  bool   expect_no_allocs = false;
+  const char * record_path = nullptr;
+
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "-v") == 0){
+      verbose = true;
+    }else if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc){
+      chunk = strtoul(argv[++i], nullptr, 0);
+    }else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc){
+      loops = strtoul(argv[++i], nullptr, 0);
+    }else if (strcmp(argv[i], "--noise") == 0 && i + 1 < argc){
+      noise = strtoul(argv[++i], nullptr, 0);
+    }else if (strcmp(argv[i], "--skip-unchanged") == 0){
+      skip_unchanged = true;
+    }else if (strcmp(argv[i], "--expect-no-allocs") == 0){
+      expect_no_allocs = true;
+    }else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+      record_path = argv[++i];
+    }else if (strcmp(argv[i], "--expect-frames") == 0 && i + 1 < argc){
+      expect_frames = strtol(argv[++i], nullptr, 0);
+    }else if (strcmp(argv[i], "--expect-min-yield") == 0 && i + 1 < argc){
+      expect_min_yield = strtod(argv[++i], nullptr);
+    }else if (argv[i][0] != '-' && path == nullptr){
+      path = argv[i];
+    }else{
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  if (path == nullptr || chunk == 0 || loops == 0 || (expect_min_yield >= 0 && !noise)){
+    usage(argv[0]);
+    return 2;
+  }
+
+  navien_host_micros = sim_micros;
+
+  NavienUartFile uart;
+  if (!uart.load(path)){
+    fprintf(stderr, "Failed to load capture %s\n", path);
+    return 2;
+  }
+
+  size_t clean_frames = 0;
+  size_t corrupted = 0;
+  if (noise){
+    // Baseline: how many frames the clean capture yields
+    ReplayVisitor clean;
+    NavienLink clean_link(&uart);
+    clean_link.set_skip_unchanged(false);
+    clean_link.add_all_sources_visitor(&clean);
+    clean.link = &clean_link;
+    replay(uart, clean_link, chunk);
+    clean_frames = clean.water_cnt + clean.gas_cnt;
+    corrupted = uart.inject_noise(noise, 1);
+  }
+
+  ReplayVisitor visitor;
+  NavienLink link(&uart);
+  link.set_skip_unchanged(skip_unchanged);
+  link.add_all_sources_visitor(&visitor);
+  visitor.link = &link;
+
+  // Allocated before counting, like the static buffer on the device
+  static uint8_t record_buffer[256 * 1024];
+  NavienFrameRecorder recorder;
+  if (record_path != nullptr){
+    recorder.begin(record_buffer, sizeof(record_buffer));
+    link.set_recorder(&recorder);
+  }
+
+  size_t allocs_before = alloc_count;
+  size_t alloc_bytes_before = alloc_bytes;
+  size_t receive_calls = 0;
+  size_t warm_allocs = alloc_count;
+
+  auto wall_start = std::chrono::steady_clock::now();
+  std::clock_t cpu_start = std::clock();
+
+  for (size_t l = 0; l < loops; l++){
+    visitor.verbose = verbose && l == 0;
+    receive_calls += replay(uart, link, chunk);
+    if (l == 0)
+      warm_allocs = alloc_count;
+  }
+
+  std::clock_t cpu_end = std::clock();
+  auto wall_end = std::chrono::steady_clock::now();
+
+  // Frames the link skipped as unchanged were still received
+  size_t frames = visitor.water_cnt + visitor.gas_cnt + link.get_stats().unchanged_hits;
+  double wall_s = std::chrono::duration<double>(wall_end - wall_start).count();
+  double cpu_s = double(cpu_end - cpu_start) / CLOCKS_PER_SEC;
+
+  printf("capture:          %s (%zu bytes)\n", path, uart.size());
+  printf("loops:            %zu\n", loops);
+  NAVIEN_LOOP_STATS loop = link.take_loop_stats();
+  printf("receive() calls:  %zu (%u drained the UART, %u skipped)\n", receive_calls,
+         (unsigned) loop.calls, (unsigned) loop.skipped);
+  printf("water frames:     %zu\n", visitor.water_cnt);
+  printf("gas frames:       %zu\n", visitor.gas_cnt);
+  printf("errors:           %zu\n", visitor.error_cnt);
+  printf("tx bytes:         %zu\n", uart.tx_bytes());
+  const NAVIEN_LINK_STATS & stats = link.get_stats();
+  printf("link packets:     %u\n", (unsigned) stats.packets);
+  printf("checksum errors:  %u\n", (unsigned) stats.checksum_errors);
+  printf("false markers:    %u\n", (unsigned) stats.false_markers);
+  printf("noise bytes:      %u\n", (unsigned) stats.noise_bytes);
+  printf("idle timeouts:    %u\n", (unsigned) stats.idle_timeouts);
+  if (skip_unchanged)
+    printf("unchanged frames: %u skipped, %u changed\n",
+           (unsigned) stats.unchanged_hits, (unsigned) stats.unchanged_misses);
+  const NAVIEN_TX_STATS & tx = link.get_tx_stats();
+  printf("tx frames:        %u (%u deferred, %u forced)\n",
+         (unsigned) tx.frames, (unsigned) tx.deferred, (unsigned) tx.forced);
+  printf("collision rate:   %.1f%%\n", link.get_collision_rate() * 100);
+  if (noise){
+    printf("corrupted bytes:  %zu per loop\n", corrupted);
+    printf("frame yield:      %zu of %zu (%.1f%%)\n", frames / loops, clean_frames,
+           clean_frames ? 100.0 * frames / loops / clean_frames : 0.0);
+  }
+  printf("wall time:        %.3f ms\n", wall_s * 1e3);
+  if (frames){
+    printf("frames/sec:       %.0f\n", wall_s > 0 ? frames / wall_s : 0.0);
+    printf("cpu per frame:    %.1f ns\n", cpu_s * 1e9 / frames);
+  }
+  visitor.print_cadence();
+  printf("published values: %zu (%zu bytes of text)\n", visitor.published, visitor.text_bytes);
+  printf("allocations:      %zu (%zu bytes), %zu after the first loop\n", alloc_count - allocs_before,
+         alloc_bytes - alloc_bytes_before, alloc_count - warm_allocs);
+
+  if (record_path != nullptr){
+    const NAVIEN_REC_STATS & rec = recorder.get_stats();
+    printf("recording:        %u records, %u frames (%u as deltas), %u bytes for %u bytes of frames\n",
+           (unsigned) rec.records, (unsigned) rec.frames, (unsigned) rec.deltas,
+           (unsigned) rec.stored_bytes, (unsigned) rec.frame_bytes);
+    FILE * f = fopen(record_path, "wb");
+    if (f == nullptr){
+      fprintf(stderr, "Failed to write %s\n", record_path);
+      return 2;
+    }
+    uint8_t chunk[4096];
+    uint32_t from;
+    for (uint32_t pos = recorder.oldest(); uint16_t n = recorder.read(pos, chunk, sizeof(chunk), from); pos = from + n)
+      fwrite(chunk, 1, n, f);
+    fclose(f);
+  }
+
+  if (expect_no_allocs && alloc_count != warm_allocs){
+    fprintf(stderr, "Expected no allocations after the first loop, made %zu\n", alloc_count - warm_allocs);
+    return 1;
+  }
+
+  if (expect_frames >= 0 && frames != (size_t) expect_frames * loops){
+    fprintf(stderr, "Expected %ld frames per loop, decoded %zu in %zu loop(s)\n", expect_frames, frames, loops);
+    return 1;
+  }
+
+  if (expect_min_yield >= 0 && 100.0 * frames < expect_min_yield * clean_frames * loops){
+    fprintf(stderr, "Expected a frame yield of at least %.1f%%, decoded %zu of %zu per loop\n",
+            expect_min_yield, frames / loops, clean_frames);
+    return 1;
+  }
+  return 0;
+}
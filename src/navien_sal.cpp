@@ -0,0 +1,673 @@
+/**
+ * navien_sal.cpp
+ *
+ * Decodes Saleae Logic 2 captures (.sal) of the RS485 line into Navien packets. The
+ * digital channels are streamed out of the capture, decoded as async serial (8N1) straight
+ * from their transitions and the bytes of all channels, merged in time order, are fed
+ * through the host build of NavienLink on a clock taken from the capture. Every packet
+ * that passes the checksum is written as a JSON line:
+ *
+ *   {"t":0.012345,"src":"0x50","dst":"0x50","dir":"status","kind":"water","len":41,"data":"F705..."}
+ *
+ * t is when the marker byte was received, in seconds from the start of the capture.
+ * Bytes with a framing error are dropped, the way a UART would, and reported as
+ *
+ *   {"t":0.012345,"channel":5,"error":"framing"}
+ *
+ * A .sal file is a zip archive holding meta.json and one digital-N.bin per channel. The
+ * layout of digital-N.bin isn't documented, what is read here is what the captures in
+ * trace/rs485 show (little endian, packed):
+ *
+ *   header   "<SALEAE>", u32 version (1), u32 type (100 digital), u8 initial level,
+ *            f64 sample rate, u64 start (unix ms), f64 fraction of a ms, 2 x u8,
+ *            u64 number of chunks
+ *   chunk    u64 first sample, u64 last sample, u64 samples, u64 sample rate, u64 (1),
+ *            u64 n, n bytes of runs, u64 m, m x {u64 sample, u64 transition, u32 level}
+ *
+ * The runs of a chunk alternate the level, starting with the level of the first index
+ * entry. Every run is one variable length number of samples minus one: the first byte
+ * holds 6 bits and bit 6 says more follow, the following ones 7 bits each, most
+ * significant first, and bit 7 says more follow.
+ *
+ * Only one chunk per channel is held in memory, so multi-hour captures decode in about
+ * the time it takes to inflate them.
+ *
+ * Usage:
+ *   navien_sal [--channel N]... [--baud N] [-o FILE] [--expect-frames N] <capture.sal | directory>
+ *
+ *   --channel N        decode channel N, may be repeated (default: the input channels of the
+ *                      Async Serial analyzers saved in the capture)
+ *   --baud N           bit rate (default 19200)
+ *   -o FILE            write the JSON lines to FILE instead of stdout
+ *   --expect-frames N  exit with non-zero status unless exactly N packets are decoded
+ *                      (used by ctest)
+ *
+ * A directory is taken to hold the digital-N.bin files (and meta.json) of an unpacked
+ * capture.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "navien_hal.h"
+#include "navien_link.h"
+
+using namespace esphome::navien;
+
+static uint16_t le16(const uint8_t * p){ return p[0] | p[1] << 8; }
+static uint32_t le32(const uint8_t * p){ return le16(p) | (uint32_t) le16(p + 2) << 16; }
+static uint64_t le64(const uint8_t * p){ return le32(p) | (uint64_t) le32(p + 4) << 32; }
+static double le_double(const uint8_t * p){
+  uint64_t bits = le64(p);
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+/**
+ * Where a member of a zip archive is stored
+ */
+typedef struct{
+  std::string name;
+  uint16_t    method;       // 0 stored, 8 deflated
+  uint64_t    comp_size;
+  uint64_t    local_offset; // of the local header
+} ZIP_ENTRY;
+
+/**
+ * Reads the central directory of a zip archive, zip64 included
+ */
+static bool zip_list(FILE * f, std::vector<ZIP_ENTRY> & entries){
+  if (fseeko(f, 0, SEEK_END) != 0)
+    return false;
+  off_t size = ftello(f);
+  // The end of central directory record is followed by a comment of up to 64 kB
+  off_t tail_len = std::min<off_t>(size, 0xFFFF + 22 + 20);
+  std::vector<uint8_t> tail(tail_len);
+  if (fseeko(f, size - tail_len, SEEK_SET) != 0 || fread(tail.data(), 1, tail_len, f) != (size_t) tail_len)
+    return false;
+
+  off_t eocd = -1;
+  for (off_t i = tail_len - 22; i >= 0; i--)
+    if (le32(&tail[i]) == 0x06054b50){
+      eocd = i;
+      break;
+    }
+  if (eocd < 0)
+    return false;
+
+  uint64_t count = le16(&tail[eocd + 10]);
+  uint64_t cd_size = le32(&tail[eocd + 12]);
+  uint64_t cd_offset = le32(&tail[eocd + 16]);
+  if (eocd >= 20 && le32(&tail[eocd - 20]) == 0x07064b50){
+    uint8_t rec[56];
+    if (fseeko(f, le64(&tail[eocd - 20 + 8]), SEEK_SET) != 0 || fread(rec, 1, sizeof(rec), f) != sizeof(rec)
+        || le32(rec) != 0x06064b50)
+      return false;
+    count = le64(rec + 32);
+    cd_size = le64(rec + 40);
+    cd_offset = le64(rec + 48);
+  }
+
+  std::vector<uint8_t> cd(cd_size);
+  if (fseeko(f, cd_offset, SEEK_SET) != 0 || fread(cd.data(), 1, cd_size, f) != cd_size)
+    return false;
+  size_t pos = 0;
+  for (uint64_t i = 0; i < count; i++){
+    if (pos + 46 > cd.size() || le32(&cd[pos]) != 0x02014b50)
+      return false;
+    const uint8_t * h = &cd[pos];
+    uint16_t name_len = le16(h + 28);
+    uint16_t extra_len = le16(h + 30);
+    uint16_t comment_len = le16(h + 32);
+    if (pos + 46 + name_len + extra_len > cd.size())
+      return false;
+    ZIP_ENTRY e;
+    e.name.assign(reinterpret_cast<const char *>(h + 46), name_len);
+    e.method = le16(h + 10);
+    e.comp_size = le32(h + 20);
+    e.local_offset = le32(h + 42);
+    uint64_t uncomp_size = le32(h + 24);
+    // Sizes that don't fit in 32 bits are in the zip64 extra field, in this order
+    for (const uint8_t * x = h + 46 + name_len; x + 4 <= h + 46 + name_len + extra_len; x += 4 + le16(x + 2)){
+      if (le16(x) != 0x0001)
+        continue;
+      const uint8_t * v = x + 4;
+      if (uncomp_size == 0xFFFFFFFF) v += 8;
+      if (e.comp_size == 0xFFFFFFFF) e.comp_size = le64(v), v += 8;
+      if (e.local_offset == 0xFFFFFFFF) e.local_offset = le64(v);
+    }
+    entries.push_back(e);
+    pos += 46 + name_len + extra_len + comment_len;
+  }
+  return true;
+}
+
+/**
+ * Sequential reader of a file, or of a member of a zip archive inflated on the fly
+ */
+class SalStream {
+public:
+  ~SalStream(){
+    if (this->inflating)
+      inflateEnd(&this->zs);
+    if (this->f != nullptr)
+      fclose(this->f);
+  }
+
+  bool open_file(const char * path){
+    this->f = fopen(path, "rb");
+    this->remaining = UINT64_MAX;
+    return this->f != nullptr;
+  }
+
+  bool open_zip(const char * path, const ZIP_ENTRY & e){
+    if (e.method != 0 && e.method != 8)
+      return false;
+    this->f = fopen(path, "rb");
+    uint8_t local[30];
+    if (this->f == nullptr || fseeko(this->f, e.local_offset, SEEK_SET) != 0
+        || fread(local, 1, sizeof(local), this->f) != sizeof(local) || le32(local) != 0x04034b50
+        || fseeko(this->f, le16(local + 26) + le16(local + 28), SEEK_CUR) != 0)
+      return false;
+    this->remaining = e.comp_size;
+    if (e.method == 8){
+      memset(&this->zs, 0, sizeof(this->zs));
+      // Raw deflate, the zip headers take the place of the zlib ones
+      if (inflateInit2(&this->zs, -MAX_WBITS) != Z_OK)
+        return false;
+      this->inflating = true;
+    }
+    return true;
+  }
+
+  size_t read(void * buf, size_t n){
+    if (!this->inflating){
+      size_t got = fread(buf, 1, std::min<uint64_t>(n, this->remaining), this->f);
+      this->remaining -= got;
+      return got;
+    }
+    this->zs.next_out = static_cast<Bytef *>(buf);
+    this->zs.avail_out = n;
+    while (this->zs.avail_out > 0 && !this->ended){
+      if (this->zs.avail_in == 0){
+        size_t got = fread(this->in, 1, std::min<uint64_t>(sizeof(this->in), this->remaining), this->f);
+        if (got == 0)
+          break;
+        this->remaining -= got;
+        this->zs.next_in = this->in;
+        this->zs.avail_in = got;
+      }
+      int r = inflate(&this->zs, Z_NO_FLUSH);
+      if (r == Z_STREAM_END)
+        this->ended = true;
+      else if (r != Z_OK)
+        break;
+    }
+    return n - this->zs.avail_out;
+  }
+
+  bool read_exact(void * buf, size_t n){ return this->read(buf, n) == n; }
+
+protected:
+  FILE *   f = nullptr;
+  uint64_t remaining = 0;
+  bool     inflating = false;
+  bool     ended = false;
+  z_stream zs;
+  uint8_t  in[65536];
+};
+
+/**
+ * A byte of async serial as a UART would receive it, times in samples of the capture
+ */
+typedef struct{
+  uint64_t start;     // falling edge of the start bit
+  uint64_t end;       // end of the stop bit, when the UART has the byte
+  uint8_t  value;
+  bool     framing_error;
+  uint8_t  channel;
+} SERIAL_BYTE;
+
+/**
+ * 8N1 receiver working off the transitions of the line: every bit is sampled in its
+ * middle, timed from the falling edge of the start bit.
+ */
+class SerialDecoder {
+public:
+  void begin(uint64_t rate, uint32_t baud, uint8_t level, uint8_t channel){
+    this->rate = rate;
+    this->baud = baud;
+    this->level = level;
+    this->channel = channel;
+  }
+
+  // The line is at `level` from sample t on
+  void run(uint64_t t, uint8_t level){
+    this->advance(t);
+    if (level == this->level)
+      return;
+    this->level = level;
+    if (!this->busy && level == 0){
+      this->busy = true;
+      this->t0 = t;
+      this->bit = 0;
+      this->value = 0;
+      this->start_ok = false;
+    }
+  }
+
+  // The capture ends at sample t
+  void finish(uint64_t t){ this->advance(t); }
+
+  std::deque<SERIAL_BYTE> out;
+
+protected:
+  // Samples every bit of the current byte that is due before sample t
+  void advance(uint64_t t){
+    while (this->busy){
+      uint64_t at = this->t0 + (2 * this->bit + 1) * this->rate / (2 * this->baud);
+      if (at >= t)
+        return;
+      if (this->bit == 0)
+        this->start_ok = this->level == 0;
+      else if (this->bit <= 8)
+        this->value |= this->level << (this->bit - 1);
+      else{
+        SERIAL_BYTE b = {this->t0, this->t0 + 10 * this->rate / this->baud, this->value,
+                         !this->start_ok || this->level == 0, this->channel};
+        this->out.push_back(b);
+        this->busy = false;
+      }
+      this->bit++;
+    }
+  }
+
+  uint64_t rate = 0;
+  uint32_t baud = 0;
+  uint8_t  channel = 0;
+  uint8_t  level = 1;
+  bool     busy = false;
+  uint64_t t0 = 0;
+  uint8_t  bit = 0;
+  uint8_t  value = 0;
+  bool     start_ok = false;
+};
+
+/**
+ * One digital channel of the capture, decoded a chunk at a time as bytes are asked for
+ */
+class SalChannel {
+public:
+  bool open(const char * path, const ZIP_ENTRY * entry, uint8_t index, uint32_t baud){
+    this->index = index;
+    if (!(entry != nullptr ? this->stream.open_zip(path, *entry) : this->stream.open_file(path)))
+      return this->fail("can't be read");
+
+    uint8_t hdr[0x33];
+    if (!this->stream.read_exact(hdr, sizeof(hdr)) || memcmp(hdr, "<SALEAE>", 8) != 0)
+      return this->fail("is not a Saleae data file");
+    if (le32(hdr + 0x0C) != 100)
+      return this->fail("is not a digital channel");
+    this->rate = (uint64_t) le_double(hdr + 0x11);
+    this->start_ms = le64(hdr + 0x19);
+    this->chunks_left = le64(hdr + 0x2B);
+    if (this->rate < 2 * baud)
+      return this->fail("is sampled too slowly for the bit rate");
+    this->decoder.begin(this->rate, baud, hdr[0x10], index);
+    return true;
+  }
+
+  // Next byte received on the channel, false at the end of the capture or on an error
+  bool next(SERIAL_BYTE & b){
+    while (this->decoder.out.empty()){
+      if (this->chunks_left == 0){
+        if (this->finished)
+          return false;
+        this->decoder.finish(this->end);
+        this->finished = true;
+        continue;
+      }
+      if (!this->decode_chunk()){
+        this->chunks_left = 0;
+        this->finished = true;
+        return false;
+      }
+    }
+    b = this->decoder.out.front();
+    this->decoder.out.pop_front();
+    if (b.framing_error)
+      this->framing_errors++;
+    else
+      this->bytes++;
+    return true;
+  }
+
+  uint8_t     index = 0;
+  uint64_t    rate = 0;
+  uint64_t    start_ms = 0;
+  uint64_t    end = 0;
+  size_t      bytes = 0;
+  size_t      framing_errors = 0;
+  const char * error = nullptr;
+
+protected:
+  bool fail(const char * why){
+    this->error = why;
+    return false;
+  }
+
+  bool decode_chunk(){
+    uint8_t hdr[48];
+    if (!this->stream.read_exact(hdr, sizeof(hdr)))
+      return this->fail("is truncated");
+    uint64_t t = le64(hdr);
+    uint64_t samples = le64(hdr + 16);
+    uint64_t len = le64(hdr + 40);
+    this->data.resize(len);
+    uint8_t count[8];
+    if (!this->stream.read_exact(this->data.data(), len) || !this->stream.read_exact(count, sizeof(count)))
+      return this->fail("is truncated");
+    this->index_entries.resize(le64(count) * 20);
+    if (!this->stream.read_exact(this->index_entries.data(), this->index_entries.size()))
+      return this->fail("is truncated");
+    this->chunks_left--;
+
+    uint8_t level = this->index_entries.empty() ? this->last_level : le32(&this->index_entries[16]) & 1;
+    uint64_t first = t;
+    for (size_t i = 0; i < len; ){
+      uint8_t b = this->data[i++];
+      if (b & 0x80)
+        return this->fail("uses an unknown encoding of the transitions");
+      uint64_t run = b & 0x3F;
+      for (bool more = b & 0x40; more && i < len; ){
+        b = this->data[i++];
+        run = run << 7 | (b & 0x7F);
+        more = b & 0x80;
+      }
+      this->decoder.run(t, level);
+      this->last_level = level;
+      t += run + 1;
+      level ^= 1;
+    }
+    if (t - first != samples)
+      return this->fail("has a chunk whose transitions don't add up");
+    this->end = t;
+    return true;
+  }
+
+  SalStream            stream;
+  SerialDecoder        decoder;
+  uint64_t             chunks_left = 0;
+  bool                 finished = false;
+  uint8_t              last_level = 1;
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> index_entries;
+};
+
+/**
+ * The RS485 line as NavienLink sees it: the merged bytes, released one by one
+ */
+class SalUart : public NavienUartI {
+public:
+  int available() override { return this->rx.size(); }
+
+  uint8_t peek_byte(uint8_t * byte) override {
+    if (this->rx.empty())
+      return 0;
+    *byte = this->rx.front();
+    return 1;
+  }
+
+  uint8_t read_byte(uint8_t * byte) override {
+    if (!this->peek_byte(byte))
+      return 0;
+    this->rx.pop_front();
+    return 1;
+  }
+
+  bool read_array(uint8_t * data, uint8_t len) override {
+    if (this->rx.size() < len)
+      return false;
+    for (uint8_t i = 0; i < len; i++){
+      data[i] = this->rx.front();
+      this->rx.pop_front();
+    }
+    return true;
+  }
+
+  // Nothing is ever transmitted onto a capture
+  void write_array(const uint8_t *, uint8_t len) override { this->tx_bytes += len; }
+
+  std::deque<uint8_t> rx;
+  size_t tx_bytes = 0;
+};
+
+/**
+ * Clock of the link, microseconds since the start of the capture. NavienLink takes the
+ * low 32 bits, which wrap after 71 minutes, and only looks at differences of them.
+ */
+static uint64_t sim_us = 0;
+static uint32_t sim_micros(){ return (uint32_t) sim_us; }
+
+class JsonVisitor : public NavienLinkVisitorI {
+public:
+  void on_water(const HEADER &, const WATER_DATA &) override {}
+  void on_gas(const HEADER &, const GAS_DATA &) override {}
+  void on_error() override {}
+
+  void on_packet(const uint8_t * data, uint16_t len) override {
+    const HEADER * hdr = reinterpret_cast<const HEADER *>(data);
+    const char * dir = "control";
+    const char * kind = "control";
+    if (hdr->direction == PACKET_DIR_STATUS){
+      dir = "status";
+      kind = hdr->dst == PACKET_DST_WATER ? "water" : hdr->dst == PACKET_DST_GAS ? "gas" : "other";
+    }
+    // Back from the 64 bit clock to when the marker byte arrived
+    uint64_t t = sim_us - (uint32_t) ((uint32_t) sim_us - this->link->get_frame_time().first_byte_us);
+    fprintf(this->out, "{\"t\":%llu.%06u,\"src\":\"0x%02X\",\"dst\":\"0x%02X\",\"dir\":\"%s\",\"kind\":\"%s\",\"len\":%u,\"data\":\"",
+            (unsigned long long) (t / 1000000), (unsigned) (t % 1000000), hdr->src, hdr->dst, dir, kind, (unsigned) len);
+    for (uint16_t i = 0; i < len; i++)
+      fprintf(this->out, "%02X", data[i]);
+    fprintf(this->out, "\"}\n");
+    this->packets++;
+  }
+
+  NavienLink * link = nullptr;
+  FILE *       out = stdout;
+  size_t       packets = 0;
+};
+
+/**
+ * The input channels of the Async Serial analyzers saved in meta.json
+ */
+static void analyzer_channels(const std::string & meta, std::vector<uint8_t> & channels){
+  static const char KEY[] = "\"Input Channel\"";
+  static const char VALUE[] = "\"value\":";
+  for (size_t pos = meta.find(KEY); pos != std::string::npos; pos = meta.find(KEY, pos + 1)){
+    size_t v = meta.find(VALUE, pos);
+    if (v == std::string::npos)
+      break;
+    long ch = strtol(meta.c_str() + v + sizeof(VALUE) - 1, nullptr, 10);
+    if (ch >= 0 && ch < 256)
+      channels.push_back(ch);
+  }
+}
+
+static void usage(const char * prog){
+  fprintf(stderr, "Usage: %s [--channel N]... [--baud N] [-o FILE] [--expect-frames N] <capture.sal | directory>\n", prog);
+}
+
+int main(int argc, char * argv[]){
+  const char * path = nullptr;
+  const char * out_path = nullptr;
+  std::vector<uint8_t> channels;
+  uint32_t baud = 19200;
+  long expect_frames = -1;
+
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--channel") == 0 && i + 1 < argc){
+      channels.push_back(strtoul(argv[++i], nullptr, 0));
+    }else if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc){
+      baud = strtoul(argv[++i], nullptr, 0);
+    }else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+      out_path = argv[++i];
+    }else if (strcmp(argv[i], "--expect-frames") == 0 && i + 1 < argc){
+      expect_frames = strtol(argv[++i], nullptr, 0);
+    }else if (argv[i][0] != '-' && path == nullptr){
+      path = argv[i];
+    }else{
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == nullptr || baud == 0){
+    usage(argv[0]);
+    return 2;
+  }
+
+  // A capture file, or the directory it was unpacked to
+  std::vector<ZIP_ENTRY> entries;
+  bool archive = false;
+  if (FILE * f = fopen(path, "rb")){
+    archive = zip_list(f, entries);
+    fclose(f);
+  }
+  auto find_entry = [&entries](const std::string & name) -> const ZIP_ENTRY * {
+    for (const ZIP_ENTRY & e : entries)
+      if (e.name == name)
+        return &e;
+    return nullptr;
+  };
+  auto member_path = [path](const std::string & name){ return std::string(path) + "/" + name; };
+
+  if (channels.empty()){
+    SalStream meta_stream;
+    const ZIP_ENTRY * meta = find_entry("meta.json");
+    if (archive ? meta != nullptr && meta_stream.open_zip(path, *meta) : meta_stream.open_file(member_path("meta.json").c_str())){
+      std::string meta_json;
+      char buf[4096];
+      while (size_t n = meta_stream.read(buf, sizeof(buf)))
+        meta_json.append(buf, n);
+      analyzer_channels(meta_json, channels);
+    }
+    if (channels.empty()){
+      fprintf(stderr, "%s names no Async Serial channels, pick them with --channel\n", path);
+      return 2;
+    }
+  }
+
+  std::deque<SalChannel> inputs;
+  for (uint8_t ch : channels){
+    std::string name = "digital-" + std::to_string(ch) + ".bin";
+    const ZIP_ENTRY * entry = archive ? find_entry(name) : nullptr;
+    if (archive && entry == nullptr){
+      fprintf(stderr, "%s has no channel %u\n", path, (unsigned) ch);
+      return 2;
+    }
+    inputs.emplace_back();
+    if (!inputs.back().open(archive ? path : member_path(name).c_str(), entry, ch, baud)){
+      fprintf(stderr, "Channel %u of %s %s\n", (unsigned) ch, path, inputs.back().error);
+      return 2;
+    }
+  }
+
+  FILE * out = out_path != nullptr ? fopen(out_path, "w") : stdout;
+  if (out == nullptr){
+    fprintf(stderr, "Failed to write %s\n", out_path);
+    return 2;
+  }
+
+  navien_host_micros = sim_micros;
+  SalUart uart;
+  NavienLink link(&uart);
+  // Bytes are released as they arrive, the marker byte is timed exactly
+  link.set_rx_threshold(1);
+  link.set_listen_only(true);
+  JsonVisitor visitor;
+  visitor.link = &link;
+  visitor.out = out;
+  link.add_all_sources_visitor(&visitor);
+
+  // While the line is quiet receive() is called as often as the component's loop would,
+  // until the idle timeout has dropped whatever incomplete packet there was
+  const uint64_t POLL_US = NavienLink::DEFAULT_IDLE_TIMEOUT_US / 2;
+  const uint64_t POLL_MAX = 8;
+
+  auto wall_start = std::chrono::steady_clock::now();
+  std::vector<SERIAL_BYTE> next(inputs.size());
+  std::vector<bool> has_next(inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++)
+    has_next[i] = inputs[i].next(next[i]);
+
+  uint64_t last_us = 0;
+  for (;;){
+    // The earliest byte of all channels goes on the line first
+    size_t pick = inputs.size();
+    for (size_t i = 0; i < inputs.size(); i++)
+      if (has_next[i] && (pick == inputs.size() || next[i].end < next[pick].end))
+        pick = i;
+    if (pick == inputs.size())
+      break;
+    SERIAL_BYTE b = next[pick];
+    has_next[pick] = inputs[pick].next(next[pick]);
+
+    const SalChannel & ch = inputs[pick];
+    uint64_t now = b.end * 1000000 / ch.rate;
+    for (uint64_t t = last_us + POLL_US; t < now && t <= last_us + POLL_MAX * POLL_US; t += POLL_US){
+      sim_us = t;
+      link.receive();
+    }
+    sim_us = last_us = now;
+    if (b.framing_error){
+      uint64_t start = b.start * 1000000 / ch.rate;
+      fprintf(out, "{\"t\":%llu.%06u,\"channel\":%u,\"error\":\"framing\"}\n",
+              (unsigned long long) (start / 1000000), (unsigned) (start % 1000000), (unsigned) b.channel);
+      continue;
+    }
+    uart.rx.push_back(b.value);
+    link.receive();
+  }
+  // Let the link give up on an incomplete packet at the end
+  for (uint64_t i = 0; i < POLL_MAX; i++){
+    sim_us += POLL_US;
+    link.receive();
+  }
+  double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  if (out != stdout)
+    fclose(out);
+
+  int status = 0;
+  uint64_t capture_us = 0;
+  for (const SalChannel & ch : inputs){
+    if (ch.error != nullptr){
+      fprintf(stderr, "Channel %u of %s %s\n", (unsigned) ch.index, path, ch.error);
+      status = 1;
+    }
+    capture_us = std::max(capture_us, ch.end * 1000000 / ch.rate);
+    fprintf(stderr, "channel %u: %zu bytes, %zu framing errors\n", (unsigned) ch.index, ch.bytes, ch.framing_errors);
+  }
+  const NAVIEN_LINK_STATS & stats = link.get_stats();
+  fprintf(stderr, "%zu packets, %u checksum errors, %u false markers, %u noise bytes, %u idle timeouts\n",
+          visitor.packets, (unsigned) stats.checksum_errors, (unsigned) stats.false_markers,
+          (unsigned) stats.noise_bytes, (unsigned) stats.idle_timeouts);
+  if (!inputs.empty())
+    fprintf(stderr, "capture started at %llu ms (unix), %.3f s decoded in %.3f s (%.0fx real time)\n",
+            (unsigned long long) inputs.front().start_ms, capture_us / 1e6, wall_s,
+            wall_s > 0 ? capture_us / 1e6 / wall_s : 0.0);
+
+  if (expect_frames >= 0 && visitor.packets != (size_t) expect_frames){
+    fprintf(stderr, "Expected %ld packets, decoded %zu\n", expect_frames, visitor.packets);
+    return 1;
+  }
+  return status;
+}
@@ -0,0 +1,63 @@
+/**
+ * navien_test.h
+ *
+ * Shared by the host tests: the CHECK harness and status packets of the main unit
+ * (src 0x50) from trace/replay/sample_exchange.hex to feed the link with.
+ * Header only, so tests that don't link navien_link can use it too.
+ *
+ * A test counts failed checks with CHECK() and ends main() with
+ * `return test_result();`, which exits with 1 on any failure.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+
+#include "navien_checksum.h"
+#include "navien_proto.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/**
+ * Reports the outcome of the checks and returns the exit status of the test
+ */
+static inline int test_result(){
+  if (failures){
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
+
+namespace esphome {
+namespace navien {
+
+// Water packet, power on, set temp 0x56
+static const uint8_t WATER_PACKET[] = {
+  0xF7, 0x05, 0x50, 0x50, 0x90, 0x22, 0x42, 0x00, 0x00, 0x25, 0x14, 0x56, 0x49, 0x49, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x88, 0xC2, 0x00, 0x20, 0x02, 0x00, 0x00, 0x00, 0x21, 0x03, 0x99, 0x08,
+  0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x65
+};
+
+// Gas packet
+static const uint8_t GAS_PACKET[] = {
+  0xF7, 0x05, 0x50, 0x0F, 0x90, 0x2A, 0x45, 0x00, 0x01, 0x01, 0x14, 0x03, 0x1F, 0x00, 0x56, 0x56,
+  0x48, 0x00, 0x00, 0x00, 0x14, 0x01, 0x74, 0x13, 0x0B, 0x44, 0x00, 0x00, 0x9D, 0x07, 0x60, 0x20,
+  0x4B, 0x3B, 0x20, 0x00, 0x21, 0x03, 0x00, 0x00, 0x00, 0x00, 0xA6, 0x49, 0x00, 0x00, 0x01, 0x00,
+  0x36
+};
+
+/**
+ * Recomputes the trailing checksum of a status packet of the main unit after its
+ * bytes were changed
+ */
+static inline void seal_packet(uint8_t * packet, uint8_t len){
+  packet[len - 1] = NavienChecksum::compute(packet, len - 1, CHECKSUM_SEED_4B);
+}
+
+}  // namespace navien
+}  // namespace esphome
@@ -0,0 +1,205 @@
+/**
+ * navien_uart_file.h
+ *
+ * File backed implementation of NavienUartI for the host build of NavienLink.
+ * The whole capture is loaded in memory and then released to NavienLink in chunks,
+ * which mimics bytes trickling in through the UART between loop() calls.
+ *
+ * Two capture formats are understood:
+ *   - raw binary byte stream (any file name)
+ *   - hex text (*.hex): whitespace/comma separated bytes, '#' starts a comment,
+ *     "+N" marks N microseconds of idle line before the next byte
+ */
+
+#pragma once
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "navien_link.h"
+
+namespace esphome {
+namespace navien {
+
+class NavienUartFile : public NavienUartI {
+public:
+  /**
+   * Loads the capture file into memory.
+   * @param path - path to the capture
+   * @return true on success, false if the file can't be read or parsed
+   */
+  bool load(const char * path){
+    FILE * f = fopen(path, "rb");
+    if (f == nullptr)
+      return false;
+
+    std::vector<uint8_t> content;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+      content.insert(content.end(), chunk, chunk + n);
+    fclose(f);
+
+    size_t path_len = strlen(path);
+    if (path_len > 4 && strcmp(path + path_len - 4, ".hex") == 0)
+      return parse_hex(content);
+
+    this->data.swap(content);
+    this->rewind();
+    return true;
+  }
+
+  /**
+   * Makes up to n more bytes of the capture visible through available()/read_*().
+   * Never releases past an idle gap, see take_gap().
+   * @return number of bytes released
+   */
+  size_t release(size_t n){
+    size_t limit = this->data.size();
+    for (const GAP & g : this->gaps)
+      if (g.offset > this->released){
+        limit = std::min(limit, g.offset);
+        break;
+      }
+    size_t before = this->released;
+    this->released = std::min(this->released + n, limit);
+    return this->released - before;
+  }
+
+  /**
+   * If everything up to an idle gap has been released, returns the gap duration in
+   * microseconds (once), otherwise 0.
+   */
+  uint32_t take_gap(){
+    for (GAP & g : this->gaps)
+      if (g.offset == this->released && !g.taken){
+        g.taken = true;
+        return g.us;
+      }
+    return 0;
+  }
+
+  /**
+   * Corrupts one randomly chosen byte in every block of the given size, to measure how
+   * the parser copes with a noisy line. Deterministic for a given seed.
+   * @return number of corrupted bytes
+   */
+  size_t inject_noise(size_t every, unsigned seed){
+    size_t corrupted = 0;
+    srand(seed);
+    for (size_t block = 0; every > 0 && block + every <= this->data.size(); block += every){
+      this->data[block + rand() % every] ^= 1 + rand() % 255;
+      corrupted++;
+    }
+    return corrupted;
+  }
+
+  /**
+   * Start over from the beginning of the capture, nothing released.
+   */
+  void rewind(){
+    this->pos = 0;
+    this->released = 0;
+    for (GAP & g : this->gaps)
+      g.taken = false;
+  }
+
+  bool eof() const { return this->pos >= this->data.size(); }
+  bool all_released() const { return this->released >= this->data.size(); }
+  size_t size() const { return this->data.size(); }
+  size_t tx_bytes() const { return this->tx_count; }
+
+public:
+  /**
+   * NavienUartI interface implementation
+   */
+  int available() override { return this->released - this->pos; }
+
+  uint8_t peek_byte(uint8_t * byte) override {
+    if (this->pos >= this->released)
+      return 0;
+    *byte = this->data[this->pos];
+    return 1;
+  }
+
+  uint8_t read_byte(uint8_t * byte) override {
+    if (!this->peek_byte(byte))
+      return 0;
+    this->pos++;
+    return 1;
+  }
+
+  bool read_array(uint8_t * out, uint8_t len) override {
+    if (this->released - this->pos < len)
+      return false;
+    memcpy(out, &this->data[this->pos], len);
+    this->pos += len;
+    return true;
+  }
+
+  void write_array(const uint8_t * /* out */, uint8_t len) override {
+    this->tx_count += len;
+  }
+
+protected:
+  bool parse_hex(const std::vector<uint8_t> & text){
+    std::vector<uint8_t> bytes;
+    size_t i = 0;
+    while (i < text.size()){
+      char c = text[i];
+      if (c == '#'){
+        while (i < text.size() && text[i] != '\n')
+          i++;
+        continue;
+      }
+      if (isspace(c) || c == ','){
+        i++;
+        continue;
+      }
+      if (c == '+'){
+        GAP g = {bytes.size(), 0, false};
+        while (++i < text.size() && isdigit(text[i]))
+          g.us = g.us * 10 + (text[i] - '0');
+        this->gaps.push_back(g);
+        continue;
+      }
+      if (c == '0' && i + 1 < text.size() && (text[i + 1] == 'x' || text[i + 1] == 'X'))
+        i += 2;
+
+      unsigned value = 0;
+      size_t digits = 0;
+      while (i < text.size() && isxdigit(text[i]) && digits < 2){
+        char d = text[i++];
+        value = value * 16 + (isdigit(d) ? d - '0' : (tolower(d) - 'a' + 10));
+        digits++;
+      }
+      if (digits == 0){
+        fprintf(stderr, "Unexpected character '%c' at offset %zu\n", c, i);
+        return false;
+      }
+      bytes.push_back(value);
+    }
+    this->data.swap(bytes);
+    this->rewind();
+    return true;
+  }
+
+protected:
+  typedef struct{
+    size_t   offset;  // the gap precedes the byte at this offset
+    uint32_t us;
+    bool     taken;
+  } GAP;
+
+  std::vector<uint8_t> data;
+  std::vector<GAP> gaps;
+  size_t pos = 0;
+  size_t released = 0;
+  size_t tx_count = 0;
+};
+
+}  // namespace navien
+}  // namespace esphome
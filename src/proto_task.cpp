@@ -0,0 +1,235 @@
+/**
+ * proto_task.cpp
+ *
+ * Host test of the hand over between the protocol task and the main loop
+ * (esphome/components/navien/navien_task.h), with std::thread standing in for the ESP32 task:
+ *  - a reader of NavienSeqlock never sees a torn copy while the writer keeps writing,
+ *  - NavienEventRing delivers every event in order from one thread to another,
+ *  - NavienLink runs in its own thread, decodes into a snapshot and reports events while the
+ *    main thread reads the snapshot and posts a command.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#include "navien_link.h"
+#include "navien_task.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+/**
+ * Every word holds the same value, a torn read shows up as a mismatch
+ */
+typedef struct{
+  uint32_t words[32];
+} SAMPLE;
+
+static void test_seqlock(){
+  const uint32_t WRITES = 200000;
+  NavienSeqlock<SAMPLE> lock;
+
+  std::thread writer([&lock, WRITES]{
+    SAMPLE s;
+    for (uint32_t i = 1; i <= WRITES; i++){
+      for (uint32_t & w : s.words)
+        w = i;
+      lock.write(s);
+    }
+  });
+
+  bool consistent = true, monotonic = true;
+  uint32_t last = 0, reads = 0, retries = 0;
+  while (last < WRITES){
+    SAMPLE s;
+    retries += lock.read(s);
+    reads++;
+    for (uint32_t w : s.words)
+      consistent &= w == s.words[0];
+    monotonic &= s.words[0] >= last;
+    last = s.words[0];
+  }
+  writer.join();
+
+  CHECK(consistent);
+  CHECK(monotonic);
+  CHECK(lock.version() == WRITES);
+  printf("seqlock: %u reads, %u retries\n", (unsigned) reads, (unsigned) retries);
+}
+
+static void test_event_ring(){
+  const uint32_t EVENTS = 100000;
+  NavienEventRing<NAVIEN_FRAME_EVENT, 16> ring;
+
+  std::thread producer([&ring, EVENTS]{
+    NAVIEN_FRAME_EVENT event = {};
+    for (uint32_t i = 0; i < EVENTS; i++){
+      event.version = i;
+      while (!ring.push(event))
+        std::this_thread::yield();
+    }
+  });
+
+  bool in_order = true;
+  NAVIEN_FRAME_EVENT event;
+  for (uint32_t i = 0; i < EVENTS; ){
+    if (!ring.pop(event)){
+      std::this_thread::yield();
+      continue;
+    }
+    in_order &= event.version == i;
+    i++;
+  }
+  producer.join();
+
+  CHECK(in_order);
+  CHECK(!ring.pop(event));
+}
+
+/**
+ * UART the main thread appends packets to while the protocol thread reads them
+ */
+class ThreadUart : public NavienUartI {
+public:
+  int available() override { return __atomic_load_n(&this->len, __ATOMIC_ACQUIRE) - this->pos; }
+
+  uint8_t peek_byte(uint8_t * byte) override {
+    if (this->available() <= 0)
+      return 0;
+    *byte = this->data[this->pos];
+    return 1;
+  }
+
+  uint8_t read_byte(uint8_t * byte) override {
+    if (!this->peek_byte(byte))
+      return 0;
+    this->pos++;
+    return 1;
+  }
+
+  bool read_array(uint8_t * out, uint8_t n) override {
+    if (this->available() < n)
+      return false;
+    memcpy(out, &this->data[this->pos], n);
+    this->pos += n;
+    return true;
+  }
+
+  void write_array(const uint8_t * out, uint8_t n) override {
+    if (n == CONTROL_CMD_LEN && out[HDR_SIZE] == CONTROL_CMD_TYPE && out[CONTROL_CMD_TEMP])
+      __atomic_store_n(&this->sent_temp, out[CONTROL_CMD_TEMP], __ATOMIC_RELEASE);
+  }
+
+  // Main thread
+  void append(const uint8_t * bytes, uint8_t n){
+    uint32_t l = __atomic_load_n(&this->len, __ATOMIC_RELAXED);
+    memcpy(&this->data[l], bytes, n);
+    __atomic_store_n(&this->len, l + n, __ATOMIC_RELEASE);
+  }
+
+  uint8_t  data[16384];
+  uint32_t len = 0;
+  uint32_t pos = 0;       // protocol thread only
+  uint8_t  sent_temp = 0; // raw setpoint of the last 0x4F frame written
+};
+
+/**
+ * What the protocol thread decodes, the inlet temperature always equals the setpoint
+ * in the packets of this test
+ */
+typedef struct{
+  uint32_t water_packets;
+  float    dhw_set_temp;
+  float    inlet_temp;
+} DECODED;
+
+class TaskVisitor : public NavienLinkVisitorI {
+public:
+  void on_water(const HEADER & hdr, const WATER_DATA & water) override {
+    this->decoded.water_packets++;
+    this->decoded.dhw_set_temp = NavienLink::t2c(water.dhw_set_temp);
+    this->decoded.inlet_temp = NavienLink::t2c(water.inlet_temp);
+    this->snapshot.write(this->decoded);
+    NAVIEN_FRAME_EVENT event = {};
+    event.type = FRAME_EVENT_WATER;
+    event.src = hdr.src;
+    event.version = this->snapshot.version();
+    this->events.push(event);
+  }
+  void on_gas(const HEADER &, const GAS_DATA &) override {}
+  void on_error() override {}
+
+  DECODED decoded = {};
+  NavienSeqlock<DECODED> snapshot;
+  NavienEventRing<NAVIEN_FRAME_EVENT, 16> events;
+};
+
+static void test_link_task(){
+  const uint32_t PACKETS = 200;
+  ThreadUart uart;
+  NavienLink link(&uart);
+  TaskVisitor visitor;
+  link.add_visitor(&visitor);
+
+  bool stop = false;
+  std::thread task([&link, &stop]{
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)){
+      link.receive();
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+  });
+
+  bool consistent = true, in_order = true;
+  uint32_t events = 0, last_version = 0;
+  auto drain = [&]{
+    NAVIEN_FRAME_EVENT event;
+    while (visitor.events.pop(event)){
+      in_order &= event.version > last_version;
+      last_version = event.version;
+      events++;
+      DECODED d;
+      visitor.snapshot.read(d);
+      consistent &= d.dhw_set_temp == d.inlet_temp;
+    }
+  };
+
+  uint8_t packet[sizeof(WATER_PACKET)];
+  memcpy(packet, WATER_PACKET, sizeof(packet));
+  for (uint32_t i = 0; i < PACKETS; i++){
+    uint8_t t = 0x50 + i % 32;
+    packet[HDR_SIZE + offsetof(WATER_DATA, dhw_set_temp)] = t;
+    packet[HDR_SIZE + offsetof(WATER_DATA, inlet_temp)] = t;
+    seal_packet(packet, sizeof(packet));
+    uart.append(packet, sizeof(packet));
+    if (i == PACKETS / 2)
+      link.send_dhw_set_temp_cmd(45);
+    std::this_thread::sleep_for(std::chrono::microseconds(500));
+    drain();
+  }
+
+  // Let the protocol thread catch up
+  for (int i = 0; i < 1000 && visitor.snapshot.version() < PACKETS; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+  task.join();
+  drain();
+
+  DECODED d;
+  visitor.snapshot.read(d);
+  CHECK(d.water_packets == PACKETS);
+  CHECK(consistent);
+  CHECK(in_order);
+  CHECK(events + visitor.events.dropped() == PACKETS);
+  CHECK(__atomic_load_n(&uart.sent_temp, __ATOMIC_ACQUIRE) == 90);
+}
+
+int main(){
+  test_seqlock();
+  test_event_ring();
+  test_link_task();
+  return test_result();
+}
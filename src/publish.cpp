@@ -0,0 +1,68 @@
+/**
+ * publish.cpp
+ *
+ * Host test of the change detection Navien publishes through
+ * (esphome/components/navien/navien_publish.h):
+ *  - the first value is always published, an unchanged one only after the heartbeat,
+ *  - changes within the deadband are held back, measured from the last published value
+ *    so a slow drift still gets through,
+ *  - NAN (published on communication errors) counts as a change both ways,
+ *  - hashed values (text, climate state) are published when the hash changes.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#include "navien_publish.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+static const uint32_t HEARTBEAT_MS = 60000;
+
+static void test_deadband(){
+  NavienPublishFilter f;
+  f.deadband = 0.5f;
+  CHECK(f.due(40.0f, 0, HEARTBEAT_MS));
+  CHECK(!f.due(40.0f, 5000, HEARTBEAT_MS));
+  CHECK(!f.due(40.5f, 10000, HEARTBEAT_MS));
+  // 40.5 was not published, the drift adds up against 40.0
+  CHECK(f.due(41.0f, 15000, HEARTBEAT_MS));
+  CHECK(!f.due(40.5f, 20000, HEARTBEAT_MS));
+
+  // Heartbeat, counted from the last publish
+  CHECK(!f.due(41.0f, 15000 + HEARTBEAT_MS - 1, HEARTBEAT_MS));
+  CHECK(f.due(41.0f, 15000 + HEARTBEAT_MS, HEARTBEAT_MS));
+  CHECK(!f.due(41.0f, 15000 + 2 * HEARTBEAT_MS - 1, HEARTBEAT_MS));
+
+  // No heartbeat
+  CHECK(!f.due(41.0f, 1000000, 0));
+}
+
+static void test_nan(){
+  NavienPublishFilter f;
+  CHECK(f.due(20.0f, 0, HEARTBEAT_MS));
+  CHECK(f.due(NAN, 1000, HEARTBEAT_MS));
+  CHECK(!f.due(NAN, 2000, HEARTBEAT_MS));
+  CHECK(f.due(20.0f, 3000, HEARTBEAT_MS));
+
+  f.reset();
+  CHECK(f.due(20.0f, 4000, HEARTBEAT_MS));
+}
+
+static void test_hash(){
+  NavienPublishFilter f;
+  CHECK(f.due_hash(NavienPublishFilter::hash("1.2"), 0, HEARTBEAT_MS));
+  CHECK(!f.due_hash(NavienPublishFilter::hash("1.2"), 1000, HEARTBEAT_MS));
+  CHECK(f.due_hash(NavienPublishFilter::hash("1.3"), 2000, HEARTBEAT_MS));
+  CHECK(NavienPublishFilter::hash("1.3") == NavienPublishFilter::hash("1.3", 3));
+}
+
+int main(){
+  test_deadband();
+  test_nan();
+  test_hash();
+  return test_result();
+}
@@ -0,0 +1,150 @@
+/**
+ * recorder.cpp
+ *
+ * Host test of NavienFrameRecorder and NavienRecordingReader
+ * (esphome/components/navien/navien_recorder.h): delta size of repeated packets, keyframes,
+ * eviction of the oldest records and reading across it, and frames decoding back to what
+ * was recorded.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "navien_recorder.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+typedef struct{
+  uint32_t frames;
+  uint32_t rejected;
+  uint32_t tx;
+  uint32_t mismatches;
+  uint32_t last_ms;
+  uint8_t  last_temp;
+} RESULT;
+
+// Decode everything between the oldest record and the end
+static void read_back(const NavienFrameRecorder & rec, NavienRecordingReader & reader, RESULT & r){
+  uint8_t chunk[37];  // records split anywhere
+  uint32_t from;
+  uint16_t n;
+  for (uint32_t pos = rec.oldest(); (n = rec.read(pos, chunk, sizeof(chunk), from)) > 0; pos = from + n){
+    reader.feed(chunk, n, [&r](const NAVIEN_REC_FRAME & f){
+      if (f.type == REC_FULL || f.type == REC_DELTA){
+        r.frames++;
+        r.last_ms = f.time_ms;
+        r.last_temp = f.bytes[12];
+        uint8_t expected[sizeof(WATER_PACKET)];
+        memcpy(expected, WATER_PACKET, sizeof(expected));
+        expected[12] = f.bytes[12];
+        if (f.len != sizeof(expected) || memcmp(f.bytes, expected, f.len) != 0)
+          r.mismatches++;
+      }else if (f.type == REC_REJECTED){
+        r.rejected++;
+      }else if (f.type == REC_TX){
+        r.tx++;
+      }
+    });
+  }
+}
+
+static void test_delta(){
+  uint8_t out[64];
+  uint8_t frame[sizeof(WATER_PACKET)];
+  memcpy(frame, WATER_PACKET, sizeof(frame));
+  CHECK(NavienFrameRecorder::delta(WATER_PACKET, frame, sizeof(frame), out, sizeof(frame)) == 0);
+
+  // One byte changed, and one 30 bytes further: skip runs of 15
+  frame[12] = 0x4A;
+  frame[40] = 0x66;
+  uint16_t n = NavienFrameRecorder::delta(WATER_PACKET, frame, sizeof(frame), out, sizeof(frame));
+  CHECK(n == 5);
+  CHECK(out[0] == (12 << 4 | 1) && out[1] == 0x4A);
+  CHECK(out[2] == 0xF0 && out[3] == (12 << 4 | 1) && out[4] == 0x66);
+
+  // Not worth it
+  for (uint8_t & b : frame)
+    b = ~b;
+  CHECK(NavienFrameRecorder::delta(WATER_PACKET, frame, sizeof(frame), out, sizeof(frame)) == sizeof(frame));
+}
+
+static void test_round_trip(){
+  static uint8_t ring[4096];
+  NavienFrameRecorder rec;
+  rec.begin(ring, sizeof(ring));
+
+  uint8_t frame[sizeof(WATER_PACKET)];
+  memcpy(frame, WATER_PACKET, sizeof(frame));
+  uint32_t now = 1000;
+  for (int i = 0; i < 40; i++){
+    frame[12] = 0x49 + i % 2;
+    rec.on_frame(frame, sizeof(frame), now);
+    now += 250000;
+  }
+  rec.on_rejected(WATER_PACKET, 10, REJECT_CHECKSUM, now);
+  rec.on_tx(WATER_PACKET, sizeof(WATER_PACKET), now);
+
+  const NAVIEN_REC_STATS & stats = rec.get_stats();
+  CHECK(stats.frames == 40);
+  // One keyframe every KEYFRAME_FRAMES + 1 packets
+  CHECK(stats.deltas == 38);
+  CHECK(stats.evicted == 0);
+  // A delta with one byte changed takes len, dt (2 bytes for 250 ms), type and a run of 2
+  CHECK(stats.stored_bytes < stats.frame_bytes / 3);
+
+  NavienRecordingReader reader;
+  RESULT r = {};
+  read_back(rec, reader, r);
+  CHECK(r.frames == 40);
+  CHECK(r.mismatches == 0);
+  CHECK(r.rejected == 1 && r.tx == 1);
+  CHECK(r.last_ms == 39 * 250);
+  CHECK(r.last_temp == 0x4A);
+  CHECK(reader.undecodable() == 0 && reader.corrupt() == 0);
+}
+
+static void test_eviction(){
+  static uint8_t ring[512];
+  NavienFrameRecorder rec;
+  rec.begin(ring, sizeof(ring));
+
+  uint8_t frame[sizeof(WATER_PACKET)];
+  memcpy(frame, WATER_PACKET, sizeof(frame));
+  uint32_t now = 0;
+  for (int i = 0; i < 500; i++){
+    frame[12] = 0x40 + i % 16;
+    rec.on_frame(frame, sizeof(frame), now);
+    now += 100000;
+  }
+  CHECK(rec.get_stats().evicted > 0);
+  CHECK(rec.end() - rec.oldest() <= rec.capacity());
+
+  // A position already overwritten reads from the oldest record
+  uint8_t chunk[16];
+  uint32_t from;
+  CHECK(rec.read(0, chunk, sizeof(chunk), from) == sizeof(chunk));
+  CHECK(from == rec.oldest());
+  CHECK(rec.read(rec.end(), chunk, sizeof(chunk), from) == 0);
+
+  // Deltas of packets stored in full before the oldest record don't decode, the rest do
+  NavienRecordingReader reader;
+  RESULT r = {};
+  read_back(rec, reader, r);
+  CHECK(r.frames > 0);
+  CHECK(r.mismatches == 0);
+  CHECK(r.last_temp == 0x40 + 499 % 16);
+  CHECK(r.frames + reader.undecodable() <= 500);
+  CHECK(reader.undecodable() <= NavienFrameRecorder::KEYFRAME_FRAMES);
+  CHECK(reader.corrupt() == 0);
+}
+
+int main(){
+  test_delta();
+  test_round_trip();
+  test_eviction();
+
+  return test_result();
+}
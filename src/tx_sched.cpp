@@ -0,0 +1,167 @@
+/**
+ * tx_sched.cpp
+ *
+ * Host test of the NavienLink transmit scheduler (esphome/components/navien/navien_tx_sched.h),
+ * driven with a synthetic heater cadence: water and gas packets of the main unit, each followed
+ * by a fixed idle window.
+ *  - nothing is known at first, so the first opportunities are allowed,
+ *  - once the windows are learned a frame only goes out if it fits in what is left of them,
+ *  - line errors after a transmission count as a collision and cause a backoff,
+ *  - packets that came in one UART read teach nothing, and a single short gap doesn't
+ *    close a window,
+ *  - average command wait is reported.
+ *
+ * Exits with 1 on any failure.
+ */
+
+#include <stdio.h>
+
+#include "navien_tx_sched.h"
+#include "navien_test.h"
+
+using namespace esphome::navien;
+
+static const HEADER WATER = {PACKET_MARKER, 0x05, PACKET_SRC_STATUS, PACKET_DST_WATER, PACKET_DIR_STATUS, 0x22};
+static const HEADER GAS   = {PACKET_MARKER, 0x05, PACKET_SRC_STATUS, PACKET_DST_GAS, PACKET_DIR_STATUS, 0x2A};
+static const HEADER OTHER_CONTROLLER = {PACKET_MARKER, 0x05, PACKET_SRC_CONTROL, PACKET_DST_WATER, PACKET_DIR_CONTROL, 0x0C};
+
+static const uint32_t BYTE_US = NavienTxScheduler::BYTE_TIME_US;
+// Idle time the heater leaves after its water and gas packets
+static const uint32_t WATER_GAP_US = 30 * BYTE_US;
+static const uint32_t GAS_GAP_US = 100000;
+static const uint8_t  FRAME_LEN = 19;
+
+static uint32_t now_us = 0;
+
+/**
+ * A packet of hdr.len body bytes arrives, followed by idle time. Returns its last byte time.
+ */
+static uint32_t packet(NavienTxScheduler & s, const HEADER & hdr, uint32_t errors = 0, bool timed = true){
+  uint32_t first = now_us;
+  now_us += (HDR_SIZE + hdr.len + 1) * BYTE_US;
+  s.on_packet(hdr, first, now_us - BYTE_US, errors, timed);
+  return now_us - BYTE_US;
+}
+
+static void test_windows(){
+  NavienTxScheduler s;
+  now_us = 1000;
+
+  // Nothing is known about the windows yet
+  packet(s, WATER);
+  CHECK(s.clear_to_send(now_us + 1000000, FRAME_LEN));
+  now_us += WATER_GAP_US;
+
+  // Learn without transmitting
+  packet(s, GAS);
+  now_us += GAS_GAP_US;
+  for (int i = 0; i < 4; i++){
+    packet(s, WATER);
+    now_us += WATER_GAP_US;
+    packet(s, GAS);
+    now_us += GAS_GAP_US;
+  }
+  CHECK(s.gap_us(NavienTxScheduler::slot_key(WATER)) == WATER_GAP_US + BYTE_US);
+  CHECK(s.gap_us(NavienTxScheduler::slot_key(GAS)) == GAS_GAP_US + BYTE_US);
+
+  // A 19 byte frame plus guard doesn't fit in 30 byte times if we're 15 byte times late
+  packet(s, WATER);
+  CHECK(!s.clear_to_send(now_us + 15 * BYTE_US, FRAME_LEN));
+  CHECK(s.clear_to_send(now_us, FRAME_LEN));
+  s.on_transmit(now_us, FRAME_LEN, 0);
+  s.on_cmd_sent(now_us, now_us - 2000);
+  now_us += WATER_GAP_US;
+
+  // Clean line until the next packet - no collision
+  packet(s, GAS);
+  CHECK(s.get_stats().collisions == 0);
+  CHECK(s.clear_to_send(now_us + 50000, FRAME_LEN));
+  s.on_transmit(now_us + 50000, FRAME_LEN, 0);
+  s.on_cmd_sent(now_us + 50000, now_us + 46000);
+  now_us += GAS_GAP_US;
+
+  CHECK(s.get_stats().frames == 2);
+  CHECK(s.get_stats().collisions == 0);
+  CHECK(s.get_stats().deferred == 1);
+  CHECK(s.avg_cmd_wait_us() == 3000);
+}
+
+static void test_collision_backoff(){
+  NavienTxScheduler s;
+  now_us = 1000;
+  for (int i = 0; i < 4; i++){
+    packet(s, WATER);
+    now_us += WATER_GAP_US;
+    packet(s, GAS);
+    now_us += GAS_GAP_US;
+  }
+
+  // Another controller's frame starts while ours is still on the wire
+  packet(s, GAS);
+  CHECK(s.clear_to_send(now_us, FRAME_LEN));
+  s.on_transmit(now_us, FRAME_LEN, 0);
+  now_us += 5 * BYTE_US;
+  packet(s, OTHER_CONTROLLER);
+  CHECK(s.get_stats().collisions == 1);
+
+  // Backing off for 1..2 opportunities
+  uint32_t skipped = 0;
+  for (int i = 0; i < 4; i++){
+    now_us += GAS_GAP_US;
+    packet(s, GAS);
+    if (!s.clear_to_send(now_us, FRAME_LEN))
+      skipped++;
+  }
+  CHECK(skipped >= 1 && skipped <= 2);
+  CHECK(s.get_stats().backoffs == skipped);
+
+  // Errors on the line after our frame are a collision too
+  now_us += GAS_GAP_US;
+  packet(s, GAS);
+  CHECK(s.clear_to_send(now_us, FRAME_LEN));
+  s.on_transmit(now_us, FRAME_LEN, 0);
+  now_us += GAS_GAP_US;
+  packet(s, WATER, 3);
+  CHECK(s.get_stats().collisions == 2);
+  CHECK(s.collision_rate() > 0.99f);
+}
+
+static void test_gap_samples(){
+  NavienTxScheduler s;
+  now_us = 1000;
+  for (int i = 0; i < 4; i++){
+    packet(s, WATER);
+    now_us += GAS_GAP_US;
+  }
+  const uint8_t key = NavienTxScheduler::slot_key(WATER);
+  CHECK(s.gap_us(key) == GAS_GAP_US + BYTE_US);
+
+  // Read together with the previous packet, both look back to back
+  packet(s, WATER, 0, false);
+  now_us += GAS_GAP_US;
+  CHECK(s.gap_us(key) == GAS_GAP_US + BYTE_US);
+
+  // One short gap is not trusted, the window still takes a frame
+  packet(s, WATER);
+  now_us += BYTE_US;
+  packet(s, WATER);
+  CHECK(s.gap_us(key) == GAS_GAP_US + BYTE_US);
+  CHECK(s.clear_to_send(now_us, FRAME_LEN));
+  now_us += GAS_GAP_US;
+
+  // Two in a row are, the window shrinks to the longer of them
+  packet(s, WATER);
+  now_us += WATER_GAP_US;
+  packet(s, WATER);
+  now_us += 20 * BYTE_US;
+  packet(s, WATER);
+  CHECK(s.gap_us(key) == WATER_GAP_US + BYTE_US);
+  CHECK(s.get_stats().deferred == 0);
+}
+
+int main(){
+  test_windows();
+  test_collision_backoff();
+  test_gap_samples();
+  return test_result();
+}